@@ -17,8 +17,8 @@
 #cmakedefine TCLSCRIPTDIR "@TCLSCRIPTDIR@"
 /* TCLTHEORA library path */
 #cmakedefine TCLTHEORA_LIBS @TCLTHEORA_LIBS@
-/* Are we building with threads enabled?  (Not necessarily implemented) */
-#cmakedefine TCL_THREADS
+/* Always build with threads enabled (needed for background decoding) */
+#define TCL_THREADS 1
 /* Use Tcl stubs  (Not necessarily implemented) */
 #cmakedefine USE_TCL_STUBS
 /* Use Tk stubs (Not necessarily implemented) */
@@ -24,28 +24,15 @@ proc make_gui {w} {
 	return [list $w $i];
 }
 
-proc do_loop {t p fn fd {lastms 0}} {
-	# calculate frame delay (warning! susceptible to accumulated drift!);
-	if {[$t next $p]!=0} {
-		set ms [clock milliseconds];
-		set dt [expr {$ms-$lastms}];
-		set delay [expr {int($fd*1000.0/$fn)}];
-		if {$delay-$dt<0} {
-			$t next $p; # immediately draw this frame;
-			puts stderr $dt;
-			after $delay [list do_loop $t $p $fn $fd $ms];
-		} else {
-			after [expr {$delay-$dt}] [list do_loop $t $p $fn $fd $ms];
-		}
-	}
-}
-
 lassign [make_gui .] w photo;
 set t [theora new [lindex $argv 0]];
 puts "Theora object $t created.";
+# decode a few frames ahead on a background thread;
+$t configure -prefetch 4;
 lassign [$t frameRate] fn fd;
 puts "Theora object $t frameRate = $fn/$fd.";
-#do_loop $t $photo $fn $fd;
+# to watch it in real time instead (see also $t playStats);
+#$t play $photo -command exit; vwait forever;
 set ms [clock milliseconds];
 set dtsum 0;
 set nframes 0;
@@ -0,0 +1,474 @@
+/*
+ * This file is part of MVTH - the Machine Vision Test Harness.
+ *
+ * Internal declarations shared by the pieces of the tcltheora package.
+ *
+ * Copyright (C) 2011 Samuel P. Bromley <sam@sambromley.com>
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License Version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (see the file named "COPYING"), and a copy of the GNU Lesser General
+ * Public License (see the file named "COPYING.LESSER") along with MVTH.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef TCLTHEORA_H
+#define TCLTHEORA_H
+
+#include <stdio.h>
+#include <tcl.h>
+#include <tk.h>
+#include <ogg/ogg.h>
+#include <theora/theoradec.h>
+
+enum {TCLTHEORA_MAX_NUM_STREAMS=16};
+
+enum {STREAM_TYPE_UNKNOWN=0, STREAM_TYPE_THEORA=1, STREAM_TYPE_OTHER=2};
+
+typedef struct theoraDecode_s {
+	th_info mInfo;
+	th_comment mComment;
+	th_setup_info *mSetup;
+	th_dec_ctx *mCtx;
+} theoraDecode_t;
+
+/* a packet of a video stream, copied out of its ogg stream */
+typedef struct queuedPacket_s {
+	ogg_packet packet; /* packet.packet is our own copy */
+	ogg_int64_t frame; /* the frame it decodes to, -1 until known */
+} queuedPacket;
+
+/* Packets of one of the other video streams, waiting for "nextAll"
+ * (see tcltheora_multi.c). It always starts at a keyframe, and while the
+ * stream is not being decoded only the packets since its last keyframe
+ * are kept. */
+typedef struct packetQueue_s {
+	queuedPacket *entries;
+	int count;
+	int alloc;
+	int keyframe; /* a keyframe has come in since the stream was reset */
+	ogg_int64_t next_frame; /* frame of the next packet to come in, or -1 */
+} packetQueue;
+
+typedef struct oggStream_s {
+	int mSerial;
+	ogg_stream_state mState;
+	int stream_type;
+	int active; /* keep its packets for decoding (always so for streams[0]) */
+	int mPacketCount;
+	theoraDecode_t mTheora;
+	packetQueue queue; /* (video streams after the first) */
+} oggStream;
+
+/* a converted frame waiting to be shown */
+typedef struct readyFrame_s {
+	unsigned char *pixels; /* packed RGBA, width*height*4 bytes */
+	int width;
+	int height;
+	ogg_int64_t granulepos;
+} readyFrame;
+
+/* single producer, single consumer ring of converted frames.
+ * The decode thread only ever advances tail, the Tcl thread only head. */
+typedef struct frameRing_s {
+	readyFrame *slots;
+	unsigned int size;  /* number of allocated slots */
+	unsigned int limit; /* the producer keeps at most this many ready */
+	unsigned int head;  /* next slot to be consumed */
+	unsigned int tail;  /* next slot to be filled */
+} frameRing;
+
+/* a video page with a known granule position */
+typedef struct seekEntry_s {
+	ogg_int64_t offset; /* where the page starts in the file */
+	ogg_int64_t granulepos;
+} seekEntry;
+
+/* every video page we have come across, sorted by offset */
+typedef struct seekIndex_s {
+	seekEntry *entries;
+	int count;
+	int alloc; /* 0 if entries point into a mapped index file */
+	void *map; /* the mapped index file, if any */
+	size_t map_len;
+	int dirty; /* something was added since it was loaded or saved */
+} seekIndex;
+
+/* the real-time quality governor (see "configure -realtime") */
+typedef struct governorState_s {
+	int realtime; /* trade quality for keeping up with the frame rate */
+	int pp_target; /* post-processing level asked for with -pplevel */
+	int pp_level; /* level the decoder is using now */
+	int pp_max; /* highest level the decoder supports */
+	int drop; /* frames decoded but not shown for each frame shown */
+	int hold; /* frames to wait before changing anything again */
+	long frames_dropped;
+	double decode_cost; /* smoothed seconds to decode one frame */
+	double convert_cost; /* smoothed seconds to convert one frame */
+} governorState;
+
+/* decodes one of the video streams for "nextAll" */
+typedef struct streamWorker_s {
+	struct tcltheora_object_s *tto;
+	oggStream *stream;
+	Tcl_ThreadId thread;
+	int running; /* has a thread (streams[0] is done by the caller) */
+	packetQueue batch; /* the packets to decode this round */
+	int got_frame;
+	readyFrame frame;
+} streamWorker;
+
+/* where the time goes (see "stats") */
+enum {STATS_BUCKETS=32};
+enum {STATS_PAGE, STATS_PACKETIN, STATS_YCBCR_OUT, STATS_CONVERT, STATS_UPLOAD,
+	STATS_NTIMERS};
+
+typedef struct statsTimer_s {
+	ogg_uint64_t calls;
+	ogg_uint64_t ns;
+	ogg_uint64_t hist[STATS_BUCKETS]; /* [i] counts calls taking < 2^i ns */
+} statsTimer;
+
+/* updated from whichever thread does the work, with relaxed atomics */
+typedef struct perfStats_s {
+	ogg_uint64_t bytes; /* in the pages read */
+	ogg_uint64_t pages;
+	ogg_uint64_t frames; /* decoded */
+	ogg_uint64_t dropped; /* decoded but never shown */
+	ogg_uint64_t dups; /* duplicate frames (empty packets) */
+	statsTimer timers[STATS_NTIMERS];
+} perfStats;
+
+/* a decoded frame kept for "frame" (see tcltheora_cache.c) */
+typedef struct cachedFrame_s {
+	ogg_int64_t frame;
+	ogg_int64_t granulepos;
+	ogg_int64_t bytes;
+	th_ycbcr_buffer buffer; /* the planes follow the struct */
+	struct cachedFrame_s *newer;
+	struct cachedFrame_s *older;
+} cachedFrame;
+
+typedef struct frameCache_s {
+	Tcl_HashTable frames; /* frame number -> cachedFrame */
+	cachedFrame *newest;
+	cachedFrame *oldest;
+	ogg_int64_t budget; /* bytes it may hold ("configure -cacheSize") */
+	ogg_int64_t bytes;
+	ogg_int64_t hits;
+	ogg_int64_t misses;
+	ogg_int64_t resume; /* the frame "next" carries on from, or -1 */
+	int reseek; /* ... which the decoder is not positioned for yet */
+	/* decoding the group of pictures before the cached ones (see "prev") */
+	Tcl_ThreadId reverse_thread;
+	int reverse_running;
+	ogg_int64_t reverse_target; /* the last frame of that group */
+	int collecting; /* decoded frames go to pending, not the cache */
+	ogg_int64_t group_start; /* keyframe the last seek decoded from */
+	cachedFrame *pending; /* newest first, linked by older (and newer) */
+	cachedFrame *pending_oldest;
+	ogg_int64_t pending_bytes;
+	/* what the thread decoded, kept for "prev" outside the budget */
+	cachedFrame *held; /* newest first, like pending */
+	cachedFrame *held_oldest;
+	ogg_int64_t shown_gp; /* granulepos while the thread has the decoder */
+} frameCache;
+
+/* a band of rows to convert (see tcltheora_pool.c) */
+typedef struct convertJob_s {
+	perfStats *stats;
+	th_info *info;
+	th_ycbcr_buffer buffer;
+	int y; /* first picture row */
+	int h;
+	Tk_PhotoImageBlock dst; /* positioned at row y */
+} convertJob;
+
+enum {CONVERT_POOL_MAX_THREADS=64, CONVERT_POOL_QUEUE=256};
+
+/* threads that convert bands of a frame in parallel ("configure -threads") */
+typedef struct convertPool_s {
+	int nthreads; /* including the thread that submits the work */
+	int nhelpers; /* pool threads actually running */
+	Tcl_ThreadId helpers[CONVERT_POOL_MAX_THREADS];
+	Tcl_Mutex lock;
+	Tcl_Condition work; /* jobs were queued, or stop was set */
+	Tcl_Condition idle; /* pending dropped to 0 */
+	convertJob queue[CONVERT_POOL_QUEUE];
+	unsigned int head; /* next job to take */
+	unsigned int tail; /* next free queue slot */
+	int pending; /* queued or running */
+	int stop;
+} convertPool;
+
+/* where the stripe callback puts rows as the decoder finishes them */
+typedef struct stripeTarget_s {
+	Tk_PhotoImageBlock *dst; /* the whole picture, NULL when not converting */
+	Tcl_Interp *interp;
+	Tk_PhotoHandle photo; /* if not NULL, each stripe is uploaded here too */
+	int rows_done; /* picture rows converted for this frame so far */
+	double convert_time; /* seconds spent converting them */
+	ogg_uint64_t callback_ns; /* in the callback, ever (see "stats") */
+} stripeTarget;
+
+/* how "next" converts a frame, when it is not the whole picture at full size */
+typedef struct frameFormat_s {
+	int shift; /* scale down by 2^shift ("-scale") */
+	int box; /* average the samples rather than pick them ("-filter box") */
+	int crop; /* only the rectangle x,y,w,h of the picture ("-crop") */
+	int x;
+	int y;
+	int w;
+	int h;
+	int gray; /* just the Y' plane, one byte per pixel ("-gray") */
+} frameFormat;
+
+/* a "next photo -command script" in progress (see tcltheora_async.c) */
+typedef struct asyncRequest_s {
+	struct tcltheora_object_s *tto;
+	Tcl_Interp *interp;
+	Tcl_ThreadId owner; /* the interpreter's thread, where the event goes */
+	int running; /* handed to the decode thread, not waited for yet */
+	int waiting; /* (channels) waiting for more data to come in */
+	Tcl_Obj *photo; /* name of the photo to put the frame in */
+	Tcl_Obj *command; /* called with the frame number and time */
+	frameFormat format;
+	readyFrame frame;
+	int status; /* 1 got a frame, 0 end of the stream */
+	ogg_int64_t number; /* frame number */
+	double time; /* and its presentation time, in seconds */
+} asyncRequest;
+
+/* playing the clip in real time from the event loop (see "play") */
+typedef struct playerState_s {
+	int playing;
+	int paused;
+	Tcl_Interp *interp;
+	Tcl_Obj *photo; /* name of the photo to show the frames in */
+	Tcl_Obj *command; /* run when the end of the clip is reached */
+	Tcl_TimerToken timer;
+	double rate; /* 1.0 is normal speed ("configure -rate") */
+	double wall0; /* the presentation clock: media time media0 was... */
+	double media0; /* ...due at monotonic time wall0 (both in seconds) */
+	double paused_at; /* media time we were paused at */
+	ogg_int64_t expected; /* next frame, unless someone else moved us */
+	long shown; /* frames shown */
+	long dropped; /* frames skipped because we were late */
+	long late; /* frames shown more than half a frame late */
+	long stalls; /* times a channel had no frame for us */
+	int stalled; /* ...and it still has not */
+	double jitter_sum; /* sum of |shown - due|, seconds */
+	double late_max; /* worst lateness, seconds */
+} playerState;
+
+typedef struct tcltheora_object_s {
+	FILE *fp; /* handle to Ogg Theora file */
+	Tcl_Channel channel; /* or the channel we read from instead */
+	Tcl_Interp *interp; /* that the channel belongs to */
+	Tcl_Obj *readable_cmd; /* run when more channel data has come in */
+	int channel_watched; /* a channel handler is installed */
+	int channel_paused; /* ... but not while the backlog is this big */
+	int input_blocked; /* the last read found no data yet (channels only) */
+	char *filename; /* name it was opened with */
+	int quiet; /* say nothing on stderr about damaged input ("scan") */
+	ogg_sync_state *sync_state; /* ogg file state */
+	int headers_read;
+	int bos_done; /* (while reading headers) the streams' first pages are in */
+	char *header_error; /* why a channel's headers could not be read */
+	/* reads on into the headers as channel data comes in (this is
+	 * read_stream_headers(), but input.c is also built without it) */
+	int (*headers_proc) (struct tcltheora_object_s *tto, char **msg);
+	ogg_page *page; /* ogg file page */
+	int num_streams; /* number of allocated streams in this file */
+	oggStream *streams[TCLTHEORA_MAX_NUM_STREAMS];
+	ogg_int64_t granulepos; /* granule position of the last frame shown */
+	ogg_int64_t sync_offset; /* file offset of the next byte for ogg_sync */
+	ogg_int64_t page_offset; /* file offset of the current page */
+	ogg_int64_t data_offset; /* file offset of the first video data page */
+	ogg_int64_t rewind_offset; /* file offset just past the header pages */
+	unsigned char *map; /* the whole file, if it could be mapped */
+	ogg_int64_t map_len; /* how much of it can be read */
+	ogg_int64_t map_size; /* how much was mapped */
+	ogg_int64_t map_advised; /* readahead has been asked for up to here */
+	seekIndex index; /* pages seen so far (see "seek") */
+	/* background decoding (see "configure -prefetch") */
+	int prefetch; /* requested number of frames to decode ahead */
+	frameRing ring;
+	frameFormat ring_format; /* how the worker converts the frames */
+	Tcl_ThreadId worker;
+	int worker_running; /* a worker thread has been started */
+	int worker_stop; /* ask the worker to finish */
+	int worker_done; /* the worker has reached the end of the file */
+	Tcl_Mutex worker_lock; /* only used to sleep/wake on worker_cond */
+	Tcl_Condition worker_cond;
+	governorState governor;
+	stripeTarget stripe;
+	convertPool pool;
+	/* decoding every video stream in parallel (see "nextAll") */
+	streamWorker *multi; /* one per video stream, NULL until first used */
+	int multi_count;
+	unsigned int multi_gen; /* bumped to hand out a round of packets */
+	int multi_busy; /* workers still decoding this round */
+	int multi_stop;
+	Tcl_Mutex multi_lock;
+	Tcl_Condition multi_cond;
+	Tcl_Obj *yuv_planes[3]; /* handed out by "nextYUV", reused when unshared */
+	readyFrame formatted; /* the last frame "next -scale" converted */
+	/* "next photo -command" */
+	asyncRequest *async; /* the request still decoding, if any */
+	readyFrame async_spare; /* pixels of the last delivered frame, for reuse */
+	Tcl_ThreadId async_thread; /* decodes the requests, started on first use */
+	int async_running; /* async_thread has been started */
+	int async_stop; /* ask it to finish */
+	asyncRequest *async_job; /* the request it is on, NULL when idle */
+	Tcl_Mutex async_lock;
+	Tcl_Condition async_cond;
+	playerState player;
+	perfStats stats;
+	frameCache cache;
+} TclTheoraObject;
+
+/* tcltheora_Init.c */
+TclTheoraObject *theora_object_alloc (void);
+void theora_destroy_func (void *ptr);
+int read_stream_headers (TclTheoraObject *tto, char **msg);
+int initialize_theora_stream (Tcl_Interp *interp, TclTheoraObject *tto);
+void theora_free_resources (TclTheoraObject *tto);
+int get_next_page (TclTheoraObject *tto);
+void route_page (TclTheoraObject *tto);
+int next_stream_packet (TclTheoraObject *tto, oggStream *stream,
+		ogg_packet *packet);
+int decode_next_packet (TclTheoraObject *tto, ogg_int64_t *granulepos);
+int decode_next_frame (TclTheoraObject *tto, th_ycbcr_buffer buffer,
+		ogg_int64_t *granulepos);
+int frame_format_is_full (frameFormat *fmt);
+void frame_format_block (frameFormat *fmt, readyFrame *frame,
+		Tk_PhotoImageBlock *block);
+int frame_format_crop (Tcl_Interp *interp, TclTheoraObject *tto, Tcl_Obj *rect,
+		frameFormat *fmt);
+int decode_next_frame_format (TclTheoraObject *tto, frameFormat *fmt,
+		readyFrame *frame, ogg_int64_t *granulepos);
+int skip_frames (TclTheoraObject *tto, Tcl_Interp *interp, int n);
+int show_next_frame (TclTheoraObject *tto, Tcl_Interp *interp,
+		Tk_PhotoHandle photo, frameFormat *fmt);
+Tcl_Obj *yuv_frame_obj (th_info *info, th_img_plane *planes, Tcl_Obj **data,
+		int nplanes, int pic_x, int pic_y, int pic_w, int pic_h);
+
+/* tcltheora_input.c */
+int input_open (TclTheoraObject *tto, int allow_mmap);
+int input_open_channel (TclTheoraObject *tto, Tcl_Interp *interp, Tcl_Channel chan);
+void input_close (TclTheoraObject *tto);
+int input_seek (TclTheoraObject *tto, ogg_int64_t offset);
+int input_size (TclTheoraObject *tto, ogg_int64_t *size);
+int input_next_page (TclTheoraObject *tto);
+long input_read_at (TclTheoraObject *tto, ogg_int64_t offset, char *buffer,
+		long len);
+
+/* tcltheora_seek.c */
+void seek_index_add (TclTheoraObject *tto, ogg_int64_t offset, ogg_int64_t gp);
+void seek_index_free (TclTheoraObject *tto);
+int seek_to_frame (TclTheoraObject *tto, ogg_int64_t frame);
+int seek_rewind (TclTheoraObject *tto);
+int seek_last_granulepos (TclTheoraObject *tto, ogg_int64_t *gp);
+
+/* tcltheora_index.c */
+int index_load (TclTheoraObject *tto);
+int index_build (TclTheoraObject *tto);
+
+/* tcltheora_stripe.c */
+void stripe_init (TclTheoraObject *tto);
+int decode_next_frame_rgb (TclTheoraObject *tto, Tk_PhotoImageBlock *dst,
+		Tcl_Interp *interp, Tk_PhotoHandle photo, ogg_int64_t *granulepos);
+
+/* tcltheora_pool.c */
+int pool_start (TclTheoraObject *tto, int nthreads);
+void pool_stop (TclTheoraObject *tto);
+void pool_submit (TclTheoraObject *tto, th_info *info, th_ycbcr_buffer buffer,
+		int y, int h, Tk_PhotoImageBlock *dst);
+void pool_wait (TclTheoraObject *tto);
+void pool_convert (TclTheoraObject *tto, th_info *info, th_ycbcr_buffer buffer,
+		Tk_PhotoImageBlock *dst);
+
+/* tcltheora_multi.c */
+int multi_video_streams (TclTheoraObject *tto, oggStream **streams);
+int multi_next (TclTheoraObject *tto);
+void multi_stop (TclTheoraObject *tto);
+void multi_queue_packets (oggStream *stream);
+void multi_queue_reset (oggStream *stream);
+
+/* tcltheora_governor.c */
+void governor_init (TclTheoraObject *tto);
+void governor_set_target (TclTheoraObject *tto, int level);
+double governor_elapsed (Tcl_Time *start);
+void governor_decoded (TclTheoraObject *tto, double seconds, int frames);
+void governor_converted (TclTheoraObject *tto, double seconds);
+Tcl_Obj *governor_state_obj (TclTheoraObject *tto);
+
+/* tcltheora_async.c */
+int async_next (TclTheoraObject *tto, Tcl_Interp *interp, Tcl_Obj *photo,
+		Tcl_Obj *command, frameFormat *fmt);
+void async_wait (TclTheoraObject *tto);
+void async_cancel (TclTheoraObject *tto);
+
+/* tcltheora_play.c */
+int play_start (TclTheoraObject *tto, Tcl_Interp *interp, Tcl_Obj *photo,
+		Tcl_Obj *command);
+void play_pause (TclTheoraObject *tto);
+void play_resume (TclTheoraObject *tto);
+void play_stop (TclTheoraObject *tto);
+void play_set_rate (TclTheoraObject *tto, double rate);
+Tcl_Obj *play_stats_obj (TclTheoraObject *tto);
+
+/* tcltheora_cache.c */
+void frame_cache_init (TclTheoraObject *tto);
+void frame_cache_free (TclTheoraObject *tto);
+void frame_cache_set_budget (TclTheoraObject *tto, ogg_int64_t bytes);
+void frame_cache_decoded (TclTheoraObject *tto, ogg_int64_t granulepos);
+int frame_cache_settle (TclTheoraObject *tto, Tcl_Interp *interp);
+void frame_cache_wait (TclTheoraObject *tto);
+int frame_prev (TclTheoraObject *tto, Tcl_Interp *interp, Tk_PhotoHandle photo);
+int frame_show (TclTheoraObject *tto, Tcl_Interp *interp, Tk_PhotoHandle photo,
+		ogg_int64_t frame);
+
+/* tcltheora_probe.c */
+int TclTheora_Probe_Cmd(ClientData clientData, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[]);
+int TclTheora_ProbeMany_Cmd(ClientData clientData, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[]);
+
+/* tcltheora_scan.c */
+int TclTheora_Scan_Cmd(ClientData clientData, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[]);
+
+/* tcltheora_stats.c */
+ogg_uint64_t stats_now (void);
+void stats_time (perfStats *stats, int timer, ogg_uint64_t start);
+void stats_add (ogg_uint64_t *counter, ogg_uint64_t n);
+void photo_put_block (TclTheoraObject *tto, Tcl_Interp *interp,
+		Tk_PhotoHandle photo, Tk_PhotoImageBlock *block, int x, int y,
+		int width, int height);
+void stats_reset (TclTheoraObject *tto);
+Tcl_Obj *stats_obj (TclTheoraObject *tto);
+void dict_put (Tcl_Obj *dict, const char *key, Tcl_Obj *value);
+void dict_put_int (Tcl_Obj *dict, const char *key, int value);
+
+/* tcltheora_prefetch.c */
+int prefetch_start (TclTheoraObject *tto);
+void prefetch_stop (TclTheoraObject *tto);
+void prefetch_flush (TclTheoraObject *tto);
+void prefetch_discard (TclTheoraObject *tto);
+int prefetch_next (TclTheoraObject *tto, readyFrame **frame);
+void prefetch_release (TclTheoraObject *tto);
+int prefetch_drop (TclTheoraObject *tto, int n);
+int prefetch_sync (TclTheoraObject *tto);
+int prefetch_format (TclTheoraObject *tto, frameFormat *fmt);
+
+#endif
@@ -38,42 +38,20 @@
 #include <ogg/ogg.h>
 #include <theora/theoradec.h>
 #include <variable_state.h>
+#include "tcltheora.h"
+#include "tcltheora_yuv.h"
 
 #define TCLTHEORA_HASH_KEY "theora_hash"
 
-enum {TCLTHEORA_MAX_NUM_STREAMS=16};
-
-typedef struct theoraDecode_s {
-	th_info mInfo;
-	th_comment mComment;
-	th_setup_info *mSetup;
-	th_dec_ctx *mCtx;
-} theoraDecode_t;
-
-typedef struct oggStream_s {
-	int mSerial;
-	ogg_stream_state mState;
-	int stream_type;
-	int mPacketCount;
-	theoraDecode_t mTheora;
-} oggStream;
-
-typedef struct tcltheora_object_s {
-	FILE *fp; /* handle to Ogg Theora file */
-	ogg_sync_state *sync_state; /* ogg file state */
-	int headers_read;
-	ogg_page *page; /* ogg file page */
-	int num_streams; /* number of allocated streams in this file */
-	oggStream *streams[TCLTHEORA_MAX_NUM_STREAMS];
-} TclTheoraObject;
-
 void theora_free_resources(TclTheoraObject *tto) {
 	int i;
 	if (tto==NULL) return;
+	multi_stop(tto);
 	if (tto->page!=NULL) ckfree((char*)tto->page);
 	tto->page=NULL;
 	for (i=0;i<tto->num_streams;i++) {
 		ogg_stream_clear(&tto->streams[i]->mState);
+		multi_queue_reset(tto->streams[i]);
 		th_decode_free(tto->streams[i]->mTheora.mCtx);
 		tto->streams[i]->mTheora.mCtx=NULL;
 		th_info_clear(&tto->streams[i]->mTheora.mInfo);
@@ -85,10 +63,16 @@ void theora_free_resources(TclTheoraObject *tto) {
 	tto->num_streams=0;
 	if (tto->sync_state!=NULL) {
 		ogg_sync_clear(tto->sync_state);
+		ckfree((char*)tto->sync_state);
 	}
-	FILE *fp=tto->fp;
-	memset(tto,0,sizeof(TclTheoraObject));
-	tto->fp=fp;
+	tto->sync_state=NULL;
+	tto->headers_read=0;
+	tto->bos_done=0;
+	tto->granulepos=-1;
+	tto->sync_offset=0;
+	tto->page_offset=0;
+	tto->data_offset=-1;
+	tto->rewind_offset=-1;
 	return;
 }
 
@@ -96,7 +80,22 @@ void theora_destroy_func(void *ptr) {
 	int i;
 	TclTheoraObject *tto=(TclTheoraObject *)ptr;
 	if (tto!=NULL) {
+		play_stop(tto);
+		async_cancel(tto);
+		frame_cache_wait(tto);
+		prefetch_flush(tto);
+		pool_stop(tto);
+		frame_cache_free(tto);
 		theora_free_resources(tto);
+		seek_index_free(tto);
+		input_close(tto);
+		for (i=0;i<3;i++) {
+			if (tto->yuv_planes[i]!=NULL) Tcl_DecrRefCount(tto->yuv_planes[i]);
+			tto->yuv_planes[i]=NULL;
+		}
+		if (tto->formatted.pixels!=NULL) ckfree((char*)tto->formatted.pixels);
+		if (tto->filename!=NULL) ckfree(tto->filename);
+		tto->filename=NULL;
 		if (tto->fp!=NULL) fclose(tto->fp);
 		tto->fp=NULL;
 		ckfree((char*)tto);
@@ -114,6 +113,12 @@ int getTTOFromObj(Tcl_Interp *interp, Tcl_Obj *CONST name, TclTheoraObject **tto
 /* forward definitions */
 int TclTheora_NextFrame_Cmd(ClientData clientData, Tcl_Interp *interp,
 		int objc, Tcl_Obj *CONST objv[]);
+int TclTheora_NextYUV_Cmd(ClientData clientData, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[]);
+int TclTheora_VideoStreams_Cmd(ClientData clientData, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[]);
+int TclTheora_NextAll_Cmd(ClientData clientData, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[]);
 
 static int find_stream_by_serial (TclTheoraObject *tto, int serialno) {
 	int i;
@@ -177,32 +182,245 @@ static int print_header_info (th_info *info) {
 	fprintf(stdout,"Keyframe Granule shift: %d\n",info->keyframe_granule_shift);
 }
 
-static int get_next_page (TclTheoraObject *tto) {
-	int ret;
-	ogg_sync_state *sync_state=tto->sync_state;
-	ogg_page *page=tto->page;
-	FILE *fp=tto->fp;
-	while (ogg_sync_pageout(sync_state,page)!=1) {
-		/* get pointer to ogg internal buffer */
-		char *buff=ogg_sync_buffer(sync_state,4096);
-		if (buff==NULL) {
-			fprintf(stderr,"Got NULL buff from ogg_sync_buffer()\n");
-			return -1;
-		}
-		int bytes=fread(buff,sizeof(char),4096,fp);
-		if (bytes==0) {
-			fprintf(stderr,"End of file.\n");
-			return -1;
-		}
-		ret=ogg_sync_wrote(sync_state,bytes);
-		if (ret!=0) {
-			fprintf(stderr,"Error from ogg_sync_wrote()\n");
-			return -1;
-		}
+/* keep track of where the video pages are, for seeking */
+static void note_page (TclTheoraObject *tto) {
+	ogg_int64_t gp;
+	if (tto->num_streams==0) return;
+	if (ogg_page_serialno(tto->page)!=tto->streams[0]->mSerial) return;
+	gp=ogg_page_granulepos(tto->page);
+	/* The first data packet starts a page of its own, and unlike the
+	 * header packets its first byte has the top bit clear. Whether any
+	 * packet ends on the page (gp -1) does not matter. */
+	if (tto->data_offset<0) {
+		ogg_page *page=tto->page;
+		if (ogg_page_continued(page) || page->body_len==0 || (page->body[0]&0x80)) return;
+		tto->data_offset=tto->page_offset;
+	}
+	if (gp!=-1 && tto->headers_read) seek_index_add(tto,tto->page_offset,gp);
+}
+
+int get_next_page (TclTheoraObject *tto) {
+	ogg_uint64_t start=stats_now();
+	if (input_next_page(tto)!=0) {
+		return -1;
 	}
+	stats_time(&tto->stats,STATS_PAGE,start);
+	stats_add(&tto->stats.pages,1);
+	stats_add(&tto->stats.bytes,tto->page->header_len+tto->page->body_len);
+	note_page(tto);
 	return 0;
 }
 
+/* start tracking a new logical stream. Returns its index, or -1 if
+ * there are too many. */
+static int new_stream (TclTheoraObject *tto, int serial) {
+	oggStream *stream;
+	if (tto->num_streams==TCLTHEORA_MAX_NUM_STREAMS) return -1;
+	stream=(oggStream*)ckalloc(sizeof(oggStream));
+	memset(stream,0,sizeof(oggStream));
+	stream->mSerial=serial;
+	ogg_stream_init(&stream->mState,serial);
+	th_info_init(&stream->mTheora.mInfo);
+	th_comment_init(&stream->mTheora.mComment);
+	tto->streams[tto->num_streams]=stream;
+	return tto->num_streams++;
+}
+
+/* hand the current page to the stream it belongs to */
+void route_page (TclTheoraObject *tto) {
+	ogg_packet packet;
+	oggStream *stream;
+	int serial=ogg_page_serialno(tto->page);
+	int cur_stream=find_stream_by_serial(tto,serial);
+	if (cur_stream==-1) {
+		if (!ogg_page_bos(tto->page)) return;
+		cur_stream=new_stream(tto,serial);
+		if (cur_stream==-1) return;
+	}
+	stream=tto->streams[cur_stream];
+	if (ogg_stream_pagein(&stream->mState,tto->page)!=0) {
+		if (!tto->quiet) fprintf(stderr,"Error in ogg_stream_pagein() for stream %d\n",serial);
+		return;
+	}
+	if (cur_stream==0) return;
+	if (stream->stream_type==STREAM_TYPE_THEORA) {
+		/* the other video streams keep enough to start decoding from
+		 * (once their headers have been read) */
+		if (tto->headers_read) multi_queue_packets(stream);
+		return;
+	}
+	/* don't let streams nobody is decoding pile up */
+	if (stream->active) return;
+	while (ogg_stream_packetout(&stream->mState,&packet)!=0) {
+		stream->mPacketCount++;
+	}
+}
+
+/* Get the next packet of a stream, reading more pages as needed.
+ * Returns 1 if we got a packet, 0 at the end of the file. */
+int next_stream_packet (TclTheoraObject *tto, oggStream *stream,
+		ogg_packet *packet)
+{
+	int ret;
+	while ((ret=ogg_stream_packetout(&stream->mState,packet))!=1) {
+		if (ret==-1) continue; /* lost some data, just carry on */
+		if (get_next_page(tto)!=0) return 0;
+		route_page(tto);
+	}
+	stream->mPacketCount++;
+	return 1;
+}
+
+/* Feed packets of the video stream to the decoder until one of them
+ * makes a frame, without fetching the picture.
+ * Returns 1 if we got a frame, 0 at the end of the file. */
+int decode_next_packet (TclTheoraObject *tto, ogg_int64_t *granulepos) {
+	/* FIXME: Only supports first stream for now */
+	oggStream *stream=tto->streams[0];
+	ogg_packet packet;
+	ogg_uint64_t start,stripes;
+	int ret;
+	*granulepos=-1;
+	do {
+		if (!next_stream_packet(tto,stream,&packet)) return 0;
+		stripes=tto->stripe.callback_ns;
+		start=stats_now();
+		ret=th_decode_packetin(stream->mTheora.mCtx,&packet,granulepos);
+		/* not counting what the stripe callback did meanwhile */
+		stats_time(&tto->stats,STATS_PACKETIN,start+(tto->stripe.callback_ns-stripes));
+		/* a duplicate frame is shown again, anything else is skipped */
+	} while (ret!=0 && ret!=TH_DUPFRAME);
+	stats_add(&tto->stats.frames,1);
+	if (ret==TH_DUPFRAME) stats_add(&tto->stats.dups,1);
+	return 1;
+}
+
+/* Decode the next frame of the video stream into buffer.
+ * Returns 1 if we got a frame, 0 at the end of the file. */
+int decode_next_frame (TclTheoraObject *tto, th_ycbcr_buffer buffer,
+		ogg_int64_t *granulepos)
+{
+	/* when the governor is dropping frames, decode them but only
+	 * hand back the last */
+	int frames=tto->governor.realtime?tto->governor.drop+1:1;
+	Tcl_Time start;
+	ogg_uint64_t out;
+	int i;
+	Tcl_GetTime(&start);
+	for (i=0;i<frames;i++) {
+		if (decode_next_packet(tto,granulepos)!=1) return 0;
+	}
+	out=stats_now();
+	th_decode_ycbcr_out(tto->streams[0]->mTheora.mCtx,buffer);
+	stats_time(&tto->stats,STATS_YCBCR_OUT,out);
+	governor_decoded(tto,governor_elapsed(&start),frames);
+	return 1;
+}
+
+/* is fmt (which may be NULL) just the whole picture at full size? */
+int frame_format_is_full (frameFormat *fmt) {
+	return fmt==NULL || (fmt->shift==0 && !fmt->crop && !fmt->gray);
+}
+
+/* describe the pixels of frame, which were converted as fmt (which may
+ * be NULL) says, for Tk_PhotoPutBlock() */
+void frame_format_block (frameFormat *fmt, readyFrame *frame,
+		Tk_PhotoImageBlock *block)
+{
+	int gray=fmt!=NULL && fmt->gray;
+	block->pixelPtr=frame->pixels;
+	block->width=frame->width;
+	block->height=frame->height;
+	block->pixelSize=gray?1:4;
+	block->pitch=block->pixelSize*frame->width;
+	block->offset[0]=0;
+	block->offset[1]=gray?0:1;
+	block->offset[2]=gray?0:2;
+	/* for gray this is past the pixel, which tells Tk there is no alpha */
+	block->offset[3]=gray?1:3;
+}
+
+/* Set fmt up to crop to rect, a list {x y w h} in picture coordinates,
+ * clipped to the picture. */
+int frame_format_crop (Tcl_Interp *interp, TclTheoraObject *tto, Tcl_Obj *rect,
+		frameFormat *fmt)
+{
+	th_info *info=&tto->streams[0]->mTheora.mInfo;
+	Tcl_Obj **elems;
+	int n,i,v[4];
+	int x1,y1;
+	if (Tcl_ListObjGetElements(interp,rect,&n,&elems)!=TCL_OK) return TCL_ERROR;
+	if (n!=4) {
+		Tcl_AppendResult(interp,"-crop takes a list of x y width height\n",NULL);
+		return TCL_ERROR;
+	}
+	for (i=0;i<4;i++) {
+		if (Tcl_GetIntFromObj(interp,elems[i],&v[i])!=TCL_OK) return TCL_ERROR;
+	}
+	x1=v[0]+v[2];
+	y1=v[1]+v[3];
+	if (v[0]<0) v[0]=0;
+	if (v[1]<0) v[1]=0;
+	if (x1>(int)info->pic_width) x1=info->pic_width;
+	if (y1>(int)info->pic_height) y1=info->pic_height;
+	if (x1<=v[0] || y1<=v[1]) {
+		Tcl_AppendResult(interp,"-crop rectangle is outside the picture\n",NULL);
+		return TCL_ERROR;
+	}
+	fmt->crop=1;
+	fmt->x=v[0];
+	fmt->y=v[1];
+	fmt->w=x1-v[0];
+	fmt->h=y1-v[1];
+	return TCL_OK;
+}
+
+/* Decode the next frame and convert it as fmt says into frame, which is
+ * resized to suit. Returns 1 if we got a frame, 0 at the end of the file. */
+int decode_next_frame_format (TclTheoraObject *tto, frameFormat *fmt,
+		readyFrame *frame, ogg_int64_t *granulepos)
+{
+	th_info *info=&tto->streams[0]->mTheora.mInfo;
+	th_ycbcr_buffer buffer;
+	Tk_PhotoImageBlock block;
+	Tcl_Time start;
+	ogg_uint64_t convert;
+	int x=0,y=0;
+	int pw=info->pic_width;
+	int ph=info->pic_height;
+	int w,h;
+
+	if (decode_next_frame(tto,buffer,granulepos)!=1) return 0;
+	Tcl_GetTime(&start);
+	if (fmt->crop) {
+		x=fmt->x;
+		y=fmt->y;
+		pw=fmt->w;
+		ph=fmt->h;
+	}
+	w=pw>>fmt->shift;
+	h=ph>>fmt->shift;
+	if (frame->pixels==NULL || frame->width!=w || frame->height!=h) {
+		/* always room for RGBA, so gray and colour can share it */
+		if (frame->pixels!=NULL) ckfree((char*)frame->pixels);
+		frame->width=w;
+		frame->height=h;
+		frame->pixels=(unsigned char*)ckalloc(4*(w>0?w:1)*(h>0?h:1));
+	}
+	frame_format_block(fmt,frame,&block);
+	convert=stats_now();
+	if (fmt->gray) {
+		ycbcr_to_gray(info,buffer,x,y,pw,ph,fmt->shift,fmt->box,
+				block.pixelPtr,block.pitch);
+	} else {
+		ycbcr_to_rgb_scaled(info,buffer,x,y,pw,ph,fmt->shift,fmt->box,&block);
+	}
+	stats_time(&tto->stats,STATS_CONVERT,convert);
+	frame->granulepos=*granulepos;
+	governor_converted(tto,governor_elapsed(&start));
+	return 1;
+}
+
 int TclTheora_GetInfo_Cmd(ClientData clientData, Tcl_Interp *interp,
 		int objc, Tcl_Obj *CONST objv[])
 {
@@ -240,35 +458,351 @@ int TclTheora_Rewind_Cmd(ClientData clientData, Tcl_Interp *interp,
 		int objc, Tcl_Obj *CONST objv[])
 {
 	TclTheoraObject *tto=NULL;
-	int i;
 	tto=(TclTheoraObject *)clientData;
-	if (tto->fp==NULL) {
+	if (tto->fp==NULL && tto->channel==NULL) {
 		Tcl_AppendResult(interp,"Theora Object File not Open.\n",NULL);
 		return TCL_ERROR;
 	}
-	rewind(tto->fp);
-	theora_free_resources(tto);
-	/* re-initialize things */
-	if (initialize_theora_stream(interp,tto)!=TCL_OK) {
+	/* keep the ring's buffers for the next time round */
+	prefetch_discard(tto);
+	tto->cache.resume=-1;
+	/* the headers and decoders we have are still good */
+	if (seek_rewind(tto)!=0) {
+		Tcl_AppendResult(interp,"Cannot rewind this input.\n",NULL);
+		return TCL_ERROR;
+	}
+	if (prefetch_start(tto)!=TCL_OK) {
+		Tcl_AppendResult(interp,"Could not start decode thread.\n",NULL);
 		return TCL_ERROR;
 	}
 	return TCL_OK;
 }
 
+/* move so that the next frame shown is the given frame, or the frame
+ * that should be showing at the given time (in seconds). Returns the
+ * frame it got to: past the end, that is the one after the last. */
+int TclTheora_Seek_Cmd(ClientData clientData, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[])
+{
+	CONST char *units[] = {"frame","time",NULL};
+	enum SeekUnitIx {FrameIx,TimeIx};
+	TclTheoraObject *tto=(TclTheoraObject *)clientData;
+	Tcl_WideInt frame,reached;
+	double t;
+	int index;
+
+	if (objc!=3) {
+		Tcl_WrongNumArgs(interp,1,objv,"frame|time value");
+		return TCL_ERROR;
+	}
+	if (Tcl_GetIndexFromObj(interp,objv[1],units,"unit",0,&index)!=TCL_OK)
+		return TCL_ERROR;
+	switch (index) {
+		case FrameIx:
+			if (Tcl_GetWideIntFromObj(interp,objv[2],&frame)!=TCL_OK) return TCL_ERROR;
+			break;
+		case TimeIx:
+			if (Tcl_GetDoubleFromObj(interp,objv[2],&t)!=TCL_OK) return TCL_ERROR;
+			th_info *info=&tto->streams[0]->mTheora.mInfo;
+			frame=(Tcl_WideInt)(t*info->fps_numerator/info->fps_denominator+1e-9);
+			break;
+	}
+	if (frame<0) frame=0;
+	prefetch_flush(tto);
+	tto->cache.resume=-1;
+	if (seek_to_frame(tto,frame)!=0) {
+		Tcl_AppendResult(interp,"Error seeking in file.\n",NULL);
+		return TCL_ERROR;
+	}
+	/* the decoder stops short of frame if the file ends first */
+	reached=th_granule_frame(tto->streams[0]->mTheora.mCtx,tto->granulepos)+1;
+	if (reached<frame) frame=reached;
+	if (prefetch_start(tto)!=TCL_OK) {
+		Tcl_AppendResult(interp,"Could not start decode thread.\n",NULL);
+		return TCL_ERROR;
+	}
+	Tcl_SetObjResult(interp,Tcl_NewWideIntObj(frame));
+	return TCL_OK;
+}
+
+/* Decode the next n frames without converting them (or drop them from
+ * the prefetch ring, if they are already there). */
+int skip_frames (TclTheoraObject *tto, Tcl_Interp *interp, int n) {
+	ogg_int64_t granulepos;
+	int dropped;
+	multi_stop(tto);
+	/* frames the worker has already finished cost nothing to drop */
+	dropped=prefetch_drop(tto,n);
+	stats_add(&tto->stats.dropped,dropped);
+	n-=dropped;
+	if (n>0) {
+		if (prefetch_sync(tto)!=0) {
+			Tcl_AppendResult(interp,"Error seeking in file.\n",NULL);
+			return TCL_ERROR;
+		}
+		while (n-->0) {
+			if (decode_next_packet(tto,&granulepos)!=1) break;
+			tto->granulepos=granulepos;
+			stats_add(&tto->stats.dropped,1);
+		}
+		if (prefetch_start(tto)!=TCL_OK) {
+			Tcl_AppendResult(interp,"Could not start decode thread.\n",NULL);
+			return TCL_ERROR;
+		}
+	}
+	return TCL_OK;
+}
+
+int TclTheora_Skip_Cmd(ClientData clientData, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[])
+{
+	TclTheoraObject *tto=(TclTheoraObject *)clientData;
+	int n;
+
+	if (objc!=2) {
+		Tcl_WrongNumArgs(interp,1,objv,"n");
+		return TCL_ERROR;
+	}
+	if (Tcl_GetIntFromObj(interp,objv[1],&n)!=TCL_OK) return TCL_ERROR;
+	if (n<0) {
+		Tcl_AppendResult(interp,"skip count must be >= 0\n",NULL);
+		return TCL_ERROR;
+	}
+	if (skip_frames(tto,interp,n)!=TCL_OK) return TCL_ERROR;
+	Tcl_SetObjResult(interp,Tcl_NewWideIntObj(
+				th_granule_frame(tto->streams[0]->mTheora.mCtx,tto->granulepos)));
+	return TCL_OK;
+}
+
+/* index every page of the file and save the index next to it (or in the
+ * cache directory), so that later opens can seek without scanning */
+int TclTheora_BuildIndex_Cmd(ClientData clientData, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[])
+{
+	TclTheoraObject *tto=(TclTheoraObject *)clientData;
+	int ret;
+	/* the worker may be adding to the index */
+	prefetch_stop(tto);
+	ret=index_build(tto);
+	if (prefetch_start(tto)!=TCL_OK) {
+		Tcl_AppendResult(interp,"Could not start decode thread.\n",NULL);
+		return TCL_ERROR;
+	}
+	if (ret!=0) {
+		Tcl_AppendResult(interp,"Could not write index for ",tto->filename,".\n",NULL);
+		return TCL_ERROR;
+	}
+	Tcl_SetObjResult(interp,Tcl_NewIntObj(tto->index.count));
+	return TCL_OK;
+}
+
+/* query or change the options of a theora object */
+int TclTheora_Configure_Cmd(ClientData clientData, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[])
+{
+	CONST char *options[] = {"-prefetch","-realtime","-pplevel","-threads",
+		"-readable","-rate","-cacheSize",NULL};
+	enum TheoraOptIx {PrefetchIx,RealtimeIx,PPLevelIx,ThreadsIx,ReadableIx,RateIx,
+		CacheSizeIx};
+	TclTheoraObject *tto=(TclTheoraObject *)clientData;
+	Tcl_Obj *result=NULL;
+	int index;
+	int i;
+
+	if (objc==1) {
+		/* report all the options */
+		result=Tcl_NewListObj(0,NULL);
+		Tcl_ListObjAppendElement(interp,result,Tcl_NewStringObj("-prefetch",-1));
+		Tcl_ListObjAppendElement(interp,result,Tcl_NewIntObj(tto->prefetch));
+		Tcl_ListObjAppendElement(interp,result,Tcl_NewStringObj("-realtime",-1));
+		Tcl_ListObjAppendElement(interp,result,Tcl_NewBooleanObj(tto->governor.realtime));
+		Tcl_ListObjAppendElement(interp,result,Tcl_NewStringObj("-pplevel",-1));
+		Tcl_ListObjAppendElement(interp,result,Tcl_NewIntObj(tto->governor.pp_target));
+		Tcl_ListObjAppendElement(interp,result,Tcl_NewStringObj("-threads",-1));
+		Tcl_ListObjAppendElement(interp,result,Tcl_NewIntObj(tto->pool.nthreads));
+		Tcl_ListObjAppendElement(interp,result,Tcl_NewStringObj("-readable",-1));
+		Tcl_ListObjAppendElement(interp,result,
+				tto->readable_cmd?tto->readable_cmd:Tcl_NewObj());
+		Tcl_ListObjAppendElement(interp,result,Tcl_NewStringObj("-rate",-1));
+		Tcl_ListObjAppendElement(interp,result,Tcl_NewDoubleObj(tto->player.rate));
+		Tcl_ListObjAppendElement(interp,result,Tcl_NewStringObj("-cacheSize",-1));
+		Tcl_ListObjAppendElement(interp,result,Tcl_NewWideIntObj(tto->cache.budget));
+		Tcl_SetObjResult(interp,result);
+		return TCL_OK;
+	}
+	if (objc==2) {
+		if (Tcl_GetIndexFromObj(interp,objv[1],options,"option",0,&index)!=TCL_OK)
+			return TCL_ERROR;
+		switch (index) {
+			case PrefetchIx:
+				Tcl_SetObjResult(interp,Tcl_NewIntObj(tto->prefetch));
+				break;
+			case RealtimeIx:
+				Tcl_SetObjResult(interp,Tcl_NewBooleanObj(tto->governor.realtime));
+				break;
+			case PPLevelIx:
+				Tcl_SetObjResult(interp,Tcl_NewIntObj(tto->governor.pp_target));
+				break;
+			case ThreadsIx:
+				Tcl_SetObjResult(interp,Tcl_NewIntObj(tto->pool.nthreads));
+				break;
+			case ReadableIx:
+				if (tto->readable_cmd!=NULL) Tcl_SetObjResult(interp,tto->readable_cmd);
+				break;
+			case RateIx:
+				Tcl_SetObjResult(interp,Tcl_NewDoubleObj(tto->player.rate));
+				break;
+			case CacheSizeIx:
+				Tcl_SetObjResult(interp,Tcl_NewWideIntObj(tto->cache.budget));
+				break;
+		}
+		return TCL_OK;
+	}
+	if (objc%2!=1) {
+		Tcl_WrongNumArgs(interp,1,objv,"?-option value ...?");
+		return TCL_ERROR;
+	}
+	for (i=1;i<objc;i+=2) {
+		int n;
+		if (Tcl_GetIndexFromObj(interp,objv[i],options,"option",0,&index)!=TCL_OK)
+			return TCL_ERROR;
+		switch (index) {
+			case PrefetchIx:
+				if (Tcl_GetIntFromObj(interp,objv[i+1],&n)!=TCL_OK) return TCL_ERROR;
+				if (n<0) {
+					Tcl_AppendResult(interp,"-prefetch must be >= 0\n",NULL);
+					return TCL_ERROR;
+				}
+				if (n==tto->prefetch) break;
+				/* frames already decoded are kept and shown first */
+				prefetch_stop(tto);
+				tto->prefetch=n;
+				if (prefetch_start(tto)!=TCL_OK) {
+					tto->prefetch=0;
+					Tcl_AppendResult(interp,"Could not start decode thread.\n",NULL);
+					return TCL_ERROR;
+				}
+				break;
+			case RealtimeIx:
+				if (Tcl_GetBooleanFromObj(interp,objv[i+1],&n)!=TCL_OK) return TCL_ERROR;
+				/* the worker thread owns the decoder while it runs */
+				prefetch_stop(tto);
+				tto->governor.realtime=n;
+				/* start again from full quality, showing every frame */
+				governor_set_target(tto,tto->governor.pp_target);
+				if (prefetch_start(tto)!=TCL_OK) {
+					Tcl_AppendResult(interp,"Could not start decode thread.\n",NULL);
+					return TCL_ERROR;
+				}
+				break;
+			case PPLevelIx:
+				if (Tcl_GetIntFromObj(interp,objv[i+1],&n)!=TCL_OK) return TCL_ERROR;
+				if (n<0) {
+					Tcl_AppendResult(interp,"-pplevel must be >= 0\n",NULL);
+					return TCL_ERROR;
+				}
+				prefetch_stop(tto);
+				governor_set_target(tto,n);
+				if (prefetch_start(tto)!=TCL_OK) {
+					Tcl_AppendResult(interp,"Could not start decode thread.\n",NULL);
+					return TCL_ERROR;
+				}
+				break;
+			case ThreadsIx:
+				if (Tcl_GetIntFromObj(interp,objv[i+1],&n)!=TCL_OK) return TCL_ERROR;
+				if (n<1 || n>CONVERT_POOL_MAX_THREADS) {
+					char msg[64];
+					sprintf(msg,"-threads must be between 1 and %d\n",CONVERT_POOL_MAX_THREADS);
+					Tcl_AppendResult(interp,msg,NULL);
+					return TCL_ERROR;
+				}
+				if (n==tto->pool.nthreads) break;
+				/* the pool is used by whichever thread is decoding */
+				prefetch_stop(tto);
+				if (pool_start(tto,n)!=TCL_OK) {
+					Tcl_AppendResult(interp,"Could not start conversion threads.\n",NULL);
+					prefetch_start(tto);
+					return TCL_ERROR;
+				}
+				if (prefetch_start(tto)!=TCL_OK) {
+					Tcl_AppendResult(interp,"Could not start decode thread.\n",NULL);
+					return TCL_ERROR;
+				}
+				break;
+			case ReadableIx:
+				if (tto->channel==NULL) {
+					Tcl_AppendResult(interp,"-readable only applies to channels\n",NULL);
+					return TCL_ERROR;
+				}
+				if (tto->readable_cmd!=NULL) Tcl_DecrRefCount(tto->readable_cmd);
+				tto->readable_cmd=NULL;
+				if (Tcl_GetCharLength(objv[i+1])>0) {
+					tto->readable_cmd=objv[i+1];
+					Tcl_IncrRefCount(tto->readable_cmd);
+				}
+				break;
+			case RateIx: {
+				double rate;
+				if (Tcl_GetDoubleFromObj(interp,objv[i+1],&rate)!=TCL_OK) return TCL_ERROR;
+				if (rate<=0) {
+					Tcl_AppendResult(interp,"-rate must be > 0\n",NULL);
+					return TCL_ERROR;
+				}
+				play_set_rate(tto,rate);
+				break;
+			}
+			case CacheSizeIx: {
+				Tcl_WideInt bytes;
+				if (Tcl_GetWideIntFromObj(interp,objv[i+1],&bytes)!=TCL_OK) return TCL_ERROR;
+				if (bytes<0) {
+					Tcl_AppendResult(interp,"-cacheSize must be >= 0\n",NULL);
+					return TCL_ERROR;
+				}
+				frame_cache_set_budget(tto,bytes);
+				break;
+			}
+		}
+	}
+	return TCL_OK;
+}
+
 int handle_tto_cmd (ClientData clientData, Tcl_Interp *interp,
 		int objc, Tcl_Obj *CONST objv[])
 {
-	CONST char *subCmds[] = {"next","frameRate","rewind",NULL};
-	enum TheoraCmdIx {NextIx,FrameRateIx,RewindIx};
+	CONST char *subCmds[] = {"next","frameRate","rewind","configure","seek",
+		"buildIndex","nextYUV","skip","governor","videoStreams","nextAll",
+		"play","pause","resume","stop","playStats","stats","frame","prev","duration","frameCount",NULL};
+	enum TheoraCmdIx {NextIx,FrameRateIx,RewindIx,ConfigureIx,SeekIx,
+		BuildIndexIx,NextYUVIx,SkipIx,GovernorIx,VideoStreamsIx,NextAllIx,
+		PlayIx,PauseIx,ResumeIx,StopIx,PlayStatsIx,StatsIx,FrameIx,PrevIx,DurationIx,FrameCountIx};
+	TclTheoraObject *tto=(TclTheoraObject *)clientData;
 	int index;
 
 	if (Tcl_GetIndexFromObj(interp,objv[1],subCmds,"sub-command",0,&index)!=TCL_OK)
 		return TCL_ERROR;
+	/* a channel's headers come in from the event loop, and until they
+	 * have there is nothing to do but configure */
+	if (!tto->headers_read && index!=ConfigureIx) {
+		Tcl_AppendResult(interp,tto->header_error!=NULL?tto->header_error
+				:"Still reading the headers from the channel.\n",NULL);
+		return TCL_ERROR;
+	}
+	/* a "next -command" still decoding owns the decoder */
+	async_wait((TclTheoraObject *)clientData);
+	/* and so does "prev" decoding backwards, except to "prev" itself */
+	if (index!=PrevIx) frame_cache_wait(tto);
+	/* reading on after "frame" starts from the frame after it */
+	switch (index) {
+		case NextIx: case NextYUVIx: case SkipIx: case NextAllIx:
+		case PlayIx: case ResumeIx:
+			if (frame_cache_settle(tto,interp)!=TCL_OK) return TCL_ERROR;
+			break;
+	}
 
 	switch (index) {
 		case NextIx:
-			if (objc!=3) {
-				Tcl_WrongNumArgs(interp,1,objv,"next photo");
+			if (objc<3) {
+				Tcl_WrongNumArgs(interp,1,objv,"next photo ?-option value ...?");
 				return TCL_ERROR;
 			}
 			return TclTheora_NextFrame_Cmd(clientData,interp,objc-1,objv+1);
@@ -287,6 +821,148 @@ int handle_tto_cmd (ClientData clientData, Tcl_Interp *interp,
 			}
 			return TclTheora_Rewind_Cmd(clientData,interp,objc,objv);
 			break;
+		case ConfigureIx:
+			return TclTheora_Configure_Cmd(clientData,interp,objc-1,objv+1);
+			break;
+		case SeekIx:
+			if (objc!=4) {
+				Tcl_WrongNumArgs(interp,1,objv,"seek frame|time value");
+				return TCL_ERROR;
+			}
+			return TclTheora_Seek_Cmd(clientData,interp,objc-1,objv+1);
+			break;
+		case BuildIndexIx:
+			if (objc!=2) {
+				Tcl_WrongNumArgs(interp,1,objv,"buildIndex");
+				return TCL_ERROR;
+			}
+			return TclTheora_BuildIndex_Cmd(clientData,interp,objc-1,objv+1);
+			break;
+		case NextYUVIx:
+			return TclTheora_NextYUV_Cmd(clientData,interp,objc-1,objv+1);
+			break;
+		case SkipIx:
+			if (objc!=3) {
+				Tcl_WrongNumArgs(interp,1,objv,"skip n");
+				return TCL_ERROR;
+			}
+			return TclTheora_Skip_Cmd(clientData,interp,objc-1,objv+1);
+			break;
+		case GovernorIx:
+			if (objc!=2) {
+				Tcl_WrongNumArgs(interp,1,objv,"governor");
+				return TCL_ERROR;
+			}
+			Tcl_SetObjResult(interp,governor_state_obj((TclTheoraObject *)clientData));
+			return TCL_OK;
+			break;
+		case VideoStreamsIx:
+			if (objc!=2) {
+				Tcl_WrongNumArgs(interp,1,objv,"videoStreams");
+				return TCL_ERROR;
+			}
+			return TclTheora_VideoStreams_Cmd(clientData,interp,objc-1,objv+1);
+			break;
+		case NextAllIx:
+			return TclTheora_NextAll_Cmd(clientData,interp,objc-1,objv+1);
+			break;
+		case PlayIx:
+			if (objc==5 && strcmp(Tcl_GetString(objv[3]),"-command")==0) {
+				return play_start(tto,interp,objv[2],objv[4]);
+			}
+			if (objc!=3) {
+				Tcl_WrongNumArgs(interp,1,objv,"play photo ?-command script?");
+				return TCL_ERROR;
+			}
+			return play_start(tto,interp,objv[2],NULL);
+			break;
+		case PauseIx:
+		case ResumeIx:
+		case StopIx:
+			if (objc!=2) {
+				Tcl_WrongNumArgs(interp,2,objv,NULL);
+				return TCL_ERROR;
+			}
+			if (index==PauseIx) play_pause(tto);
+			else if (index==ResumeIx) play_resume(tto);
+			else play_stop(tto);
+			return TCL_OK;
+			break;
+		case PlayStatsIx:
+			if (objc!=2) {
+				Tcl_WrongNumArgs(interp,1,objv,"playStats");
+				return TCL_ERROR;
+			}
+			Tcl_SetObjResult(interp,play_stats_obj(tto));
+			return TCL_OK;
+			break;
+		case StatsIx:
+			if (objc==3 && strcmp(Tcl_GetString(objv[2]),"-reset")==0) {
+				/* the next "next" starts it again */
+				prefetch_stop(tto);
+				stats_reset(tto);
+				return TCL_OK;
+			}
+			if (objc!=2) {
+				Tcl_WrongNumArgs(interp,1,objv,"stats ?-reset?");
+				return TCL_ERROR;
+			}
+			Tcl_SetObjResult(interp,stats_obj(tto));
+			return TCL_OK;
+			break;
+		case FrameIx: {
+			Tcl_WideInt frame;
+			Tk_PhotoHandle photo;
+			if (objc!=4) {
+				Tcl_WrongNumArgs(interp,1,objv,"frame n photo");
+				return TCL_ERROR;
+			}
+			if (Tcl_GetWideIntFromObj(interp,objv[2],&frame)!=TCL_OK) return TCL_ERROR;
+			photo=Tk_FindPhoto(interp,Tcl_GetString(objv[3]));
+			if (photo==NULL) {
+				Tcl_AppendResult(interp,"Cannot find photo \"",Tcl_GetString(objv[3]),"\"",NULL);
+				return TCL_ERROR;
+			}
+			return frame_show(tto,interp,photo,frame);
+			break;
+		}
+		case PrevIx: {
+			Tk_PhotoHandle photo;
+			if (objc!=3) {
+				Tcl_WrongNumArgs(interp,1,objv,"prev photo");
+				return TCL_ERROR;
+			}
+			photo=Tk_FindPhoto(interp,Tcl_GetString(objv[2]));
+			if (photo==NULL) {
+				Tcl_AppendResult(interp,"Cannot find photo \"",Tcl_GetString(objv[2]),"\"",NULL);
+				return TCL_ERROR;
+			}
+			return frame_prev(tto,interp,photo);
+			break;
+		}
+		case DurationIx:
+		case FrameCountIx: {
+			th_dec_ctx *ctx=tto->streams[0]->mTheora.mCtx;
+			ogg_int64_t gp=-1;
+			int ret;
+			if (objc!=2) {
+				Tcl_WrongNumArgs(interp,2,objv,NULL);
+				return TCL_ERROR;
+			}
+			/* from the last page, rather than by decoding to the end */
+			ret=seek_last_granulepos(tto,&gp);
+			if (ret<0) {
+				Tcl_AppendResult(interp,"Cannot find the end of this input.\n",NULL);
+				return TCL_ERROR;
+			}
+			if (index==DurationIx) {
+				Tcl_SetObjResult(interp,Tcl_NewDoubleObj(ret?th_granule_time(ctx,gp):0.0));
+			} else {
+				Tcl_SetObjResult(interp,Tcl_NewWideIntObj(ret?th_granule_frame(ctx,gp)+1:0));
+			}
+			return TCL_OK;
+			break;
+		}
 
 		default:
 			Tcl_AppendResult(interp,"Unknown subcommand.\n",NULL);
@@ -295,58 +971,131 @@ int handle_tto_cmd (ClientData clientData, Tcl_Interp *interp,
 	return TCL_OK;
 }
 
-static inline ycbcr_to_rgb(th_info *info, th_ycbcr_buffer buffer,
-		Tk_PhotoImageBlock *dst)
-{
-	unsigned int i,j;
-	/* Convert each element to RGB */
-	unsigned char r,g,b;
-	unsigned char y,cr,cb;
-	for (j=0;j<info->pic_height;j++) {
-		for (i=0;i<info->pic_width;i++) {
-			switch (info->pixel_fmt) {
-				case TH_PF_420:
-					y=buffer[0].data[(j+info->pic_y)*buffer[0].stride+(i+info->pic_x)];
-					cb=buffer[1].data[((j+info->pic_y)/2)*buffer[1].stride+(i+info->pic_x)/2];
-					cr=buffer[2].data[((j+info->pic_y)/2)*buffer[2].stride+(i+info->pic_x)/2];
-					break;
-				case TH_PF_RSVD:
-					break;
-				case TH_PF_422:
-					break;
-				case TH_PF_444:
-					y=buffer[0].data[(j+info->pic_y)*buffer[0].stride+(i+info->pic_x)];
-					cb=buffer[1].data[(j+info->pic_y)*buffer[1].stride+(i+info->pic_x)];
-					cr=buffer[2].data[(j+info->pic_y)*buffer[2].stride+(i+info->pic_x)];
-					break;
-				default:
-					break;
-			}
-			double tmp;
-			/* red */
-			tmp=255.0*(y-16)/219 + 255*0.701*(cr-128)/112;
-			if (tmp<0) tmp=0;
-			if (tmp>255) tmp=255;
-			r=(unsigned char)tmp;
-			/* green */
-			tmp=255.0*(y-16)/219 - 255*0.886*0.114*(cb-128)/(112*0.587) - 255*0.701*0.299*(cr-128)/(112*0.587);
-			if (tmp<0) tmp=0;
-			if (tmp>255) tmp=255;
-			g=(unsigned char)tmp;
-			/* blue */
-			tmp=255.0*(y-16)/219+255.0*0.866*(cb-128)/112;
-			if (tmp<0) tmp=0;
-			if (tmp>255) tmp=255;
-			b=(unsigned char)tmp;
-			dst->pixelPtr[j*dst->pitch+i*dst->pixelSize+dst->offset[0]]=r;
-			dst->pixelPtr[j*dst->pitch+i*dst->pixelSize+dst->offset[1]]=g;
-			dst->pixelPtr[j*dst->pitch+i*dst->pixelSize+dst->offset[2]]=b;
-			dst->pixelPtr[j*dst->pitch+i*dst->pixelSize+dst->offset[3]]=255;
+/* does this packet start a Theora stream? */
+static int is_theora_bos (ogg_packet *packet) {
+	return packet->bytes>=7 && packet->packet[0]==0x80
+		&& memcmp(packet->packet+1,"theora",6)==0;
+}
+
+/* Feed the header packets a video stream has so far to the decoder. At
+ * the first data packet (which is left in the stream) the decoder context
+ * is set up. Returns -1 if the headers are bad. */
+static int read_headers (oggStream *stream) {
+	theoraDecode_t *th=&stream->mTheora;
+	ogg_packet packet;
+	int ret;
+	while ((ret=ogg_stream_packetpeek(&stream->mState,&packet))!=0) {
+		if (ret<0) {
+			/* lost some data, skip over the hole */
+			ogg_stream_packetout(&stream->mState,&packet);
+			continue;
+		}
+		ret=th_decode_headerin(&th->mInfo,&th->mComment,&th->mSetup,&packet);
+		if (ret<0) return -1;
+		if (ret==0) {
+			/* that was the first video data packet */
+			th->mCtx=th_decode_alloc(&th->mInfo,th->mSetup);
+			return (th->mCtx==NULL)?-1:0;
 		}
+		ogg_stream_packetout(&stream->mState,&packet);
+		stream->mPacketCount++;
 	}
 	return 0;
 }
 
+/* Read the first pages of the streams and then the headers, as far as
+ * the input goes. This picks up where it left off, so for a channel it is
+ * called again as more data comes in. Returns 1 once the headers are all
+ * in, 0 if a channel has no more data yet, or -1 with *msg set if the
+ * input is no good. */
+int read_stream_headers (TclTheoraObject *tto, char **msg) {
+	ogg_packet packet;
+	int i,pending;
+
+	/* the first page of every stream comes before anything else */
+	while (!tto->bos_done) {
+		if (get_next_page(tto)!=0) {
+			if (tto->input_blocked) return 0;
+			*msg="Could not get a page from Ogg stream.\n";
+			return -1;
+		}
+		if (!ogg_page_bos(tto->page)) {
+			if (tto->num_streams==0 || tto->streams[0]->stream_type!=STREAM_TYPE_THEORA) {
+				*msg="No Theora stream in file.\n";
+				return -1;
+			}
+			tto->streams[0]->active=1;
+			/* the page we stopped on is already part of the data */
+			route_page(tto);
+			tto->bos_done=1;
+			break;
+		}
+		int serial=ogg_page_serialno(tto->page);
+		if (find_stream_by_serial(tto,serial)!=-1) continue;
+		i=new_stream(tto,serial);
+		if (i==-1) {
+			*msg="Too many streams in file.\n";
+			return -1;
+		}
+		oggStream *stream=tto->streams[i];
+		ogg_stream_pagein(&stream->mState,tto->page);
+		if (ogg_stream_packetpeek(&stream->mState,&packet)==1 && is_theora_bos(&packet)) {
+			stream->stream_type=STREAM_TYPE_THEORA;
+			/* the first video stream is the one everything else works on.
+			 * This has to be settled before any data pages are read. */
+			if (tto->streams[0]->stream_type!=STREAM_TYPE_THEORA) {
+				tto->streams[i]=tto->streams[0];
+				tto->streams[0]=stream;
+			}
+		} else {
+			stream->stream_type=STREAM_TYPE_OTHER;
+		}
+	}
+
+	/* then the headers of every video stream */
+	for (;;) {
+		pending=0;
+		for (i=0;i<tto->num_streams;i++) {
+			oggStream *stream=tto->streams[i];
+			if (stream->stream_type!=STREAM_TYPE_THEORA || stream->mTheora.mCtx!=NULL) continue;
+			if (read_headers(stream)!=0) {
+				if (i==0) {
+					*msg="Bad Theora headers.\n";
+					return -1;
+				}
+				stream->stream_type=STREAM_TYPE_OTHER;
+				continue;
+			}
+			if (stream->mTheora.mCtx==NULL) pending=1;
+		}
+		if (!pending) break;
+		if (get_next_page(tto)!=0) {
+			if (tto->input_blocked) return 0;
+			break;
+		}
+		route_page(tto);
+	}
+	if (tto->streams[0]->mTheora.mCtx==NULL) {
+		*msg="Could not read the Theora headers.\n";
+		return -1;
+	}
+	for (i=1;i<tto->num_streams;i++) {
+		if (tto->streams[i]->mTheora.mCtx==NULL) {
+			tto->streams[i]->stream_type=STREAM_TYPE_OTHER;
+		}
+	}
+	tto->headers_read=1;
+	/* The page we are on is a data page already (the decoder only starts
+	 * at the first data packet), so go back to the first video data page.
+	 * The other video streams pick up again at their next keyframe. */
+	tto->rewind_offset=tto->data_offset;
+	governor_init(tto);
+	stripe_init(tto);
+	return 1;
+}
+
+/* Set up the Ogg side and read the headers. For a channel they may not
+ * all be there yet; the rest are read as they come in. */
 int initialize_theora_stream (Tcl_Interp *interp, TclTheoraObject *tto) {
 	int ret;
 	char *msg=NULL;
@@ -362,147 +1111,7 @@ int initialize_theora_stream (Tcl_Interp *interp, TclTheoraObject *tto) {
 		msg="Error initializing ogg stream\n";
 		goto error;
 	}
-
-	/* Get at the first page */
-	if (get_next_page(tto)!=0) {
-		msg="Could not get a page from Ogg stream.\n";
-		goto error;
-	}
-
-	oggStream *oggstream=NULL;
-	ogg_stream_state stream_state;
-	int serial=ogg_page_serialno(tto->page);
-	int cur_stream=find_stream_by_serial(tto,serial);
-	if (ogg_page_bos(tto->page)) {
-		/* we are at the beginning of a stream */
-		if (cur_stream==-1) {
-			if (tto->num_streams==TCLTHEORA_MAX_NUM_STREAMS) {
-				msg="Too many streams in file.\n";
-				goto error;
-			}
-			cur_stream=tto->num_streams;
-			fprintf(stderr,"cur_stream=%d\n",cur_stream);
-			tto->streams[cur_stream]=(oggStream*)ckalloc(sizeof(oggStream));
-			memset(tto->streams[cur_stream],0,sizeof(oggStream));
-			fprintf(stderr,"tto->streams[%d]=%p\n",cur_stream,tto->streams[cur_stream]);
-			tto->streams[cur_stream]->mSerial=serial;
-			ogg_stream_init(&tto->streams[cur_stream]->mState,serial);
-			tto->num_streams++;
-		}
-		/* we are at the beginning of a stream */
-		ret=ogg_stream_init(&tto->streams[cur_stream]->mState,serial);
-	} else if (cur_stream==-1) {
-		fprintf(stderr,"Some error occurred!\n");
-		goto error;
-	}
-
-	/* from here on, use stream state  within oggstream */
-	/* copy the page into the stream */
-	ret = ogg_stream_pagein(&tto->streams[cur_stream]->mState,tto->page);
-	if (ret!=0) {
-		msg="Error in ogg_stream_pagein().\n";
-		goto error;
-	}
-	/* check to see if we have a full packet stored in the frame */
-	ogg_packet packet;
-	int done=0;
-	while (!done) {
-	  ret=ogg_stream_packetpeek(&tto->streams[cur_stream]->mState,&packet);
-		while (ret!=1) {
-			ret = get_next_page(tto);
-			if (ret!=0) break;
-			/* from here on, use stream state  within oggstream */
-			/* copy the page into the stream */
-			ret = ogg_stream_pagein(&tto->streams[cur_stream]->mState,tto->page);
-			if (ret!=0) {
-				msg="Error in ogg_stream_pagein().\n";
-				goto error;
-			}
-	  	ret=ogg_stream_packetpeek(&tto->streams[cur_stream]->mState,&packet);
-		}
-		if (ret==-1) {
-			fprintf(stderr,"Error. Ran out of data!\n");
-			break;
-		}
-		fprintf(stderr,"Got a packet\n");
-		tto->streams[cur_stream]->mPacketCount++;
-		/* is it a theora packet? */
-		int break_early=0;
-		if (!tto->headers_read) {
-			fprintf(stderr,"calling th_decode_headerin\n");
-			ret = th_decode_headerin(
-					&tto->streams[cur_stream]->mTheora.mInfo,
-					&tto->streams[cur_stream]->mTheora.mComment,
-					&tto->streams[cur_stream]->mTheora.mSetup,
-					&packet);
-			switch (ret) {
-				case TH_EFAULT:
-					fprintf(stderr,"TH_EFAULT\n");
-					break_early=1;
-					break;
-				case TH_EBADHEADER:
-					fprintf(stderr,"TH_EBADHEADER\n");
-					break_early=1;
-					break;
-				case TH_EVERSION:
-					fprintf(stderr,"TH_EVERSION\n");
-					break_early=1;
-					break;
-				case TH_ENOTFORMAT:
-					fprintf(stderr,"Not TH_ENOTFORMAT, but %d\n",ret);
-					break_early=1;
-					break;
-			}
-			if (break_early) {
-				/* advance the stream */
-	  		ogg_stream_packetout(&tto->streams[cur_stream]->mState,&packet);
-				continue;
-			}
-			/* otherwise it *is* a theora packet, therefore
-			 * we have a valid theora stream. We can finish setting everything
-			 * up, register a new command, and return.
-			 * But first, read any remaining headers.
-			 */
-			if (ret>0) {
-				fprintf(stderr,"ret=%d\n",ret);
-				/* then we have a header packet. Might as well get another one */
-				/* first advance the packet stream */
-	  		ret=ogg_stream_packetout(&tto->streams[cur_stream]->mState,&packet);
-				continue;
-			}
-			done=1;
-			tto->headers_read=1;
-			fprintf(stderr,"All headers read for stream %d\n",serial);
-			/* otherwise, we've found the first video data packet! */
-			if (tto->streams[cur_stream]->mTheora.mCtx==NULL) {
-				tto->streams[cur_stream]->mTheora.mCtx = th_decode_alloc(
-						&tto->streams[cur_stream]->mTheora.mInfo,
-						tto->streams[cur_stream]->mTheora.mSetup);
-			}
-			if (tto->streams[cur_stream]->mTheora.mCtx==NULL) {
-				Tcl_AppendResult(interp,"Error allocating Theora Context!\n",NULL);
-				goto error;
-			}
-#if 0
-			/* try to decode the data packet */
-			/* FIXME: For now, I need to do this here, otherwise we'll loose
-			 * the first frame, and the theora decode won't have the first
-			 * key-frame for reference. To fix this, I'll need to either
-			 * store the first data packet for later, to be used by the first
-			 * call to NextFrame. Or I'll have to make things smarter in some
-			 * other way. For now, just decode it to make everyone happy. (Well,
-			 * everyone except the user who wants to see the first frame!)
-			 */
-			ogg_int64_t granulepos=-1;
-			ret = th_decode_packetin(oggstream->mTheora.mCtx,&packet,&granulepos);
-			if (ret==0) {
-				/* then all we have to do is decode the frame */
-				th_ycbcr_buffer buffer;
-				ret = th_decode_ycbcr_out(oggstream->mTheora.mCtx,buffer);
-			}
-#endif
-		} 
-	}
+	if (read_stream_headers(tto,&msg)<0) goto error;
 	return TCL_OK;
 
 error:
@@ -511,37 +1120,79 @@ error:
 	return TCL_ERROR;
 }
 
+/* a new theora object with nothing opened yet */
+TclTheoraObject *theora_object_alloc (void) {
+	TclTheoraObject *tto=(TclTheoraObject*)ckalloc(sizeof(TclTheoraObject));
+	memset(tto,0,sizeof(TclTheoraObject));
+	tto->headers_read=0;
+	tto->granulepos=-1;
+	tto->data_offset=-1;
+	tto->rewind_offset=-1;
+	tto->pool.nthreads=1;
+	tto->player.rate=1.0;
+	frame_cache_init(tto);
+	return tto;
+}
+
 /* command to create a new TclTheora object */
 int TclTheora_New_Cmd(ClientData clientData, Tcl_Interp *interp,
 		int objc, Tcl_Obj *CONST objv[])
 {
 	FILE *fp=NULL;
+	Tcl_Channel chan=NULL;
 	char *msg="Error.\n";
 	int ret;
+	int mode;
 	TclTheoraObject *tto=NULL;
 
-	if (objc!=2) {
-		Tcl_WrongNumArgs(interp,1,objv,"ogv_file");
-		return TCL_ERROR;
-	}
-
-	/* Next, try to open the file */
-	fp=fopen(Tcl_GetString(objv[1]),"r");
-	if (fp==NULL) {
-		Tcl_AppendResult(interp,"Error opening file ",Tcl_GetString(objv[1])," .\n",
-				NULL);
+	if (objc==3 && strcmp(Tcl_GetString(objv[1]),"-channel")==0) {
+		/* read from an open Tcl channel (a pipe, say) */
+		chan=Tcl_GetChannel(interp,Tcl_GetString(objv[2]),&mode);
+		if (chan==NULL) return TCL_ERROR;
+		if (!(mode&TCL_READABLE)) {
+			Tcl_AppendResult(interp,"Channel ",Tcl_GetString(objv[2]),
+					" is not readable.\n",NULL);
+			return TCL_ERROR;
+		}
+	} else if (objc!=2) {
+		Tcl_WrongNumArgs(interp,1,objv,"ogv_file|-channel chan");
 		return TCL_ERROR;
+	} else {
+		/* Next, try to open the file */
+		fp=fopen(Tcl_GetString(objv[1]),"r");
+		if (fp==NULL) {
+			Tcl_AppendResult(interp,"Error opening file ",Tcl_GetString(objv[1])," .\n",
+					NULL);
+			return TCL_ERROR;
+		}
 	}
 	/* ok, make a theora object */
-	tto=(TclTheoraObject*)ckalloc(sizeof(TclTheoraObject));
-	tto->fp=fp;
-	tto->headers_read=0;
+	tto=theora_object_alloc();
+	if (chan!=NULL) {
+		tto->headers_proc=read_stream_headers;
+		if (input_open_channel(tto,interp,chan)!=TCL_OK) {
+			theora_destroy_func((void*)tto);
+			return TCL_ERROR;
+		}
+	} else {
+		tto->fp=fp;
+		tto->filename=ckalloc(strlen(Tcl_GetString(objv[1]))+1);
+		strcpy(tto->filename,Tcl_GetString(objv[1]));
+		if (input_open(tto,1)!=0) {
+			Tcl_AppendResult(interp,"Error reading file ",Tcl_GetString(objv[1])," .\n",
+					NULL);
+			theora_destroy_func((void*)tto);
+			return TCL_ERROR;
+		}
+	}
 
 	/*** is the file a theora stream? ***/
 	/* prepare the theora objects */
 	if (initialize_theora_stream(interp,tto)!=TCL_OK) {
 		return TCL_ERROR;
 	}
+	/* pick up the seek index a "buildIndex" saved, if there is one */
+	index_load(tto);
 	/* if we get here, we have a valid Theora data stream.
 	 * Need to create a unique command for operating on this Theora file */
 	char cmdname[1024];
@@ -560,25 +1211,62 @@ int TclTheora_New_Cmd(ClientData clientData, Tcl_Interp *interp,
 int TclTheora_NextFrame_Cmd(ClientData clientData, Tcl_Interp *interp,
 		int objc, Tcl_Obj *CONST objv[])
 {
-	FILE *fp=NULL;
-	char *msg="Error.\n";
-	int ret;
+	CONST char *options[] = {"-command","-scale","-filter","-crop","-gray",NULL};
+	enum NextOptIx {CommandIx,ScaleIx,FilterIx,CropIx,GrayIx};
+	CONST char *scales[] = {"1","1/2","1/4","1/8",NULL};
+	CONST char *filters[] = {"point","box",NULL};
 	TclTheoraObject *tto=NULL;
-	ogg_int64_t granulepos=-1;
-	th_ycbcr_buffer buffer;
+	Tcl_Obj *command=NULL;
+	frameFormat fmt;
+	int i,index,ret;
 
 	assert(clientData!=NULL);
 
-	if (objc!=2) {
-		Tcl_WrongNumArgs(interp,1,objv,"photo");
+	if (objc<2 || objc%2!=0) {
+		Tcl_WrongNumArgs(interp,1,objv,"photo ?-option value ...?");
 		return TCL_ERROR;
 	}
 
 	tto=(TclTheoraObject *)clientData;
+	memset(&fmt,0,sizeof(fmt));
+	for (i=2;i<objc;i+=2) {
+		if (Tcl_GetIndexFromObj(interp,objv[i],options,"option",0,&index)!=TCL_OK)
+			return TCL_ERROR;
+		switch (index) {
+			case CommandIx:
+				command=objv[i+1];
+				break;
+			case ScaleIx:
+				if (Tcl_GetIndexFromObj(interp,objv[i+1],scales,"scale",0,
+							&fmt.shift)!=TCL_OK) return TCL_ERROR;
+				break;
+			case FilterIx:
+				if (Tcl_GetIndexFromObj(interp,objv[i+1],filters,"filter",0,
+							&fmt.box)!=TCL_OK) return TCL_ERROR;
+				break;
+			case CropIx:
+				if (frame_format_crop(interp,tto,objv[i+1],&fmt)!=TCL_OK) return TCL_ERROR;
+				break;
+			case GrayIx:
+				if (Tcl_GetBooleanFromObj(interp,objv[i+1],&fmt.gray)!=TCL_OK)
+					return TCL_ERROR;
+				break;
+		}
+	}
+	/* -crop and -scale may come in either order, so check them together */
+	if (fmt.shift>0) {
+		th_info *info=&tto->streams[0]->mTheora.mInfo;
+		int w=fmt.crop?fmt.w:(int)info->pic_width;
+		int h=fmt.crop?fmt.h:(int)info->pic_height;
+		if ((w>>fmt.shift)==0 || (h>>fmt.shift)==0) {
+			Tcl_AppendResult(interp,"-scale leaves nothing of the picture\n",NULL);
+			return TCL_ERROR;
+		}
+	}
+	if (command!=NULL) return async_next(tto,interp,objv[1],command,&fmt);
 
 	/* Get a handle on the photo object */
 	Tk_PhotoHandle photo;
-	Tk_PhotoImageBlock dst;
 	char *str=Tcl_GetString(objv[1]);
 	photo = Tk_FindPhoto(interp,str);
 	if (photo==NULL) {
@@ -586,123 +1274,309 @@ int TclTheora_NextFrame_Cmd(ClientData clientData, Tcl_Interp *interp,
 		return TCL_ERROR;
 	}
 
-	/* finish reading any packets already in the stream */
-	ogg_packet packet;
-	oggStream *stream=tto->streams[0];
-	th_info *info=&stream->mTheora.mInfo;
-	/* FIXME: Only supports first stream for now */
-	/* Check to see if a packet is avaliable */
-	ret=ogg_stream_packetpeek(&stream->mState,&packet);
+	/* return 1 if we've recovered a frame, 0 if there are no frames left,
+	 * -1 if a channel has no frame for us yet */
+	ret=show_next_frame(tto,interp,photo,&fmt);
+	if (ret==-2) {
+		Tcl_AppendResult(interp,"Error seeking in file.\n",NULL);
+		return TCL_ERROR;
+	}
+	Tcl_SetObjResult(interp,Tcl_NewIntObj(ret));
+	return TCL_OK;
+}
+
+/* Put the next frame in photo, converted as fmt (which may be NULL) says.
+ * Returns 1 if there was one, 0 at the end of the stream, -1 if a channel
+ * has no frame for us yet, or -2 if the decoder could not take over from
+ * the prefetch worker. */
+int show_next_frame (TclTheoraObject *tto, Tcl_Interp *interp,
+		Tk_PhotoHandle photo, frameFormat *fmt)
+{
+	int ret;
+	ogg_int64_t granulepos=-1;
+	readyFrame *frame=NULL;
+	Tk_PhotoImageBlock dst;
+
+	/* back to decoding just the first stream */
+	multi_stop(tto);
+	/* the worker converts what it decodes ahead the way this one wants */
+	if (prefetch_format(tto,fmt)!=0) return -2;
+	/* frames decoded in the background are handed out first */
+	ret=prefetch_next(tto,&frame);
 	if (ret==0) {
-		/* then no packet available, so we need to get a new page */
-		if (get_next_page(tto)!=0) {
-			/* then we are at the end of the stream */
-			/* return 0 */
-			Tcl_SetObjResult(interp,Tcl_NewIntObj(0));
-			return TCL_OK;
-		}
-		ret = ogg_stream_pagein(&stream->mState,tto->page);
-		if (ret!=0) {
-			fprintf(stderr,"%s: Error in ogg_stream_pagein()\n",__func__);
+		/* the worker hit the end of the stream */
+		prefetch_stop(tto);
+		return 0;
+	}
+	if (ret!=1 && !frame_format_is_full(fmt)) {
+		/* otherwise decode it ourselves */
+		frame=&tto->formatted;
+		if (decode_next_frame_format(tto,fmt,frame,&granulepos)!=1) {
+			if (tto->input_blocked) return -1;
+			return 0;
 		}
-		ret=ogg_stream_packetpeek(&stream->mState,&packet);
+		ret=1;
 	}
 	if (ret==1) {
-		stream->mPacketCount++;
+		frame_format_block(fmt,frame,&dst);
+		Tk_PhotoSetSize(interp,photo,frame->width,frame->height);
+		photo_put_block(tto,interp,photo,&dst,0,0,frame->width,frame->height);
+		tto->granulepos=frame->granulepos;
+		if (frame!=&tto->formatted) prefetch_release(tto);
+		return 1;
 	}
-	/* actually advance the packet */
-	ret=ogg_stream_packetout(&stream->mState,&packet);
 
-	/* try to decode the data packet */
-	ret = th_decode_packetin(stream->mTheora.mCtx,&packet,&granulepos);
-	if (ret==0) {
-		/* then all we have to do is decode the frame */
-		ret = th_decode_ycbcr_out(stream->mTheora.mCtx,buffer);
-		/* ensure the photo is the correct size */
-		Tk_PhotoSetSize(interp,photo,info->pic_width,info->pic_height);
-		Tk_PhotoGetImage(photo,&dst);
-
-		ycbcr_to_rgb(&stream->mTheora.mInfo,buffer,&dst);
-		Tk_PhotoPutBlock(interp,photo,&dst,0,0,info->pic_width,info->pic_height,TK_PHOTO_COMPOSITE_SET);
-		/* return 1, since we've recovered a frame */
-		Tcl_SetObjResult(interp,Tcl_NewIntObj(1));
-		return TCL_OK;
+	/* otherwise decode it ourselves, straight into the photo */
+	th_info *info=&tto->streams[0]->mTheora.mInfo;
+	/* ensure the photo is the correct size */
+	Tk_PhotoSetSize(interp,photo,info->pic_width,info->pic_height);
+	Tk_PhotoGetImage(photo,&dst);
+	if (decode_next_frame_rgb(tto,&dst,interp,photo,&granulepos)!=1) {
+		/* a channel with no frame for us yet */
+		if (tto->input_blocked) return -1;
+		return 0;
 	}
+	tto->granulepos=granulepos;
+	return 1;
+}
 
-	/* otherwise, we need to get another page and try again */
-	int got_another_frame=0;
-	int cur_stream=-1;
-	while (get_next_page(tto)==0) {
-		/* Then we've acquired another page */
-		ogg_stream_state stream_state;
-		oggStream *newstream;
-		int serial=ogg_page_serialno(tto->page);
-		cur_stream=find_stream_by_serial(tto,serial);
-		if (ogg_page_bos(tto->page)) {
-			/* we are at the beginning of a stream */
-			if (cur_stream==-1) {
-				if (tto->num_streams==TCLTHEORA_MAX_NUM_STREAMS) {
-					msg="Too many streams in file.\n";
-					return TCL_ERROR;
-				}
-				tto->streams[tto->num_streams]=(oggStream*)ckalloc(sizeof(oggStream));
-				cur_stream=tto->num_streams;
-				tto->streams[cur_stream]->mSerial=serial;
-				ogg_stream_init(&tto->streams[cur_stream]->mState,serial);
-				tto->num_streams++;
-			}
-			/* we are at the beginning of a stream */
-			ret=ogg_stream_init(&tto->streams[cur_stream]->mState,serial);
-			/* we only handle the first data stream for now, so just
-			 * try to get another page for that stream.*/
-			continue;
-		} else if (cur_stream==-1) {
-			fprintf(stderr,"Some error occured!\n");
+/* Copy one plane of a decoded frame into a byte array, packed with
+ * stride equal to its width. The byte array of the previous frame is
+ * reused if the script has let go of it. */
+static Tcl_Obj *yuv_plane_obj (Tcl_Obj **cache, th_img_plane *plane) {
+	unsigned char *dst;
+	int row;
+	if (*cache==NULL || Tcl_IsShared(*cache)) {
+		if (*cache!=NULL) Tcl_DecrRefCount(*cache);
+		*cache=Tcl_NewByteArrayObj(NULL,0);
+		Tcl_IncrRefCount(*cache);
+	}
+	dst=Tcl_SetByteArrayLength(*cache,plane->width*plane->height);
+	for (row=0;row<plane->height;row++) {
+		memcpy(dst+row*plane->width,plane->data+row*plane->stride,plane->width);
+	}
+	return *cache;
+}
+
+/* Narrow the planes of buffer down to the smallest area that holds the
+ * picture rectangle x,y,w,h and starts and ends on whole chroma samples.
+ * Returns where the rectangle starts within the narrowed planes. */
+static void crop_planes (th_info *info, th_ycbcr_buffer buffer,
+		int x, int y, int w, int h, int *pic_x, int *pic_y)
+{
+	/* the same trick libtheora uses: bit 0 clear means half width chroma,
+	 * bit 1 clear means half height */
+	int hshift=!(info->pixel_fmt&1);
+	int vshift=!(info->pixel_fmt&2);
+	int hmask=(1<<hshift)-1;
+	int vmask=(1<<vshift)-1;
+	int fx0=((int)info->pic_x+x)&~hmask;
+	int fy0=((int)info->pic_y+y)&~vmask;
+	int fx1=((int)info->pic_x+x+w+hmask)&~hmask;
+	int fy1=((int)info->pic_y+y+h+vmask)&~vmask;
+	int i;
+	if (fx1>buffer[0].width) fx1=buffer[0].width;
+	if (fy1>buffer[0].height) fy1=buffer[0].height;
+	*pic_x=(int)info->pic_x+x-fx0;
+	*pic_y=(int)info->pic_y+y-fy0;
+	for (i=0;i<3;i++) {
+		int hs=i?hshift:0;
+		int vs=i?vshift:0;
+		buffer[i].data+=(fy0>>vs)*buffer[i].stride+(fx0>>hs);
+		buffer[i].width=(fx1-fx0)>>hs;
+		buffer[i].height=(fy1-fy0)>>vs;
+	}
+}
+
+/* The dict "nextYUV" and "scan" give for a frame. planes say how big
+ * the three planes are (packed, so that is their stride too), data holds
+ * the first nplanes of them, and the picture is pic_w by pic_h at
+ * pic_x,pic_y within them. */
+Tcl_Obj *yuv_frame_obj (th_info *info, th_img_plane *planes, Tcl_Obj **data,
+		int nplanes, int pic_x, int pic_y, int pic_w, int pic_h)
+{
+	CONST char *formats[] = {"420","rsvd","422","444"};
+	CONST char *names[] = {"y","cb","cr"};
+	CONST char *strides[] = {"yStride","cbStride","crStride"};
+	Tcl_Obj *result=Tcl_NewDictObj();
+	int i;
+	dict_put(result,"format",Tcl_NewStringObj(formats[info->pixel_fmt&3],-1));
+	dict_put_int(result,"width",planes[0].width);
+	dict_put_int(result,"height",planes[0].height);
+	dict_put_int(result,"chromaWidth",planes[1].width);
+	dict_put_int(result,"chromaHeight",planes[1].height);
+	dict_put_int(result,"picX",pic_x);
+	dict_put_int(result,"picY",pic_y);
+	dict_put_int(result,"picWidth",pic_w);
+	dict_put_int(result,"picHeight",pic_h);
+	for (i=0;i<nplanes;i++) {
+		dict_put(result,names[i],data[i]);
+		dict_put_int(result,strides[i],planes[i].width);
+	}
+	return result;
+}
+
+/* command to decode the next frame and return its Y'CbCr planes as a
+ * dict, without converting it or touching Tk. Returns an empty result
+ * at the end of the file, or -1 if a channel has no frame yet. With -crop only the part of the planes that
+ * covers the rectangle is returned, and picX.. say where it lies. */
+int TclTheora_NextYUV_Cmd(ClientData clientData, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[])
+{
+	CONST char *options[] = {"-crop","-gray",NULL};
+	enum YUVOptIx {CropIx,GrayIx};
+	TclTheoraObject *tto=(TclTheoraObject *)clientData;
+	ogg_int64_t granulepos=-1;
+	th_ycbcr_buffer buffer;
+	th_info *info;
+	Tcl_Obj *data[3];
+	Tcl_Time start;
+	frameFormat fmt;
+	int pic_x,pic_y,pic_w,pic_h;
+	int i,index;
+
+	memset(&fmt,0,sizeof(fmt));
+	if (objc%2!=1) {
+		Tcl_WrongNumArgs(interp,1,objv,"?-crop {x y w h}? ?-gray bool?");
+		return TCL_ERROR;
+	}
+	for (i=1;i<objc;i+=2) {
+		if (Tcl_GetIndexFromObj(interp,objv[i],options,"option",0,&index)!=TCL_OK)
 			return TCL_ERROR;
-			/* FIXME: Hmmm. Maybe the error label below shouldn't free oggstream */
-			//stream=find_stream_by_serialno(tto,serial);
-			/* we'll just use the "stream" value already set way above */
-		}
-		/* copy the page into the stream */
-		ret = ogg_stream_pagein(&tto->streams[cur_stream]->mState,tto->page);
-		if (ret!=0) {
-			fprintf(stderr,"Error in ogg_stream_page_in() for stream %d\n",serial);
-			fclose(fp);
+		if (index==CropIx) {
+			if (frame_format_crop(interp,tto,objv[i+1],&fmt)!=TCL_OK) return TCL_ERROR;
+		} else if (Tcl_GetBooleanFromObj(interp,objv[i+1],&fmt.gray)!=TCL_OK) {
 			return TCL_ERROR;
 		}
-		/* check to see if we have a full packet stored in the frame */
-		ogg_packet packet;
-		while (ogg_stream_packetout(&tto->streams[cur_stream]->mState,&packet)!=0) {
-			tto->streams[cur_stream]->mPacketCount++;
-		}
-		/* try to decode the data packet */
-		ret = th_decode_packetin(tto->streams[cur_stream]->mTheora.mCtx,&packet,&granulepos);
-		if (ret==0) {
-			/* then all we have to do is decode the frame */
-			ret = th_decode_ycbcr_out(tto->streams[cur_stream]->mTheora.mCtx,buffer);
-			ycbcr_to_rgb(&tto->streams[cur_stream]->mTheora.mInfo,buffer,&dst);
-			Tk_PhotoPutBlock(interp,photo,&dst,0,0,info->pic_width,info->pic_height,TK_PHOTO_COMPOSITE_SET);
-			/* return 1, since we've recovered a frame */
-			Tcl_SetObjResult(interp,Tcl_NewIntObj(1));
+	}
+	multi_stop(tto);
+	/* the background decoder only keeps RGBA, so take over from it */
+	if (prefetch_sync(tto)!=0) {
+		Tcl_AppendResult(interp,"Error seeking in file.\n",NULL);
+		return TCL_ERROR;
+	}
+	if (decode_next_frame(tto,buffer,&granulepos)!=1) {
+		if (tto->input_blocked) {
+			/* a channel with no frame for us yet */
+			Tcl_SetObjResult(interp,Tcl_NewIntObj(-1));
 			return TCL_OK;
 		}
+		Tcl_ResetResult(interp);
+		return TCL_OK;
+	}
+	tto->granulepos=granulepos;
+	info=&tto->streams[0]->mTheora.mInfo;
+
+	Tcl_GetTime(&start);
+	pic_x=info->pic_x;
+	pic_y=info->pic_y;
+	pic_w=info->pic_width;
+	pic_h=info->pic_height;
+	if (fmt.crop) {
+		crop_planes(info,buffer,fmt.x,fmt.y,fmt.w,fmt.h,&pic_x,&pic_y);
+		pic_w=fmt.w;
+		pic_h=fmt.h;
 	}
-	/* return 0, there are no frames left */
-	Tcl_SetObjResult(interp,Tcl_NewIntObj(0));
+	/* with -gray the chroma planes are not even copied */
+	for (i=0;i<(fmt.gray?1:3);i++) {
+		data[i]=yuv_plane_obj(&tto->yuv_planes[i],&buffer[i]);
+	}
+	Tcl_SetObjResult(interp,yuv_frame_obj(info,buffer,data,fmt.gray?1:3,
+				pic_x,pic_y,pic_w,pic_h));
+	governor_converted(tto,governor_elapsed(&start));
+	return TCL_OK;
+}
+
+/* the serial numbers of the video streams; the first is the one that
+ * "next" and friends decode */
+int TclTheora_VideoStreams_Cmd(ClientData clientData, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[])
+{
+	TclTheoraObject *tto=(TclTheoraObject *)clientData;
+	oggStream *streams[TCLTHEORA_MAX_NUM_STREAMS];
+	Tcl_Obj *result=Tcl_NewListObj(0,NULL);
+	int i,n;
+	n=multi_video_streams(tto,streams);
+	for (i=0;i<n;i++) {
+		Tcl_ListObjAppendElement(interp,result,Tcl_NewIntObj(streams[i]->mSerial));
+	}
+	Tcl_SetObjResult(interp,result);
+	return TCL_OK;
+}
+
+/* Decode the next frame of every video stream in the file, each on its
+ * own thread, and put the i'th one in the i'th photo (an empty name
+ * skips that stream). The first stream moves on a frame each time, and
+ * the others catch up to it by time, so a photo is left alone when its
+ * stream has no new frame yet. Returns the number of streams that had a
+ * new frame. */
+int TclTheora_NextAll_Cmd(ClientData clientData, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[])
+{
+	TclTheoraObject *tto=(TclTheoraObject *)clientData;
+	Tk_PhotoHandle photos[TCLTHEORA_MAX_NUM_STREAMS];
+	Tk_PhotoImageBlock block;
+	int i,n;
+
+	if (objc-1>TCLTHEORA_MAX_NUM_STREAMS) {
+		Tcl_AppendResult(interp,"Too many photos.\n",NULL);
+		return TCL_ERROR;
+	}
+	for (i=1;i<objc;i++) {
+		char *str=Tcl_GetString(objv[i]);
+		photos[i-1]=NULL;
+		if (*str=='\0') continue;
+		photos[i-1]=Tk_FindPhoto(interp,str);
+		if (photos[i-1]==NULL) {
+			Tcl_AppendResult(interp,"Cannot find photo \"",str,"\"",NULL);
+			return TCL_ERROR;
+		}
+	}
+	/* the background decoder only does the first stream */
+	if (prefetch_sync(tto)!=0) {
+		Tcl_AppendResult(interp,"Error seeking in file.\n",NULL);
+		return TCL_ERROR;
+	}
+	n=multi_next(tto);
+	if (n<0) {
+		Tcl_AppendResult(interp,"Could not start stream decode threads.\n",NULL);
+		return TCL_ERROR;
+	}
+	if (n==0 && tto->input_blocked) {
+		/* a channel with no frames for us yet */
+		Tcl_SetObjResult(interp,Tcl_NewIntObj(-1));
+		return TCL_OK;
+	}
+	for (i=0;i<objc-1 && i<tto->multi_count;i++) {
+		readyFrame *frame=&tto->multi[i].frame;
+		if (photos[i]==NULL || !tto->multi[i].got_frame) continue;
+		block.pixelPtr=frame->pixels;
+		block.width=frame->width;
+		block.height=frame->height;
+		block.pitch=4*frame->width;
+		block.pixelSize=4;
+		block.offset[0]=0;
+		block.offset[1]=1;
+		block.offset[2]=2;
+		block.offset[3]=3;
+		Tk_PhotoSetSize(interp,photos[i],frame->width,frame->height);
+		photo_put_block(tto,interp,photos[i],&block,0,0,frame->width,frame->height);
+	}
+	Tcl_SetObjResult(interp,Tcl_NewIntObj(n));
 	return TCL_OK;
 }
 
 int theora_cmd(ClientData clientData, Tcl_Interp *interp,
 		int objc, Tcl_Obj *CONST objv[])
 {
-	CONST char *subCmds[] = {"new",NULL};
-	enum TheoraCmdIx {NewIx,};
+	CONST char *subCmds[] = {"new","probe","probeMany","scan",NULL};
+	enum TheoraCmdIx {NewIx,ProbeIx,ProbeManyIx,ScanIx};
 	int index;
 
 	Tcl_ResetResult(interp);
 
-	if (objc!=3) {
-		Tcl_WrongNumArgs(interp,1,objv,"new file");
+	if (objc<2) {
+		Tcl_WrongNumArgs(interp,1,objv,"new|probe|probeMany|scan ?arg ...?");
 		return TCL_ERROR;
 	}
 
@@ -711,8 +1585,21 @@ int theora_cmd(ClientData clientData, Tcl_Interp *interp,
 
 	switch (index) {
 		case NewIx:
+			if (objc<3 || objc>4) {
+				Tcl_WrongNumArgs(interp,1,objv,"new file|-channel chan");
+				return TCL_ERROR;
+			}
 			return TclTheora_New_Cmd(clientData,interp,objc-1,objv+1);
 			break;
+		case ProbeIx:
+			return TclTheora_Probe_Cmd(clientData,interp,objc-1,objv+1);
+			break;
+		case ProbeManyIx:
+			return TclTheora_ProbeMany_Cmd(clientData,interp,objc-1,objv+1);
+			break;
+		case ScanIx:
+			return TclTheora_Scan_Cmd(clientData,interp,objc-1,objv+1);
+			break;
 		default:
 			Tcl_AppendResult(interp,"Unknown subcommand.\n",NULL);
 			return TCL_ERROR;
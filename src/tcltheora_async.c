@@ -0,0 +1,330 @@
+/*
+ * This file is part of MVTH - the Machine Vision Test Harness.
+ *
+ * "next photo -command script": decode and convert the next frame on a
+ * thread of its own, then put it in the photo and run the script from
+ * the event loop of the interpreter's thread.
+ *
+ * Copyright (C) 2011 Samuel P. Bromley <sam@sambromley.com>
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License Version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (see the file named "COPYING"), and a copy of the GNU Lesser General
+ * Public License (see the file named "COPYING.LESSER") along with MVTH.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tcl.h>
+#include <tk.h>
+#include "tcltheora.h"
+
+/* Each object has one decode thread, started by its first request and
+ * kept until the object goes. While it works on a request it owns the
+ * decoder, just like the prefetch worker does; every subcommand waits for
+ * it first (see async_wait()). The photo and the script are only touched
+ * from the interpreter's thread, when the event comes back. */
+
+typedef struct asyncEvent_s {
+	Tcl_Event header; /* must be first */
+	asyncRequest *req;
+} asyncEvent;
+
+static int async_event_proc (Tcl_Event *evPtr, int flags);
+
+static void async_free (asyncRequest *req) {
+	if (req->frame.pixels!=NULL) ckfree((char*)req->frame.pixels);
+	Tcl_DecrRefCount(req->photo);
+	Tcl_DecrRefCount(req->command);
+	ckfree((char*)req);
+}
+
+/* Get the next frame into req->frame. Returns 1 for a frame, 0 at the
+ * end of the stream, or -1 if a channel has no frame for us yet. */
+static int async_decode (asyncRequest *req) {
+	TclTheoraObject *tto=req->tto;
+	th_info *info=&tto->streams[0]->mTheora.mInfo;
+	th_dec_ctx *ctx=tto->streams[0]->mTheora.mCtx;
+	readyFrame *slot=NULL;
+	readyFrame tmp;
+	Tk_PhotoImageBlock block;
+	ogg_int64_t granulepos=-1;
+	int ret;
+
+	/* the prefetch worker converts frames the way this one wants them */
+	if (prefetch_format(tto,&req->format)!=0) {
+		req->status=0;
+		return 0;
+	}
+	if ((ret=prefetch_next(tto,&slot))==1) {
+		/* take the slot's pixels, and leave it ours to fill next time */
+		tmp=*slot;
+		*slot=req->frame;
+		req->frame=tmp;
+		prefetch_release(tto);
+	} else if (ret==0) {
+		prefetch_stop(tto);
+		req->status=0;
+		return 0;
+	} else if (!frame_format_is_full(&req->format)) {
+		if (decode_next_frame_format(tto,&req->format,&req->frame,&granulepos)!=1) {
+			if (tto->input_blocked) return -1;
+			req->status=0;
+			return 0;
+		}
+	} else {
+		readyFrame *frame=&req->frame;
+		if (frame->pixels==NULL || frame->width!=(int)info->pic_width
+				|| frame->height!=(int)info->pic_height) {
+			if (frame->pixels!=NULL) ckfree((char*)frame->pixels);
+			frame->width=info->pic_width;
+			frame->height=info->pic_height;
+			frame->pixels=(unsigned char*)ckalloc(4*frame->width*frame->height);
+		}
+		block.pixelPtr=frame->pixels;
+		block.width=frame->width;
+		block.height=frame->height;
+		block.pitch=4*frame->width;
+		block.pixelSize=4;
+		block.offset[0]=0;
+		block.offset[1]=1;
+		block.offset[2]=2;
+		block.offset[3]=3;
+		if (decode_next_frame_rgb(tto,&block,NULL,NULL,&granulepos)!=1) {
+			if (tto->input_blocked) return -1;
+			req->status=0;
+			return 0;
+		}
+		frame->granulepos=granulepos;
+	}
+	tto->granulepos=req->frame.granulepos;
+	req->number=th_granule_frame(ctx,req->frame.granulepos);
+	/* when the frame starts, not when it ends as th_granule_time() has it */
+	req->time=(double)req->number*info->fps_denominator/info->fps_numerator;
+	req->status=1;
+	return 1;
+}
+
+/* hand the finished request back to the interpreter's thread */
+static void async_post (asyncRequest *req) {
+	asyncEvent *ev=(asyncEvent*)ckalloc(sizeof(asyncEvent));
+	ev->header.proc=async_event_proc;
+	ev->req=req;
+	Tcl_ThreadQueueEvent(req->owner,&ev->header,TCL_QUEUE_TAIL);
+	Tcl_ThreadAlert(req->owner);
+}
+
+static Tcl_ThreadCreateType async_thread (ClientData clientData) {
+	TclTheoraObject *tto=(TclTheoraObject *)clientData;
+	asyncRequest *req;
+	Tcl_MutexLock(&tto->async_lock);
+	for (;;) {
+		while (!tto->async_stop && tto->async_job==NULL) {
+			Tcl_ConditionWait(&tto->async_cond,&tto->async_lock,NULL);
+		}
+		if (tto->async_stop) break;
+		req=tto->async_job;
+		Tcl_MutexUnlock(&tto->async_lock);
+		async_decode(req);
+		/* queued before we say we are done, so async_cancel() finds it */
+		async_post(req);
+		Tcl_MutexLock(&tto->async_lock);
+		tto->async_job=NULL;
+		Tcl_ConditionNotify(&tto->async_cond);
+	}
+	Tcl_MutexUnlock(&tto->async_lock);
+	TCL_THREAD_CREATE_RETURN;
+}
+
+/* let the decode thread go */
+static void async_stop (TclTheoraObject *tto) {
+	int result;
+	if (tto->async_running) {
+		Tcl_MutexLock(&tto->async_lock);
+		tto->async_stop=1;
+		Tcl_ConditionNotify(&tto->async_cond);
+		Tcl_MutexUnlock(&tto->async_lock);
+		Tcl_JoinThread(tto->async_thread,&result);
+		tto->async_running=0;
+	}
+	Tcl_MutexFinalize(&tto->async_lock);
+	Tcl_ConditionFinalize(&tto->async_cond);
+}
+
+/* more data came in on the channel a request is waiting on */
+static void async_channel_proc (ClientData clientData, int mask) {
+	asyncRequest *req=(asyncRequest *)clientData;
+	TclTheoraObject *tto=req->tto;
+	(void)mask;
+	if (async_decode(req)<0) return;
+	Tcl_DeleteChannelHandler(tto->channel,async_channel_proc,(ClientData)req);
+	req->waiting=0;
+	tto->async=NULL;
+	async_post(req);
+}
+
+/* back on the interpreter's thread: show the frame and run the script */
+static int async_event_proc (Tcl_Event *evPtr, int flags) {
+	asyncRequest *req=((asyncEvent *)evPtr)->req;
+	TclTheoraObject *tto=req->tto;
+	Tcl_Interp *interp=req->interp;
+	Tcl_Obj *cmd;
+	Tk_PhotoHandle photo;
+	Tk_PhotoImageBlock block;
+	readyFrame *frame=&req->frame;
+
+	(void)flags;
+	if (tto->async==req) async_wait(tto);
+	Tcl_Preserve((ClientData)interp);
+	cmd=Tcl_DuplicateObj(req->command);
+	Tcl_IncrRefCount(cmd);
+	if (req->status==1) {
+		photo=Tk_FindPhoto(interp,Tcl_GetString(req->photo));
+		if (photo==NULL) {
+			Tcl_ResetResult(interp);
+			Tcl_AppendResult(interp,"Cannot find photo \"",
+					Tcl_GetString(req->photo),"\"",NULL);
+			Tcl_BackgroundError(interp);
+			goto done;
+		}
+		frame_format_block(&req->format,frame,&block);
+		Tk_PhotoSetSize(interp,photo,frame->width,frame->height);
+		photo_put_block(tto,interp,photo,&block,0,0,frame->width,frame->height);
+		Tcl_ListObjAppendElement(NULL,cmd,Tcl_NewWideIntObj(req->number));
+		Tcl_ListObjAppendElement(NULL,cmd,Tcl_NewDoubleObj(req->time));
+		/* keep the pixels for the next request */
+		if (tto->async_spare.pixels!=NULL) ckfree((char*)tto->async_spare.pixels);
+		tto->async_spare=*frame;
+		memset(frame,0,sizeof(readyFrame));
+	} else {
+		Tcl_ListObjAppendElement(NULL,cmd,Tcl_NewIntObj(-1));
+		Tcl_ListObjAppendElement(NULL,cmd,Tcl_NewDoubleObj(-1.0));
+	}
+	/* the script may well destroy the object, so we are done with it */
+	if (Tcl_EvalObjEx(interp,cmd,TCL_EVAL_GLOBAL)!=TCL_OK) {
+		Tcl_BackgroundError(interp);
+	}
+done:
+	Tcl_DecrRefCount(cmd);
+	Tcl_Release((ClientData)interp);
+	async_free(req);
+	return 1;
+}
+
+/* Start getting the next frame in the background, converted as fmt says.
+ * It is put in the photo named by photo, and then command is run with the
+ * frame number and time appended (-1 -1 at the end of the stream). */
+int async_next (TclTheoraObject *tto, Tcl_Interp *interp, Tcl_Obj *photo,
+		Tcl_Obj *command, frameFormat *fmt)
+{
+	asyncRequest *req;
+
+	async_wait(tto);
+	if (tto->async!=NULL) {
+		Tcl_AppendResult(interp,"Still waiting on the channel for the last frame.\n",
+				NULL);
+		return TCL_ERROR;
+	}
+	if (Tk_FindPhoto(interp,Tcl_GetString(photo))==NULL) {
+		Tcl_AppendResult(interp,"Cannot find photo \"",Tcl_GetString(photo),"\"",NULL);
+		return TCL_ERROR;
+	}
+	/* back to decoding just the first stream */
+	multi_stop(tto);
+
+	req=(asyncRequest*)ckalloc(sizeof(asyncRequest));
+	memset(req,0,sizeof(asyncRequest));
+	req->tto=tto;
+	req->interp=interp;
+	req->owner=Tcl_GetCurrentThread();
+	req->photo=photo;
+	Tcl_IncrRefCount(photo);
+	req->command=command;
+	Tcl_IncrRefCount(command);
+	req->format=*fmt;
+	req->frame=tto->async_spare;
+	memset(&tto->async_spare,0,sizeof(readyFrame));
+
+	if (tto->channel!=NULL) {
+		/* a channel can only be read here, so wait for it to have a frame */
+		if (async_decode(req)<0) {
+			req->waiting=1;
+			tto->async=req;
+			Tcl_CreateChannelHandler(tto->channel,TCL_READABLE,async_channel_proc,
+					(ClientData)req);
+			return TCL_OK;
+		}
+		async_post(req);
+		return TCL_OK;
+	}
+	if (!tto->async_running) {
+		tto->async_stop=0;
+		tto->async_job=NULL;
+		if (Tcl_CreateThread(&tto->async_thread,async_thread,(ClientData)tto,
+					TCL_THREAD_STACK_DEFAULT,TCL_THREAD_JOINABLE)!=TCL_OK) {
+			async_free(req);
+			Tcl_AppendResult(interp,"Could not start decode thread.\n",NULL);
+			return TCL_ERROR;
+		}
+		tto->async_running=1;
+	}
+	req->running=1;
+	tto->async=req;
+	Tcl_MutexLock(&tto->async_lock);
+	tto->async_job=req;
+	Tcl_ConditionNotify(&tto->async_cond);
+	Tcl_MutexUnlock(&tto->async_lock);
+	return TCL_OK;
+}
+
+/* Wait for the decode thread to finish the request, so that the decoder
+ * is ours again. Its event may still be queued, and is delivered as usual. */
+void async_wait (TclTheoraObject *tto) {
+	asyncRequest *req=tto->async;
+	if (req==NULL || !req->running) return;
+	Tcl_MutexLock(&tto->async_lock);
+	while (tto->async_job!=NULL) {
+		Tcl_ConditionWait(&tto->async_cond,&tto->async_lock,NULL);
+	}
+	Tcl_MutexUnlock(&tto->async_lock);
+	req->running=0;
+	tto->async=NULL;
+}
+
+static int async_event_match (Tcl_Event *evPtr, ClientData clientData) {
+	asyncRequest *req;
+	if (evPtr->proc!=async_event_proc) return 0;
+	req=((asyncEvent *)evPtr)->req;
+	if (req->tto!=(TclTheoraObject *)clientData) return 0;
+	async_free(req);
+	return 1;
+}
+
+/* forget about every request of an object that is going away */
+void async_cancel (TclTheoraObject *tto) {
+	async_wait(tto);
+	async_stop(tto);
+	if (tto->async!=NULL) {
+		/* still waiting on its channel */
+		Tcl_DeleteChannelHandler(tto->channel,async_channel_proc,(ClientData)tto->async);
+		async_free(tto->async);
+		tto->async=NULL;
+	}
+	Tcl_DeleteEvents(async_event_match,(ClientData)tto);
+	if (tto->async_spare.pixels!=NULL) ckfree((char*)tto->async_spare.pixels);
+	memset(&tto->async_spare,0,sizeof(readyFrame));
+}
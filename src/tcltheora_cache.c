@@ -0,0 +1,438 @@
+/*
+ * This file is part of MVTH - the Machine Vision Test Harness.
+ *
+ * Keep recently decoded frames, as Y'CbCr, so that stepping back and forth
+ * around a frame ("$t frame N") does not decode them over and over.
+ *
+ * Copyright (C) 2011 Samuel P. Bromley <sam@sambromley.com>
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License Version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (see the file named "COPYING"), and a copy of the GNU Lesser General
+ * Public License (see the file named "COPYING.LESSER") along with MVTH.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <tcl.h>
+#include <tk.h>
+#include "tcltheora.h"
+
+/* The cache is only touched by whoever owns the decoder (the interpreter
+ * thread, or a "next -command" decode thread while it runs), never by the
+ * prefetch worker. Frames are least recently used first out once the
+ * byte budget is reached. */
+
+#define FRAME_CACHE_DEFAULT (32*1024*1024)
+
+static Tcl_HashEntry *cache_entry (frameCache *c, ogg_int64_t frame) {
+	return Tcl_FindHashEntry(&c->frames,(char *)(intptr_t)frame);
+}
+
+static void cache_unlink (frameCache *c, cachedFrame *f) {
+	if (f->newer!=NULL) f->newer->older=f->older;
+	else c->newest=f->older;
+	if (f->older!=NULL) f->older->newer=f->newer;
+	else c->oldest=f->newer;
+	f->newer=f->older=NULL;
+}
+
+static void cache_push (frameCache *c, cachedFrame *f) {
+	f->newer=NULL;
+	f->older=c->newest;
+	if (c->newest!=NULL) c->newest->newer=f;
+	c->newest=f;
+	if (c->oldest==NULL) c->oldest=f;
+}
+
+static void cache_evict (frameCache *c, cachedFrame *f) {
+	Tcl_HashEntry *entry=cache_entry(c,f->frame);
+	if (entry!=NULL) Tcl_DeleteHashEntry(entry);
+	cache_unlink(c,f);
+	c->bytes-=f->bytes;
+	ckfree((char*)f);
+}
+
+/* make room for bytes more */
+static void cache_trim (frameCache *c, ogg_int64_t bytes) {
+	while (c->oldest!=NULL && c->bytes+bytes>c->budget) cache_evict(c,c->oldest);
+}
+
+void frame_cache_init (TclTheoraObject *tto) {
+	frameCache *c=&tto->cache;
+	Tcl_InitHashTable(&c->frames,TCL_ONE_WORD_KEYS);
+	c->budget=FRAME_CACHE_DEFAULT;
+	c->resume=-1;
+}
+
+void frame_cache_free (TclTheoraObject *tto) {
+	frameCache *c=&tto->cache;
+	cachedFrame *f;
+	frame_cache_wait(tto);
+	while (c->oldest!=NULL) cache_evict(c,c->oldest);
+	while ((f=c->held)!=NULL) {
+		c->held=f->older;
+		ckfree((char*)f);
+	}
+	c->held_oldest=NULL;
+	Tcl_DeleteHashTable(&c->frames);
+}
+
+/* change the budget, throwing out frames if it shrank */
+void frame_cache_set_budget (TclTheoraObject *tto, ogg_int64_t bytes) {
+	frameCache *c=&tto->cache;
+	c->budget=bytes;
+	cache_trim(c,0);
+}
+
+/* the cached frame, made the most recently used, or NULL */
+static cachedFrame *cache_find (frameCache *c, ogg_int64_t frame) {
+	Tcl_HashEntry *entry=cache_entry(c,frame);
+	cachedFrame *f;
+	if (entry==NULL) return NULL;
+	f=(cachedFrame *)Tcl_GetHashValue(entry);
+	cache_unlink(c,f);
+	cache_push(c,f);
+	return f;
+}
+
+/* the bytes a copy of buffer takes */
+static ogg_int64_t cache_bytes (th_ycbcr_buffer buffer) {
+	ogg_int64_t bytes=sizeof(cachedFrame);
+	int i;
+	for (i=0;i<3;i++) bytes+=(ogg_int64_t)buffer[i].width*buffer[i].height;
+	return bytes;
+}
+
+/* a copy of the planes of a decoded frame */
+static cachedFrame *cache_copy (th_ycbcr_buffer buffer, ogg_int64_t frame,
+		ogg_int64_t granulepos, ogg_int64_t bytes)
+{
+	cachedFrame *f=(cachedFrame*)ckalloc(bytes);
+	unsigned char *data=(unsigned char *)(f+1);
+	int i,row;
+	f->frame=frame;
+	f->granulepos=granulepos;
+	f->bytes=bytes;
+	f->newer=f->older=NULL;
+	for (i=0;i<3;i++) {
+		th_img_plane *plane=&f->buffer[i];
+		*plane=buffer[i];
+		plane->stride=plane->width;
+		plane->data=data;
+		for (row=0;row<plane->height;row++) {
+			memcpy(data+row*plane->width,buffer[i].data+row*buffer[i].stride,
+					plane->width);
+		}
+		data+=plane->width*plane->height;
+	}
+	return f;
+}
+
+/* add f as the most recently used frame (or free it, if it is there) */
+static void cache_insert (frameCache *c, cachedFrame *f) {
+	Tcl_HashEntry *entry;
+	int isnew;
+	if (f->bytes>c->budget || cache_find(c,f->frame)!=NULL) {
+		ckfree((char*)f);
+		return;
+	}
+	cache_trim(c,f->bytes);
+	entry=Tcl_CreateHashEntry(&c->frames,(char *)(intptr_t)f->frame,&isnew);
+	Tcl_SetHashValue(entry,(ClientData)f);
+	cache_push(c,f);
+	c->bytes+=f->bytes;
+}
+
+/* keep a copy of the planes of a decoded frame */
+static void cache_store (TclTheoraObject *tto, th_ycbcr_buffer buffer,
+		ogg_int64_t granulepos)
+{
+	frameCache *c=&tto->cache;
+	ogg_int64_t frame=th_granule_frame(tto->streams[0]->mTheora.mCtx,granulepos);
+	ogg_int64_t bytes=cache_bytes(buffer);
+	if (frame<0 || bytes>c->budget || cache_find(c,frame)!=NULL) return;
+	cache_insert(c,cache_copy(buffer,frame,granulepos,bytes));
+}
+
+/* The decoder just produced the frame at granulepos without anyone
+ * fetching it (on the way to a seek target); keep it if there is room.
+ * On the reverse thread it is put aside until frame_cache_wait(). */
+void frame_cache_decoded (TclTheoraObject *tto, ogg_int64_t granulepos) {
+	frameCache *c=&tto->cache;
+	th_dec_ctx *ctx=tto->streams[0]->mTheora.mCtx;
+	th_ycbcr_buffer buffer;
+	ogg_uint64_t start;
+	ogg_int64_t frame,bytes,limit;
+	cachedFrame *f;
+	if (c->budget<=0 || granulepos<0) return;
+	frame=th_granule_frame(ctx,granulepos);
+	/* the reverse thread must leave the cache itself alone */
+	if (!c->collecting && cache_find(c,frame)!=NULL) return;
+	/* and keeps nothing from before the keyframe of its group */
+	if (c->collecting && frame<c->group_start) return;
+	start=stats_now();
+	th_decode_ycbcr_out(ctx,buffer);
+	stats_time(&tto->stats,STATS_YCBCR_OUT,start);
+	if (!c->collecting) {
+		cache_store(tto,buffer,granulepos);
+		return;
+	}
+	bytes=cache_bytes(buffer);
+	/* "prev" wants the latest frames first, so room is made at the old
+	 * end; a whole group of pictures always fits, whatever the budget */
+	limit=bytes<<tto->streams[0]->mTheora.mInfo.keyframe_granule_shift;
+	if (limit<c->budget) limit=c->budget;
+	while (c->pending_oldest!=NULL && c->pending_bytes+bytes>limit) {
+		f=c->pending_oldest;
+		c->pending_oldest=f->newer;
+		if (c->pending_oldest!=NULL) c->pending_oldest->older=NULL;
+		else c->pending=NULL;
+		c->pending_bytes-=f->bytes;
+		ckfree((char*)f);
+	}
+	f=cache_copy(buffer,frame,granulepos,bytes);
+	f->older=c->pending;
+	if (c->pending!=NULL) c->pending->newer=f;
+	else c->pending_oldest=f;
+	c->pending=f;
+	c->pending_bytes+=bytes;
+}
+
+/* convert a frame at full size and put it in photo */
+static void cache_show (TclTheoraObject *tto, Tcl_Interp *interp,
+		Tk_PhotoHandle photo, th_ycbcr_buffer buffer)
+{
+	th_info *info=&tto->streams[0]->mTheora.mInfo;
+	readyFrame *frame=&tto->formatted;
+	Tk_PhotoImageBlock block;
+	if (frame->pixels==NULL || frame->width!=(int)info->pic_width
+			|| frame->height!=(int)info->pic_height) {
+		if (frame->pixels!=NULL) ckfree((char*)frame->pixels);
+		frame->width=info->pic_width;
+		frame->height=info->pic_height;
+		frame->pixels=(unsigned char*)ckalloc(4*frame->width*frame->height);
+	}
+	frame_format_block(NULL,frame,&block);
+	pool_convert(tto,info,buffer,&block);
+	Tk_PhotoSetSize(interp,photo,frame->width,frame->height);
+	photo_put_block(tto,interp,photo,&block,0,0,frame->width,frame->height);
+}
+
+/* show a cached frame, and leave "next" to carry on after it */
+static void cache_hit (TclTheoraObject *tto, Tcl_Interp *interp,
+		Tk_PhotoHandle photo, cachedFrame *f)
+{
+	frameCache *c=&tto->cache;
+	c->hits++;
+	cache_show(tto,interp,photo,f->buffer);
+	/* the reverse thread is moving the decoder, and with it granulepos */
+	c->shown_gp=f->granulepos;
+	if (!c->reverse_running) tto->granulepos=f->granulepos;
+	/* only seek when something wants the frames after it */
+	c->resume=f->frame+1;
+	c->reseek=1;
+}
+
+/* Put the given frame in photo, from the cache if it is there, and leave
+ * "next" to carry on after it. The result is 1, or 0 if the clip has no
+ * such frame. */
+int frame_show (TclTheoraObject *tto, Tcl_Interp *interp, Tk_PhotoHandle photo,
+		ogg_int64_t frame)
+{
+	frameCache *c=&tto->cache;
+	th_ycbcr_buffer buffer;
+	ogg_int64_t granulepos;
+	cachedFrame *f;
+	int positioned;
+
+	if (frame<0) frame=0;
+	/* stepping forward from the last frame decoded needs no seek */
+	positioned=c->resume==frame && !c->reseek;
+	/* the worker would only be decoding frames from the old position */
+	prefetch_flush(tto);
+	multi_stop(tto);
+	f=cache_find(c,frame);
+	if (f!=NULL) {
+		cache_hit(tto,interp,photo,f);
+		Tcl_SetObjResult(interp,Tcl_NewIntObj(1));
+		return TCL_OK;
+	}
+
+	c->misses++;
+	c->resume=-1;
+	if (!positioned && seek_to_frame(tto,frame)!=0) {
+		Tcl_AppendResult(interp,"Error seeking in file.\n",NULL);
+		return TCL_ERROR;
+	}
+	/* not decode_next_frame(), the governor must not drop this one */
+	if (decode_next_packet(tto,&granulepos)!=1) {
+		Tcl_SetObjResult(interp,Tcl_NewIntObj(0));
+		return TCL_OK;
+	}
+	tto->granulepos=granulepos;
+	th_decode_ycbcr_out(tto->streams[0]->mTheora.mCtx,buffer);
+	if (c->budget>0) cache_store(tto,buffer,granulepos);
+	cache_show(tto,interp,photo,buffer);
+	/* the decoder is already in place, but the worker is not running */
+	c->resume=frame+1;
+	c->reseek=0;
+	Tcl_SetObjResult(interp,Tcl_NewIntObj(1));
+	return TCL_OK;
+}
+
+/* Before reading on after "frame", put the decoder where "next" expects
+ * it to be, and start decoding ahead again. */
+int frame_cache_settle (TclTheoraObject *tto, Tcl_Interp *interp) {
+	frameCache *c=&tto->cache;
+	ogg_int64_t frame=c->resume;
+	if (frame<0) return TCL_OK;
+	c->resume=-1;
+	if (c->reseek && seek_to_frame(tto,frame)!=0) {
+		Tcl_AppendResult(interp,"Error seeking in file.\n",NULL);
+		return TCL_ERROR;
+	}
+	if (prefetch_start(tto)!=TCL_OK) {
+		Tcl_AppendResult(interp,"Could not start decode thread.\n",NULL);
+		return TCL_ERROR;
+	}
+	return TCL_OK;
+}
+
+/* Decode the group of pictures that ends at c->reverse_target, for
+ * "prev" to go on to once it has shown the frames after it. */
+static Tcl_ThreadCreateType reverse_thread (ClientData clientData) {
+	TclTheoraObject *tto=(TclTheoraObject *)clientData;
+	frameCache *c=&tto->cache;
+	ogg_int64_t granulepos;
+	/* the seek collects the frames before the target on its way */
+	if (seek_to_frame(tto,c->reverse_target)==0
+			&& decode_next_packet(tto,&granulepos)==1) {
+		frame_cache_decoded(tto,granulepos);
+	}
+	TCL_THREAD_CREATE_RETURN;
+}
+
+/* Wait for the reverse thread, if there is one, and put the frames it
+ * decoded (which come before any already held) with the held ones.
+ * Anything that uses the decoder calls this first. */
+void frame_cache_wait (TclTheoraObject *tto) {
+	frameCache *c=&tto->cache;
+	int result;
+	if (!c->reverse_running) return;
+	Tcl_JoinThread(c->reverse_thread,&result);
+	c->reverse_running=0;
+	c->collecting=0;
+	tto->granulepos=c->shown_gp;
+	if (c->pending!=NULL) {
+		if (c->held_oldest!=NULL) {
+			c->held_oldest->older=c->pending;
+			c->pending->newer=c->held_oldest;
+		} else {
+			c->held=c->pending;
+		}
+		c->held_oldest=c->pending_oldest;
+	}
+	c->pending=c->pending_oldest=NULL;
+	c->pending_bytes=0;
+}
+
+/* Take frame out of the held ones, or return NULL. Any held frames after
+ * it are let go too, since "prev" has gone past them. */
+static cachedFrame *held_take (frameCache *c, ogg_int64_t frame) {
+	cachedFrame *f;
+	for (f=c->held;f!=NULL && f->frame!=frame;f=f->older);
+	if (f==NULL) return NULL;
+	while (c->held!=f) {
+		cachedFrame *newer=c->held;
+		c->held=newer->older;
+		ckfree((char*)newer);
+	}
+	c->held=f->older;
+	if (c->held!=NULL) c->held->newer=NULL;
+	else c->held_oldest=NULL;
+	f->newer=f->older=NULL;
+	return f;
+}
+
+/* is frame cached or held? */
+static int cache_has (frameCache *c, ogg_int64_t frame) {
+	cachedFrame *f;
+	if (cache_entry(c,frame)!=NULL) return 1;
+	for (f=c->held;f!=NULL;f=f->older) {
+		if (f->frame==frame) return 1;
+	}
+	return 0;
+}
+
+/* Put the frame before the one last shown in photo. Frames come out of
+ * the cache a group of pictures at a time, and the group before the
+ * cached ones is decoded in the background meanwhile, so stepping
+ * backwards costs about what stepping forwards does. The result is 1, or
+ * 0 at the start of the clip. */
+int frame_prev (TclTheoraObject *tto, Tcl_Interp *interp, Tk_PhotoHandle photo) {
+	frameCache *c=&tto->cache;
+	th_dec_ctx *ctx=tto->streams[0]->mTheora.mCtx;
+	ogg_int64_t gp=c->reverse_running?c->shown_gp:tto->granulepos;
+	ogg_int64_t frame=gp<0?-1:th_granule_frame(ctx,gp)-1;
+	ogg_int64_t group=(ogg_int64_t)1<<tto->streams[0]->mTheora.mInfo.keyframe_granule_shift;
+	ogg_int64_t low;
+	cachedFrame *f;
+	int held=0;
+
+	if (frame<0) {
+		Tcl_SetObjResult(interp,Tcl_NewIntObj(0));
+		return TCL_OK;
+	}
+	f=cache_find(c,frame);
+	if (f==NULL) {
+		/* the previous group may be on its way */
+		if (!cache_has(c,frame)) frame_cache_wait(tto);
+		f=held_take(c,frame);
+		held=f!=NULL;
+	}
+	if (f!=NULL) {
+		/* neither can be running alongside the reverse thread */
+		prefetch_flush(tto);
+		multi_stop(tto);
+		cache_hit(tto,interp,photo,f);
+		/* once it has been shown it is just another cached frame */
+		if (held) cache_insert(c,f);
+		Tcl_SetObjResult(interp,Tcl_NewIntObj(1));
+	} else if (frame_show(tto,interp,photo,frame)!=TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	/* start on the group before the frames we have, unless there is a
+	 * whole group of them still to go */
+	if (c->budget<=0 || c->reverse_running) return TCL_OK;
+	for (low=frame;low>0 && cache_has(c,low-1);low--);
+	if (low==0 || frame-low>=group) return TCL_OK;
+	c->reverse_target=low-1;
+	c->shown_gp=tto->granulepos;
+	c->reseek=1;
+	c->collecting=1;
+	if (Tcl_CreateThread(&c->reverse_thread,reverse_thread,(ClientData)tto,
+				TCL_THREAD_STACK_DEFAULT,TCL_THREAD_JOINABLE)!=TCL_OK) {
+		/* it will be decoded when it is wanted instead */
+		c->collecting=0;
+		return TCL_OK;
+	}
+	c->reverse_running=1;
+	return TCL_OK;
+}
@@ -0,0 +1,160 @@
+/*
+ * This file is part of MVTH - the Machine Vision Test Harness.
+ *
+ * Keep real-time playback in step with the clip's frame rate by lowering
+ * the post-processing level, then dropping frames, when decoding falls
+ * behind, and undoing that when there is time to spare.
+ *
+ * Copyright (C) 2011 Samuel P. Bromley <sam@sambromley.com>
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License Version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (see the file named "COPYING"), and a copy of the GNU Lesser General
+ * Public License (see the file named "COPYING.LESSER") along with MVTH.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tcl.h>
+#include "tcltheora.h"
+
+/* Frames the governor waits after a change before it looks again, so
+ * that the smoothed costs reflect the new setting. */
+enum {GOVERNOR_HOLD=8, GOVERNOR_MAX_DROP=7};
+
+/* raise quality only while a frame takes less than this much of its time */
+#define GOVERNOR_HEADROOM 0.75
+
+/* seconds since start */
+double governor_elapsed (Tcl_Time *start) {
+	Tcl_Time now;
+	Tcl_GetTime(&now);
+	return (now.sec-start->sec)+(now.usec-start->usec)*1e-6;
+}
+
+static void smooth (double *avg, double x) {
+	if (*avg==0) *avg=x;
+	else *avg+=(x-*avg)/8;
+}
+
+static void set_level (TclTheoraObject *tto, int level) {
+	governorState *g=&tto->governor;
+	if (level>g->pp_max) level=g->pp_max;
+	if (level<0) level=0;
+	if (tto->num_streams>0 && tto->streams[0]->mTheora.mCtx!=NULL) {
+		th_decode_ctl(tto->streams[0]->mTheora.mCtx,TH_DECCTL_SET_PPLEVEL,
+				&level,sizeof(level));
+	}
+	g->pp_level=level;
+}
+
+/* seconds each frame is on screen for */
+static double frame_budget (TclTheoraObject *tto) {
+	th_info *info=&tto->streams[0]->mTheora.mInfo;
+	if (info->fps_numerator==0) return 0;
+	return (double)info->fps_denominator/info->fps_numerator;
+}
+
+/* Set up a freshly allocated decoder context: find out how far its
+ * post-processing goes and start it at the requested level. */
+void governor_init (TclTheoraObject *tto) {
+	governorState *g=&tto->governor;
+	int max=0;
+	if (th_decode_ctl(tto->streams[0]->mTheora.mCtx,TH_DECCTL_GET_PPLEVEL_MAX,
+				&max,sizeof(max))!=0) {
+		max=0;
+	}
+	g->pp_max=max;
+	g->drop=0;
+	g->hold=GOVERNOR_HOLD;
+	g->decode_cost=0;
+	g->convert_cost=0;
+	set_level(tto,g->pp_target);
+}
+
+/* change the level the governor aims for (and starts from) */
+void governor_set_target (TclTheoraObject *tto, int level) {
+	governorState *g=&tto->governor;
+	g->pp_target=level;
+	g->drop=0;
+	g->hold=GOVERNOR_HOLD;
+	set_level(tto,level);
+}
+
+/* decoding the frame to show (and frames-1 dropped ones) took seconds */
+void governor_decoded (TclTheoraObject *tto, double seconds, int frames) {
+	governorState *g=&tto->governor;
+	if (frames>1) stats_add(&tto->stats.dropped,frames-1);
+	if (!g->realtime) return;
+	smooth(&g->decode_cost,seconds/frames);
+	g->frames_dropped+=frames-1;
+}
+
+/* Converting the frame took seconds. This is once per frame shown,
+ * so it is where the governor decides what to do next. */
+void governor_converted (TclTheoraObject *tto, double seconds) {
+	governorState *g=&tto->governor;
+	double budget,load;
+	int n;
+
+	if (!g->realtime) return;
+	smooth(&g->convert_cost,seconds);
+	if (g->hold>0) {
+		g->hold--;
+		return;
+	}
+	budget=frame_budget(tto);
+	if (budget<=0) return;
+
+	/* each frame shown pays for its own conversion and for decoding
+	 * the frames dropped before it, and has that many frames of time */
+	n=g->drop+1;
+	load=(n*g->decode_cost+g->convert_cost)/(n*budget);
+	if (load>1.0) {
+		if (g->pp_level>0) set_level(tto,g->pp_level-1);
+		else if (g->drop<GOVERNOR_MAX_DROP) g->drop++;
+		else return;
+	} else if (g->drop>0) {
+		/* would we keep up dropping one fewer? */
+		n=g->drop;
+		load=(n*g->decode_cost+g->convert_cost)/(n*budget);
+		if (load>=GOVERNOR_HEADROOM) return;
+		g->drop--;
+	} else if (load<GOVERNOR_HEADROOM && g->pp_level<g->pp_target
+			&& g->pp_level<g->pp_max) {
+		set_level(tto,g->pp_level+1);
+	} else {
+		return;
+	}
+	g->hold=GOVERNOR_HOLD;
+}
+
+/* what the governor is doing, for "$t governor" */
+Tcl_Obj *governor_state_obj (TclTheoraObject *tto) {
+	governorState *g=&tto->governor;
+	Tcl_Obj *result=Tcl_NewDictObj();
+	dict_put(result,"realtime",Tcl_NewBooleanObj(g->realtime));
+	dict_put(result,"ppLevel",Tcl_NewIntObj(g->pp_level));
+	dict_put(result,"ppTarget",Tcl_NewIntObj(g->pp_target));
+	dict_put(result,"ppLevelMax",Tcl_NewIntObj(g->pp_max));
+	dict_put(result,"drop",Tcl_NewIntObj(g->drop));
+	dict_put(result,"framesDropped",Tcl_NewLongObj(g->frames_dropped));
+	dict_put(result,"decodeMs",Tcl_NewDoubleObj(g->decode_cost*1000.0));
+	dict_put(result,"convertMs",Tcl_NewDoubleObj(g->convert_cost*1000.0));
+	dict_put(result,"budgetMs",Tcl_NewDoubleObj(frame_budget(tto)*1000.0));
+	return result;
+}
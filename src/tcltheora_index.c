@@ -0,0 +1,277 @@
+/*
+ * This file is part of MVTH - the Machine Vision Test Harness.
+ *
+ * Keep the seek index of a clip on disk between sessions.
+ *
+ * Copyright (C) 2011 Samuel P. Bromley <sam@sambromley.com>
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License Version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (see the file named "COPYING"), and a copy of the GNU Lesser General
+ * Public License (see the file named "COPYING.LESSER") along with MVTH.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <tcl.h>
+#include "tcltheora.h"
+
+/* The index file ("sidecar") is, in native byte order:
+ *   sidecarHeader
+ *   seekEntry[count]              (offset,granulepos of each video page)
+ * It is only written by "buildIndex": next to the clip as clip.ogv.tidx,
+ * or if that is not possible (or TCLTHEORA_INDEX_DIR is set) into a cache
+ * directory under a name derived from the clip's path. The entries are
+ * used in place from the mapping until something new has to be added. */
+
+#define SIDECAR_MAGIC "TTHIDX\0\0"
+enum {SIDECAR_BYTE_ORDER=0x01020304, SIDECAR_VERSION=2};
+
+typedef struct sidecarHeader_s {
+	char magic[8];
+	ogg_uint32_t byte_order;
+	ogg_uint32_t version;
+	ogg_int64_t file_size; /* of the clip when the index was written */
+	ogg_int64_t file_mtime; /* in nanoseconds */
+	ogg_int64_t data_offset;
+	ogg_int32_t serial; /* of the video stream */
+	ogg_int32_t granule_shift;
+	ogg_int64_t count; /* number of entries */
+} sidecarHeader;
+
+/* FNV-1a, to give cached indexes a name */
+static unsigned long long path_hash (const char *s) {
+	unsigned long long h=14695981039346656037ULL;
+	while (*s) {
+		h^=(unsigned char)*s++;
+		h*=1099511628211ULL;
+	}
+	return h;
+}
+
+/* Fill in the candidate places for the index of a clip, best first.
+ * A path that does not fit is left out. Returns the number of
+ * candidates. */
+static int sidecar_paths (const char *filename, char paths[2][PATH_MAX]) {
+	char full[PATH_MAX];
+	const char *dir=getenv("TCLTHEORA_INDEX_DIR");
+	const char *base;
+	int n=0;
+	if (realpath(filename,full)==NULL) {
+		strncpy(full,filename,PATH_MAX-1);
+		full[PATH_MAX-1]='\0';
+	}
+	base=strrchr(full,'/');
+	base=(base==NULL)?full:base+1;
+	if (dir==NULL) {
+		if (snprintf(paths[n],PATH_MAX,"%s.tidx",full)<PATH_MAX) n++;
+		dir=getenv("XDG_CACHE_HOME");
+		if (dir!=NULL) {
+			if (snprintf(paths[n],PATH_MAX,"%s/tcltheora/%s-%016llx.tidx",
+						dir,base,path_hash(full))<PATH_MAX) n++;
+		} else if ((dir=getenv("HOME"))!=NULL) {
+			if (snprintf(paths[n],PATH_MAX,"%s/.cache/tcltheora/%s-%016llx.tidx",
+						dir,base,path_hash(full))<PATH_MAX) n++;
+		}
+	} else {
+		if (snprintf(paths[n],PATH_MAX,"%s/%s-%016llx.tidx",dir,base,
+					path_hash(full))<PATH_MAX) n++;
+	}
+	return n;
+}
+
+/* size and modification time of the clip, which key the index */
+static int clip_stamp (TclTheoraObject *tto, ogg_int64_t *size, ogg_int64_t *mtime) {
+	struct stat st;
+	if (fstat(fileno(tto->fp),&st)!=0) return -1;
+	*size=(ogg_int64_t)st.st_size;
+	/* to the nanosecond, a clip rewritten within a second is not the same */
+	*mtime=(ogg_int64_t)st.st_mtim.tv_sec*1000000000+st.st_mtim.tv_nsec;
+	return 0;
+}
+
+/* try to map one index file. Returns 0 if it was valid for this clip. */
+static int sidecar_map (TclTheoraObject *tto, const char *path) {
+	sidecarHeader *hdr;
+	ogg_int64_t size,mtime;
+	struct stat st;
+	size_t need;
+	void *map;
+	int fd;
+
+	if (clip_stamp(tto,&size,&mtime)!=0) return -1;
+	fd=open(path,O_RDONLY);
+	if (fd<0) return -1;
+	if (fstat(fd,&st)!=0 || (size_t)st.st_size<sizeof(sidecarHeader)) {
+		close(fd);
+		return -1;
+	}
+	map=mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+	close(fd);
+	if (map==MAP_FAILED) return -1;
+
+	hdr=(sidecarHeader*)map;
+	need=0;
+	if (hdr->count>=0 && hdr->count<=(ogg_int64_t)(st.st_size/sizeof(seekEntry))) {
+		need=sizeof(sidecarHeader)+hdr->count*sizeof(seekEntry);
+	}
+	if (memcmp(hdr->magic,SIDECAR_MAGIC,8)!=0
+			|| hdr->byte_order!=SIDECAR_BYTE_ORDER
+			|| hdr->version!=SIDECAR_VERSION
+			|| need==0 || (size_t)st.st_size<need
+			|| hdr->file_size!=size || hdr->file_mtime!=mtime
+			|| hdr->serial!=tto->streams[0]->mSerial
+			|| hdr->granule_shift!=tto->streams[0]->mTheora.mInfo.keyframe_granule_shift
+			|| hdr->data_offset!=tto->data_offset) {
+		munmap(map,st.st_size);
+		return -1;
+	}
+	seek_index_free(tto);
+	tto->index.entries=(seekEntry*)(hdr+1);
+	tto->index.count=(int)hdr->count;
+	tto->index.alloc=0;
+	tto->index.map=map;
+	tto->index.map_len=st.st_size;
+	tto->index.dirty=0;
+	return 0;
+}
+
+/* Map a previously saved index for this clip, if there is a valid one.
+ * Returns 0 if one was loaded. */
+int index_load (TclTheoraObject *tto) {
+	char paths[2][PATH_MAX];
+	int i,n;
+	if (tto->filename==NULL || tto->num_streams==0) return -1;
+	n=sidecar_paths(tto->filename,paths);
+	for (i=0;i<n;i++) {
+		if (sidecar_map(tto,paths[i])==0) return 0;
+	}
+	return -1;
+}
+
+static int make_dirs (char *path) {
+	char *p;
+	for (p=path+1;*p;p++) {
+		if (*p!='/') continue;
+		*p='\0';
+		if (mkdir(path,0777)!=0 && errno!=EEXIST) {
+			*p='/';
+			return -1;
+		}
+		*p='/';
+	}
+	return 0;
+}
+
+/* write the index to path, via a temporary file so that readers never
+ * see half an index */
+static int sidecar_write (TclTheoraObject *tto, char *path) {
+	seekIndex *index=&tto->index;
+	char tmp[PATH_MAX+16];
+	sidecarHeader hdr;
+	FILE *fp;
+	int ok;
+
+	memset(&hdr,0,sizeof(hdr));
+	memcpy(hdr.magic,SIDECAR_MAGIC,8);
+	hdr.byte_order=SIDECAR_BYTE_ORDER;
+	hdr.version=SIDECAR_VERSION;
+	if (clip_stamp(tto,&hdr.file_size,&hdr.file_mtime)!=0) return -1;
+	hdr.data_offset=tto->data_offset;
+	hdr.serial=tto->streams[0]->mSerial;
+	hdr.granule_shift=tto->streams[0]->mTheora.mInfo.keyframe_granule_shift;
+	hdr.count=index->count;
+
+	if (make_dirs(path)!=0) return -1;
+	if (snprintf(tmp,sizeof(tmp),"%s.%d",path,(int)getpid())>=(int)sizeof(tmp)) return -1;
+	fp=fopen(tmp,"wb");
+	if (fp==NULL) return -1;
+	ok=fwrite(&hdr,sizeof(hdr),1,fp)==1
+		&& (index->count==0
+				|| fwrite(index->entries,sizeof(seekEntry),index->count,fp)==(size_t)index->count);
+	ok=(fclose(fp)==0) && ok;
+	if (!ok || rename(tmp,path)!=0) {
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+/* Save the index if we learnt anything since it was loaded.
+ * Returns 0 if there was nothing to do or it was written. */
+static int index_save (TclTheoraObject *tto) {
+	char paths[2][PATH_MAX];
+	int i,n;
+	if (!tto->index.dirty) return 0;
+	if (tto->filename==NULL || tto->num_streams==0 || tto->data_offset<0) return -1;
+	n=sidecar_paths(tto->filename,paths);
+	for (i=0;i<n;i++) {
+		if (sidecar_write(tto,paths[i])==0) {
+			tto->index.dirty=0;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* Read through the whole clip (pages only, nothing is decoded) and add
+ * every video page to the index, then save it. This does not disturb
+ * the playback position. */
+int index_build (TclTheoraObject *tto) {
+	ogg_sync_state sync;
+	ogg_page page;
+	ogg_int64_t offset=0;
+	int serial=tto->streams[0]->mSerial;
+	FILE *fp;
+	long n;
+
+	if (tto->filename==NULL || tto->data_offset<0) return -1;
+	fp=fopen(tto->filename,"rb");
+	if (fp==NULL) return -1;
+	ogg_sync_init(&sync);
+	for (;;) {
+		n=ogg_sync_pageseek(&sync,&page);
+		if (n<0) {
+			offset-=n;
+		} else if (n>0) {
+			if (ogg_page_serialno(&page)==serial && offset>=tto->data_offset
+					&& ogg_page_granulepos(&page)!=-1) {
+				seek_index_add(tto,offset,ogg_page_granulepos(&page));
+			}
+			offset+=n;
+		} else {
+			char *buff=ogg_sync_buffer(&sync,65536);
+			size_t bytes=fread(buff,1,65536,fp);
+			if (bytes==0) break;
+			ogg_sync_wrote(&sync,bytes);
+		}
+	}
+	ogg_sync_clear(&sync);
+	fclose(fp);
+	/* write it out even if nothing new turned up, so the next open finds it */
+	tto->index.dirty=1;
+	return index_save(tto);
+}
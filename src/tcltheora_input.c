@@ -0,0 +1,411 @@
+/*
+ * This file is part of MVTH - the Machine Vision Test Harness.
+ *
+ * Reading Ogg pages from the input file. Regular files are memory
+ * mapped and pages are handed out pointing straight into the mapping;
+ * anything else (pipes, FIFOs) goes through stdio and ogg_sync. Tcl
+ * channels are read without blocking, as data turns up.
+ *
+ * Copyright (C) 2011 Samuel P. Bromley <sam@sambromley.com>
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License Version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (see the file named "COPYING"), and a copy of the GNU Lesser General
+ * Public License (see the file named "COPYING.LESSER") along with MVTH.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <tcl.h>
+#include "tcltheora.h"
+
+/* how far ahead of the read position to ask the kernel to read */
+enum {INPUT_READAHEAD=4*1024*1024};
+
+/* stop reading a channel in the background once this much is waiting */
+enum {INPUT_CHANNEL_BACKLOG=8*1024*1024};
+
+/* The Ogg page CRC (polynomial 0x04c11db7, not reflected), done eight
+ * bytes at a time: crc_table[k][i] is the CRC of byte i followed by k
+ * zero bytes. Filled in by crc_init() the first time a file is opened. */
+static ogg_uint32_t crc_table[8][256];
+static int crc_ready=0;
+TCL_DECLARE_MUTEX(crc_lock)
+
+static void crc_init (void) {
+	int i,j,k;
+	if (__atomic_load_n(&crc_ready,__ATOMIC_ACQUIRE)) return;
+	Tcl_MutexLock(&crc_lock);
+	if (!crc_ready) {
+		for (i=0;i<256;i++) {
+			ogg_uint32_t crc=(ogg_uint32_t)i<<24;
+			for (j=0;j<8;j++) crc=(crc&0x80000000U)?(crc<<1)^0x04c11db7U:crc<<1;
+			crc_table[0][i]=crc;
+		}
+		for (k=1;k<8;k++) {
+			for (i=0;i<256;i++) {
+				ogg_uint32_t crc=crc_table[k-1][i];
+				crc_table[k][i]=(crc<<8)^crc_table[0][crc>>24];
+			}
+		}
+		__atomic_store_n(&crc_ready,1,__ATOMIC_RELEASE);
+	}
+	Tcl_MutexUnlock(&crc_lock);
+}
+
+static ogg_uint32_t crc_update (ogg_uint32_t crc, const unsigned char *p, long n) {
+	while (n>=8) {
+		crc^=((ogg_uint32_t)p[0]<<24)|((ogg_uint32_t)p[1]<<16)
+			|((ogg_uint32_t)p[2]<<8)|(ogg_uint32_t)p[3];
+		crc=crc_table[7][crc>>24]^crc_table[6][(crc>>16)&0xff]
+			^crc_table[5][(crc>>8)&0xff]^crc_table[4][crc&0xff]
+			^crc_table[3][p[4]]^crc_table[2][p[5]]
+			^crc_table[1][p[6]]^crc_table[0][p[7]];
+		p+=8;
+		n-=8;
+	}
+	while (n-->0) crc=(crc<<8)^crc_table[0][((crc>>24)^*p++)&0xff];
+	return crc;
+}
+
+/* Like ogg_sync_pageseek(), but on the mapping. Returns the length of the
+ * page at the current position, minus the number of bytes to skip to get
+ * to something that might be a page, or 0 if the file ends first. */
+static long map_pageseek (TclTheoraObject *tto, ogg_page *og) {
+	const unsigned char *p=tto->map+tto->sync_offset;
+	ogg_int64_t avail=tto->map_len-tto->sync_offset;
+	static const unsigned char zero[4]={0,0,0,0};
+	long hlen,blen,i;
+	ogg_uint32_t crc;
+
+	if (avail<27) return 0;
+	if (memcmp(p,"OggS",4)!=0) {
+		const unsigned char *q=p+1;
+		/* look for the next capture pattern */
+		while ((q=memchr(q,'O',avail-(q-p)))!=NULL) {
+			if (avail-(q-p)<4 || memcmp(q,"OggS",4)==0) break;
+			q++;
+		}
+		if (q==NULL) return -(long)((avail>LONG_MAX)?LONG_MAX:avail);
+		return -(long)(q-p);
+	}
+	hlen=27+p[26];
+	if (avail<hlen) return 0;
+	blen=0;
+	for (i=0;i<p[26];i++) blen+=p[27+i];
+	if (avail<hlen+blen) return 0;
+
+	crc=crc_update(0,p,22);
+	crc=crc_update(crc,zero,4);
+	crc=crc_update(crc,p+26,hlen-26);
+	crc=crc_update(crc,p+hlen,blen);
+	if (crc!=((ogg_uint32_t)p[22]|((ogg_uint32_t)p[23]<<8)
+				|((ogg_uint32_t)p[24]<<16)|((ogg_uint32_t)p[25]<<24))) {
+		/* not a page after all */
+		return -1;
+	}
+	og->header=(unsigned char*)p;
+	og->header_len=hlen;
+	og->body=(unsigned char*)p+hlen;
+	og->body_len=blen;
+	return hlen+blen;
+}
+
+/* Size of the mapped file now, up to the size of the mapping. Touching
+ * the mapping past the end of a file that has been cut short since
+ * raises SIGBUS, so a file must not be truncated while it is being read.
+ * The size taken when the file was mapped is kept in map_len, and only
+ * checked again when a read runs up against it. */
+static ogg_int64_t map_file_size (TclTheoraObject *tto) {
+	struct stat st;
+	if (fstat(fileno(tto->fp),&st)!=0 || (ogg_int64_t)st.st_size>tto->map_size) {
+		return tto->map_size;
+	}
+	return (ogg_int64_t)st.st_size;
+}
+
+/* keep the kernel reading ahead of us */
+static void map_readahead (TclTheoraObject *tto) {
+	ogg_int64_t page=sysconf(_SC_PAGESIZE);
+	ogg_int64_t start,len;
+	if (tto->sync_offset+INPUT_READAHEAD/2<tto->map_advised) return;
+	start=tto->sync_offset&~(page-1);
+	len=INPUT_READAHEAD;
+	if (start+len>tto->map_len) len=tto->map_len-start;
+	if (len>0) madvise(tto->map+start,len,MADV_WILLNEED);
+	tto->map_advised=start+len;
+}
+
+/* Set up reading from tto->fp. Regular files are mapped unless
+ * allow_mmap is 0. Returns 0, or -1 if the file cannot be looked at. */
+int input_open (TclTheoraObject *tto, int allow_mmap) {
+	struct stat st;
+	void *map;
+	tto->map=NULL;
+	tto->map_len=0;
+	tto->map_advised=0;
+	if (!allow_mmap) return 0;
+	crc_init();
+	if (fstat(fileno(tto->fp),&st)!=0) return -1;
+	if (!S_ISREG(st.st_mode) || st.st_size==0) return 0;
+	if ((ogg_int64_t)st.st_size!=(ogg_int64_t)(size_t)st.st_size) return 0;
+	map=mmap(NULL,(size_t)st.st_size,PROT_READ,MAP_PRIVATE,fileno(tto->fp),0);
+	if (map==MAP_FAILED) return 0;
+	madvise(map,(size_t)st.st_size,MADV_SEQUENTIAL);
+	tto->map=(unsigned char*)map;
+	tto->map_len=(ogg_int64_t)st.st_size;
+	tto->map_size=tto->map_len;
+	return 0;
+}
+
+static void channel_proc (ClientData clientData, int mask);
+
+/* bytes read from the channel that ogg_sync has not handed out yet */
+static long channel_backlog (TclTheoraObject *tto) {
+	if (tto->sync_state==NULL) return 0;
+	return tto->sync_state->fill-tto->sync_state->returned;
+}
+
+/* read from the channel in the background while there is room */
+static void channel_watch (TclTheoraObject *tto, int watch) {
+	if (watch==tto->channel_watched) return;
+	if (watch) {
+		Tcl_CreateChannelHandler(tto->channel,TCL_READABLE,channel_proc,(ClientData)tto);
+	} else {
+		Tcl_DeleteChannelHandler(tto->channel,channel_proc,(ClientData)tto);
+	}
+	tto->channel_watched=watch;
+}
+
+/* Read whatever the channel has into the sync buffer. Returns the number
+ * of bytes read, 0 if there was nothing yet, or -1 at the end (or on an
+ * error). */
+static int channel_fill (TclTheoraObject *tto) {
+	char *buff=ogg_sync_buffer(tto->sync_state,4096);
+	int bytes;
+	if (buff==NULL) return -1;
+	bytes=Tcl_ReadRaw(tto->channel,buff,4096);
+	if (bytes<0) return -1;
+	if (bytes==0) return Tcl_Eof(tto->channel)?-1:0;
+	ogg_sync_wrote(tto->sync_state,bytes);
+	return bytes;
+}
+
+/* the channel is readable: take in what is there, and let the script
+ * know there may be frames to get */
+static void channel_proc (ClientData clientData, int mask) {
+	TclTheoraObject *tto=(TclTheoraObject *)clientData;
+	int got=0,ret;
+	(void)mask;
+	if (tto->sync_state==NULL || tto->header_error!=NULL) return;
+	if (!tto->headers_read && tto->headers_proc!=NULL) {
+		/* the script only hears about it once the headers are in (or
+		 * could not be read) */
+		if (tto->headers_proc(tto,&tto->header_error)==0) return;
+		got=1;
+	}
+	ret=0;
+	while (tto->header_error==NULL && (ret=channel_fill(tto))>0) {
+		got+=ret;
+		if (channel_backlog(tto)>=INPUT_CHANNEL_BACKLOG) {
+			/* nobody is reading frames, wait until they do */
+			channel_watch(tto,0);
+			tto->channel_paused=1;
+			break;
+		}
+	}
+	if (ret<0 || tto->header_error!=NULL) channel_watch(tto,0);
+	if ((got>0 || ret<0) && tto->readable_cmd!=NULL) {
+		Tcl_Interp *interp=tto->interp;
+		Tcl_Obj *cmd=tto->readable_cmd;
+		Tcl_Preserve((ClientData)interp);
+		Tcl_IncrRefCount(cmd);
+		if (Tcl_EvalObjEx(interp,cmd,TCL_EVAL_GLOBAL)!=TCL_OK) {
+			Tcl_BackgroundError(interp);
+		}
+		Tcl_DecrRefCount(cmd);
+		Tcl_Release((ClientData)interp);
+	}
+}
+
+/* Read from a Tcl channel instead of a file. Reads never wait: they
+ * return with what there is, and data (the headers too) is taken in from
+ * the event loop as it arrives. */
+int input_open_channel (TclTheoraObject *tto, Tcl_Interp *interp, Tcl_Channel chan) {
+	tto->map=NULL;
+	tto->map_len=0;
+	tto->map_advised=0;
+	if (Tcl_SetChannelOption(interp,chan,"-translation","binary")!=TCL_OK
+			|| Tcl_SetChannelOption(interp,chan,"-blocking","0")!=TCL_OK) {
+		return TCL_ERROR;
+	}
+	/* keep it open for as long as we need it */
+	Tcl_RegisterChannel(NULL,chan);
+	tto->channel=chan;
+	tto->interp=interp;
+	channel_watch(tto,1);
+	return TCL_OK;
+}
+
+void input_close (TclTheoraObject *tto) {
+	if (tto->map!=NULL) munmap(tto->map,(size_t)tto->map_size);
+	tto->map=NULL;
+	tto->map_len=0;
+	tto->map_size=0;
+	if (tto->channel!=NULL) {
+		channel_watch(tto,0);
+		Tcl_UnregisterChannel(NULL,tto->channel);
+		tto->channel=NULL;
+	}
+	if (tto->readable_cmd!=NULL) Tcl_DecrRefCount(tto->readable_cmd);
+	tto->readable_cmd=NULL;
+}
+
+/* carry on reading from offset */
+int input_seek (TclTheoraObject *tto, ogg_int64_t offset) {
+	/* channels only go forwards */
+	if (tto->channel!=NULL) return -1;
+	if (tto->map!=NULL) {
+		if (offset<0 || offset>tto->map_len) return -1;
+		tto->map_advised=0;
+	} else if (fseeko(tto->fp,(off_t)offset,SEEK_SET)!=0) {
+		return -1;
+	}
+	if (tto->sync_state!=NULL) ogg_sync_reset(tto->sync_state);
+	tto->sync_offset=offset;
+	return 0;
+}
+
+/* size of the input in bytes */
+int input_size (TclTheoraObject *tto, ogg_int64_t *size) {
+	struct stat st;
+	if (tto->map!=NULL) {
+		*size=tto->map_len;
+		return 0;
+	}
+	if (tto->channel!=NULL) return -1;
+	if (fstat(fileno(tto->fp),&st)!=0 || !S_ISREG(st.st_mode)) return -1;
+	*size=(ogg_int64_t)st.st_size;
+	return 0;
+}
+
+/* Copy up to len bytes at offset into buffer, without moving the read
+ * position (so the prefetch worker may be reading meanwhile). Returns the
+ * number of bytes copied, or -1 if the input cannot do that. */
+long input_read_at (TclTheoraObject *tto, ogg_int64_t offset, char *buffer,
+		long len)
+{
+	ssize_t n;
+	if (offset<0) return -1;
+	if (tto->map!=NULL) {
+		/* the reader may be using map_len meanwhile, so leave it be */
+		ogg_int64_t end=map_file_size(tto);
+		if (offset>=end) return 0;
+		if (len>end-offset) len=(long)(end-offset);
+		memcpy(buffer,tto->map+offset,len);
+		return len;
+	}
+	if (tto->channel!=NULL || tto->fp==NULL) return -1;
+	n=pread(fileno(tto->fp),buffer,(size_t)len,(off_t)offset);
+	return n<0?-1:(long)n;
+}
+
+/* Read the next page into tto->page, setting tto->page_offset to where
+ * it starts. Returns 0 on success, -1 at the end of the input, or when
+ * a non-blocking channel has no more data yet (tto->input_blocked). */
+int input_next_page (TclTheoraObject *tto) {
+	int ret;
+	long n;
+	ogg_sync_state *sync_state=tto->sync_state;
+	ogg_page *page=tto->page;
+	FILE *fp=tto->fp;
+
+	tto->input_blocked=0;
+	if (tto->channel!=NULL) {
+		while ((n=ogg_sync_pageseek(sync_state,page))<=0) {
+			if (n<0) {
+				tto->sync_offset-=n;
+				continue;
+			}
+			ret=channel_fill(tto);
+			if (ret<0) return -1;
+			if (ret==0) {
+				tto->input_blocked=1;
+				return -1;
+			}
+		}
+		/* there is room in the backlog again */
+		if (tto->channel_paused && channel_backlog(tto)<INPUT_CHANNEL_BACKLOG/2) {
+			tto->channel_paused=0;
+			channel_watch(tto,1);
+		}
+		tto->page_offset=tto->sync_offset;
+		tto->sync_offset+=n;
+		return 0;
+	}
+
+	if (tto->map!=NULL) {
+		map_readahead(tto);
+		while ((n=map_pageseek(tto,page))<0) {
+			tto->sync_offset-=n;
+		}
+		if (n==0) {
+			/* the end of the file, unless it has changed size since */
+			ogg_int64_t end=map_file_size(tto);
+			if (end==tto->map_len) return -1;
+			tto->map_len=end;
+			tto->map_advised=0;
+			return input_next_page(tto);
+		}
+		tto->page_offset=tto->sync_offset;
+		tto->sync_offset+=n;
+		return 0;
+	}
+
+	while ((n=ogg_sync_pageseek(sync_state,page))<=0) {
+		if (n<0) {
+			/* skipped over some garbage */
+			tto->sync_offset-=n;
+			continue;
+		}
+		/* get pointer to ogg internal buffer */
+		char *buff=ogg_sync_buffer(sync_state,4096);
+		if (buff==NULL) {
+			if (!tto->quiet) fprintf(stderr,"Got NULL buff from ogg_sync_buffer()\n");
+			return -1;
+		}
+		int bytes=fread(buff,sizeof(char),4096,fp);
+		if (bytes==0) {
+			return -1;
+		}
+		ret=ogg_sync_wrote(sync_state,bytes);
+		if (ret!=0) {
+			if (!tto->quiet) fprintf(stderr,"Error from ogg_sync_wrote()\n");
+			return -1;
+		}
+	}
+	tto->page_offset=tto->sync_offset;
+	tto->sync_offset+=n;
+	return 0;
+}
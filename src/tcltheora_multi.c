@@ -0,0 +1,345 @@
+/*
+ * This file is part of MVTH - the Machine Vision Test Harness.
+ *
+ * Decode every Theora stream of a multiplexed file at once: the file is
+ * demultiplexed once, on the calling thread, and each stream's packet is
+ * then decoded and converted on a thread of its own.
+ *
+ * Copyright (C) 2011 Samuel P. Bromley <sam@sambromley.com>
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License Version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (see the file named "COPYING"), and a copy of the GNU Lesser General
+ * Public License (see the file named "COPYING.LESSER") along with MVTH.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tcl.h>
+#include "tcltheora.h"
+#include "tcltheora_yuv.h"
+
+/* While a round is being decoded each worker only touches its own
+ * stream's decoder and its own batch of packets; all the ogg state is
+ * left to the calling thread, which only demuxes between rounds.
+ *
+ * The first stream sets the pace, one frame a round. Each of the others
+ * gets whatever frames of its own start by the time that frame does, so
+ * streams with different frame rates stay together. A stream with no
+ * new frame for the round keeps showing its last one. */
+
+/* The video streams, streams[0] first. Returns how many there are. */
+int multi_video_streams (TclTheoraObject *tto, oggStream **streams) {
+	int i,n=0;
+	for (i=0;i<tto->num_streams;i++) {
+		if (tto->streams[i]->stream_type==STREAM_TYPE_THEORA) {
+			streams[n++]=tto->streams[i];
+		}
+	}
+	return n;
+}
+
+/* keep a copy of packet at the end of q */
+static void queue_push (packetQueue *q, ogg_packet *packet, ogg_int64_t frame) {
+	queuedPacket *e;
+	if (q->count==q->alloc) {
+		q->alloc=q->alloc?2*q->alloc:32;
+		q->entries=(queuedPacket*)ckrealloc((char*)q->entries,
+				q->alloc*sizeof(queuedPacket));
+	}
+	e=&q->entries[q->count++];
+	e->packet=*packet;
+	e->packet.packet=(unsigned char*)ckalloc(packet->bytes>0?packet->bytes:1);
+	if (packet->bytes>0) memcpy(e->packet.packet,packet->packet,packet->bytes);
+	e->frame=frame;
+}
+
+/* Move the first n packets of q to the end of dst, or throw them away
+ * if dst is NULL. */
+static void queue_take (packetQueue *q, int n, packetQueue *dst) {
+	int i;
+	for (i=0;i<n;i++) {
+		queuedPacket *e=&q->entries[i];
+		if (dst==NULL) {
+			ckfree((char*)e->packet.packet);
+			continue;
+		}
+		if (dst->count==dst->alloc) {
+			dst->alloc=dst->alloc?2*dst->alloc:32;
+			dst->entries=(queuedPacket*)ckrealloc((char*)dst->entries,
+					dst->alloc*sizeof(queuedPacket));
+		}
+		dst->entries[dst->count++]=*e;
+	}
+	q->count-=n;
+	memmove(q->entries,q->entries+n,q->count*sizeof(queuedPacket));
+}
+
+/* Forget all the packets of stream: its ogg stream was reset, so the next
+ * packet to come in has nothing to do with the last. */
+void multi_queue_reset (oggStream *stream) {
+	packetQueue *q=&stream->queue;
+	queue_take(q,q->count,NULL);
+	if (q->entries!=NULL) ckfree((char*)q->entries);
+	memset(q,0,sizeof(packetQueue));
+	q->next_frame=-1;
+}
+
+/* Take the packets that have come in for one of the other video streams
+ * out of its ogg stream. Nothing is kept before the first keyframe, and
+ * while nobody is decoding the stream, nothing before the latest. */
+void multi_queue_packets (oggStream *stream) {
+	th_dec_ctx *ctx=stream->mTheora.mCtx;
+	packetQueue *q=&stream->queue;
+	ogg_packet packet;
+	ogg_int64_t frame;
+	int i,ret;
+	while ((ret=ogg_stream_packetout(&stream->mState,&packet))!=0) {
+		if (ret<0) continue; /* lost some data, just carry on */
+		stream->mPacketCount++;
+		if (ctx==NULL) continue;
+		/* number the frames, going back over any we could not before */
+		if (packet.granulepos>=0) {
+			frame=th_granule_frame(ctx,packet.granulepos);
+			for (i=q->count-1;i>=0 && q->entries[i].frame<0;i--) {
+				q->entries[i].frame=frame-(q->count-i);
+			}
+			q->next_frame=frame+1;
+		} else if (q->next_frame>=0) {
+			frame=q->next_frame++;
+		} else {
+			frame=-1;
+		}
+		if (th_packet_iskeyframe(&packet)==1) {
+			q->keyframe=1;
+			if (!stream->active) queue_take(q,q->count,NULL);
+		}
+		/* a decoder started anywhere else only makes gray frames */
+		if (q->keyframe) queue_push(q,&packet,frame);
+	}
+}
+
+/* when frame of stream is due, in seconds */
+static double frame_start (oggStream *stream, ogg_int64_t frame) {
+	th_info *info=&stream->mTheora.mInfo;
+	if (info->fps_numerator==0) return 0;
+	return (double)frame*info->fps_denominator/info->fps_numerator;
+}
+
+/* Hand a worker the packets of its stream for the frames that are due by
+ * until, reading on until one that is due later has come in (so that we
+ * know there are no more). If paced is 0 (the first stream has ended) it
+ * just gets the next packet. */
+static void multi_gather (TclTheoraObject *tto, streamWorker *w, int paced,
+		double until)
+{
+	oggStream *stream=w->stream;
+	packetQueue *q=&stream->queue;
+	int n;
+	multi_queue_packets(stream);
+	for (;;) {
+		queuedPacket *last=q->count>0?&q->entries[q->count-1]:NULL;
+		if (last!=NULL && (!paced
+					|| (last->frame>=0 && frame_start(stream,last->frame)>until))) {
+			break;
+		}
+		if (get_next_page(tto)!=0) break;
+		route_page(tto);
+	}
+	if (!paced) {
+		n=q->count>0?1:0;
+	} else {
+		/* frames still without a number can only be at the end of the file */
+		for (n=0;n<q->count;n++) {
+			queuedPacket *e=&q->entries[n];
+			if (e->frame>=0 && frame_start(stream,e->frame)>until) break;
+		}
+	}
+	queue_take(q,n,&w->batch);
+}
+
+/* decode the packets handed to a worker, and convert the last frame */
+static void multi_decode (streamWorker *w) {
+	th_dec_ctx *ctx=w->stream->mTheora.mCtx;
+	th_info *info=&w->stream->mTheora.mInfo;
+	readyFrame *frame=&w->frame;
+	perfStats *stats=&w->tto->stats;
+	th_ycbcr_buffer buffer;
+	Tk_PhotoImageBlock block;
+	ogg_int64_t granulepos=-1;
+	ogg_uint64_t start;
+	int i,ret;
+
+	w->got_frame=0;
+	for (i=0;i<w->batch.count;i++) {
+		start=stats_now();
+		ret=th_decode_packetin(ctx,&w->batch.entries[i].packet,&granulepos);
+		stats_time(stats,STATS_PACKETIN,start);
+		if (ret!=0 && ret!=TH_DUPFRAME) continue;
+		stats_add(&stats->frames,1);
+		if (ret==TH_DUPFRAME) stats_add(&stats->dups,1);
+		/* only the last of them is shown */
+		if (w->got_frame) stats_add(&stats->dropped,1);
+		w->got_frame=1;
+	}
+	if (!w->got_frame) return;
+	start=stats_now();
+	th_decode_ycbcr_out(ctx,buffer);
+	stats_time(stats,STATS_YCBCR_OUT,start);
+
+	if (frame->pixels==NULL || frame->width!=(int)info->pic_width
+			|| frame->height!=(int)info->pic_height) {
+		if (frame->pixels!=NULL) ckfree((char*)frame->pixels);
+		frame->width=info->pic_width;
+		frame->height=info->pic_height;
+		frame->pixels=(unsigned char*)ckalloc(4*frame->width*frame->height);
+	}
+	block.pixelPtr=frame->pixels;
+	block.width=frame->width;
+	block.height=frame->height;
+	block.pitch=4*frame->width;
+	block.pixelSize=4;
+	block.offset[0]=0;
+	block.offset[1]=1;
+	block.offset[2]=2;
+	block.offset[3]=3;
+	start=stats_now();
+	ycbcr_to_rgb(info,buffer,&block);
+	stats_time(stats,STATS_CONVERT,start);
+	frame->granulepos=granulepos;
+}
+
+static Tcl_ThreadCreateType multi_thread (ClientData clientData) {
+	streamWorker *w=(streamWorker *)clientData;
+	TclTheoraObject *tto=w->tto;
+	unsigned int seen=0;
+	Tcl_MutexLock(&tto->multi_lock);
+	for (;;) {
+		while (!tto->multi_stop && tto->multi_gen==seen) {
+			Tcl_ConditionWait(&tto->multi_cond,&tto->multi_lock,NULL);
+		}
+		if (tto->multi_stop) break;
+		seen=tto->multi_gen;
+		Tcl_MutexUnlock(&tto->multi_lock);
+		multi_decode(w);
+		Tcl_MutexLock(&tto->multi_lock);
+		if (--tto->multi_busy==0) Tcl_ConditionNotify(&tto->multi_cond);
+	}
+	Tcl_MutexUnlock(&tto->multi_lock);
+	TCL_THREAD_CREATE_RETURN;
+}
+
+/* start keeping the packets of every video stream, with a thread for
+ * each one after the first */
+static int multi_start (TclTheoraObject *tto) {
+	oggStream *streams[TCLTHEORA_MAX_NUM_STREAMS];
+	int i,n=multi_video_streams(tto,streams);
+	tto->multi=(streamWorker*)ckalloc(n*sizeof(streamWorker));
+	memset(tto->multi,0,n*sizeof(streamWorker));
+	tto->multi_count=n;
+	tto->multi_gen=0;
+	tto->multi_busy=0;
+	tto->multi_stop=0;
+	for (i=0;i<n;i++) {
+		streamWorker *w=&tto->multi[i];
+		w->tto=tto;
+		w->stream=streams[i];
+		streams[i]->active=1;
+		if (i==0) continue;
+		if (Tcl_CreateThread(&w->thread,multi_thread,(ClientData)w,
+					TCL_THREAD_STACK_DEFAULT,TCL_THREAD_JOINABLE)!=TCL_OK) {
+			multi_stop(tto);
+			return TCL_ERROR;
+		}
+		w->running=1;
+	}
+	return TCL_OK;
+}
+
+/* let the stream threads go; the streams after the first go back to
+ * keeping just their packets since the last keyframe */
+void multi_stop (TclTheoraObject *tto) {
+	int i,result;
+	if (tto->multi==NULL) return;
+	Tcl_MutexLock(&tto->multi_lock);
+	tto->multi_stop=1;
+	Tcl_ConditionNotify(&tto->multi_cond);
+	Tcl_MutexUnlock(&tto->multi_lock);
+	for (i=0;i<tto->multi_count;i++) {
+		streamWorker *w=&tto->multi[i];
+		if (w->running) Tcl_JoinThread(w->thread,&result);
+		queue_take(&w->batch,w->batch.count,NULL);
+		if (w->batch.entries!=NULL) ckfree((char*)w->batch.entries);
+		if (w->frame.pixels!=NULL) ckfree((char*)w->frame.pixels);
+		if (i>0) w->stream->active=0;
+	}
+	ckfree((char*)tto->multi);
+	tto->multi=NULL;
+	tto->multi_count=0;
+	Tcl_MutexFinalize(&tto->multi_lock);
+	Tcl_ConditionFinalize(&tto->multi_cond);
+}
+
+/* Decode the next frame of every video stream, in parallel. The frames
+ * are left in tto->multi[i].frame, with got_frame set for the streams
+ * that have a new one. Returns the number of those (0 at the end of the
+ * file), or -1 if the threads could not be started. */
+int multi_next (TclTheoraObject *tto) {
+	streamWorker *first;
+	ogg_packet packet;
+	ogg_int64_t frame;
+	double until=0;
+	int i,n,paced;
+
+	if (tto->multi==NULL && multi_start(tto)!=TCL_OK) return -1;
+
+	/* the first stream's next frame says how far the others go */
+	first=&tto->multi[0];
+	queue_take(&first->batch,first->batch.count,NULL);
+	paced=next_stream_packet(tto,first->stream,&packet);
+	if (paced) {
+		frame=tto->granulepos<0?0:th_granule_frame(first->stream->mTheora.mCtx,
+				tto->granulepos)+1;
+		until=frame_start(first->stream,frame);
+		queue_push(&first->batch,&packet,frame);
+	}
+	for (i=1;i<tto->multi_count;i++) {
+		streamWorker *w=&tto->multi[i];
+		queue_take(&w->batch,w->batch.count,NULL);
+		multi_gather(tto,w,paced,until);
+	}
+
+	Tcl_MutexLock(&tto->multi_lock);
+	tto->multi_busy=tto->multi_count-1;
+	tto->multi_gen++;
+	Tcl_ConditionNotify(&tto->multi_cond);
+	Tcl_MutexUnlock(&tto->multi_lock);
+	/* the first stream is ours */
+	multi_decode(&tto->multi[0]);
+	Tcl_MutexLock(&tto->multi_lock);
+	while (tto->multi_busy>0) {
+		Tcl_ConditionWait(&tto->multi_cond,&tto->multi_lock,NULL);
+	}
+	Tcl_MutexUnlock(&tto->multi_lock);
+
+	n=0;
+	for (i=0;i<tto->multi_count;i++) {
+		if (tto->multi[i].got_frame) n++;
+	}
+	if (tto->multi[0].got_frame) tto->granulepos=tto->multi[0].frame.granulepos;
+	return n;
+}
@@ -0,0 +1,278 @@
+/*
+ * This file is part of MVTH - the Machine Vision Test Harness.
+ *
+ * "play": show the frames of a clip at their presentation times, from
+ * Tcl timer handlers, skipping frames rather than falling behind.
+ *
+ * Copyright (C) 2011 Samuel P. Bromley <sam@sambromley.com>
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License Version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (see the file named "COPYING"), and a copy of the GNU Lesser General
+ * Public License (see the file named "COPYING.LESSER") along with MVTH.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <tcl.h>
+#include <tk.h>
+#include "tcltheora.h"
+
+/* Every frame's due time is worked out afresh from one anchor,
+ *   wall = wall0 + (media - media0)/rate,
+ * with media = frame*fps_denominator/fps_numerator, so rounding of the
+ * timer delays never adds up. The anchor only moves on pause/resume, a
+ * change of rate, or when something other than the player moved the
+ * decoder (a seek, say). */
+
+/* a timer this close to the due time shows the frame rather than waiting */
+#define PLAY_EARLY 0.001
+/* how long to wait before asking a channel for a frame again */
+#define PLAY_STALL_WAIT 0.005
+
+static void play_tick (ClientData clientData);
+
+/* seconds on a clock that is never set back */
+static double play_now (void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec+ts.tv_nsec*1e-9;
+}
+
+/* seconds each frame is on screen for, at normal speed */
+static double frame_duration (TclTheoraObject *tto) {
+	th_info *info=&tto->streams[0]->mTheora.mInfo;
+	if (info->fps_numerator==0) return 0;
+	return (double)info->fps_denominator/info->fps_numerator;
+}
+
+/* the frame the decoder will produce next */
+static ogg_int64_t next_frame (TclTheoraObject *tto) {
+	if (tto->granulepos<0) return 0;
+	return th_granule_frame(tto->streams[0]->mTheora.mCtx,tto->granulepos)+1;
+}
+
+/* where the presentation clock is at wall time now */
+static double media_time (playerState *p, double now) {
+	return p->media0+(now-p->wall0)*p->rate;
+}
+
+/* when frame is due on the wall clock */
+static double due_time (TclTheoraObject *tto, ogg_int64_t frame) {
+	playerState *p=&tto->player;
+	return p->wall0+(frame*frame_duration(tto)-p->media0)/p->rate;
+}
+
+/* start the clock again with frame due now */
+static void play_anchor (TclTheoraObject *tto, ogg_int64_t frame, double now) {
+	playerState *p=&tto->player;
+	p->media0=frame*frame_duration(tto);
+	p->wall0=now;
+	p->expected=frame;
+}
+
+static void play_schedule (TclTheoraObject *tto, double seconds) {
+	playerState *p=&tto->player;
+	int ms=seconds>0?(int)(seconds*1000.0):0;
+	p->timer=Tcl_CreateTimerHandler(ms,play_tick,(ClientData)tto);
+}
+
+/* the clip is over: stop, then let the script know */
+static void play_end (TclTheoraObject *tto) {
+	playerState *p=&tto->player;
+	Tcl_Interp *interp=p->interp;
+	Tcl_Obj *cmd=p->command;
+	if (cmd!=NULL) Tcl_IncrRefCount(cmd);
+	play_stop(tto);
+	if (cmd==NULL) return;
+	Tcl_Preserve((ClientData)interp);
+	if (Tcl_EvalObjEx(interp,cmd,TCL_EVAL_GLOBAL)!=TCL_OK) {
+		Tcl_BackgroundError(interp);
+	}
+	Tcl_DecrRefCount(cmd);
+	Tcl_Release((ClientData)interp);
+}
+
+static void play_tick (ClientData clientData) {
+	TclTheoraObject *tto=(TclTheoraObject *)clientData;
+	playerState *p=&tto->player;
+	Tcl_Interp *interp=p->interp;
+	Tk_PhotoHandle photo;
+	ogg_int64_t next,want;
+	double now,due,late,dur;
+	int ret;
+
+	p->timer=NULL;
+	/* a "next -command" or "prev" may still have the decoder */
+	async_wait(tto);
+	frame_cache_wait(tto);
+	photo=Tk_FindPhoto(interp,Tcl_GetString(p->photo));
+	if (photo==NULL) {
+		Tcl_ResetResult(interp);
+		Tcl_AppendResult(interp,"Cannot find photo \"",Tcl_GetString(p->photo),"\"",NULL);
+		play_stop(tto);
+		Tcl_BackgroundError(interp);
+		return;
+	}
+
+	/* after "frame", carry on from there */
+	if (frame_cache_settle(tto,interp)!=TCL_OK) {
+		play_stop(tto);
+		Tcl_BackgroundError(interp);
+		return;
+	}
+	now=play_now();
+	next=next_frame(tto);
+	if (next!=p->expected) play_anchor(tto,next,now);
+	dur=frame_duration(tto);
+	if (dur>0) {
+		/* the frame that should be on screen by now */
+		want=(ogg_int64_t)(media_time(p,now)/dur+1e-9);
+		if (want>next) {
+			/* behind: skip to it without converting the ones in between */
+			if (skip_frames(tto,interp,(int)(want-next))!=TCL_OK) {
+				play_stop(tto);
+				Tcl_BackgroundError(interp);
+				return;
+			}
+			p->dropped+=next_frame(tto)-next;
+			next=next_frame(tto);
+			p->expected=next;
+		}
+	}
+	due=due_time(tto,next);
+	if (now<due-PLAY_EARLY) {
+		play_schedule(tto,due-now);
+		return;
+	}
+
+	ret=show_next_frame(tto,interp,photo,NULL);
+	if (ret==0) {
+		play_end(tto);
+		return;
+	}
+	if (ret<0) {
+		/* a channel that has not caught up; frames are dropped once it does */
+		if (!p->stalled) p->stalls++;
+		p->stalled=1;
+		play_schedule(tto,PLAY_STALL_WAIT);
+		return;
+	}
+	p->stalled=0;
+	late=play_now()-due;
+	p->shown++;
+	p->jitter_sum+=late<0?-late:late;
+	if (late>p->late_max) p->late_max=late;
+	if (late>dur/2) p->late++;
+	p->expected=next+1;
+	play_schedule(tto,due_time(tto,next+1)-play_now());
+}
+
+/* Start showing frames in the photo named photo, from the current
+ * position. command (which may be NULL) is run at the end of the clip. */
+int play_start (TclTheoraObject *tto, Tcl_Interp *interp, Tcl_Obj *photo,
+		Tcl_Obj *command)
+{
+	playerState *p=&tto->player;
+	if (Tk_FindPhoto(interp,Tcl_GetString(photo))==NULL) {
+		Tcl_AppendResult(interp,"Cannot find photo \"",Tcl_GetString(photo),"\"",NULL);
+		return TCL_ERROR;
+	}
+	play_stop(tto);
+	p->interp=interp;
+	p->photo=photo;
+	Tcl_IncrRefCount(photo);
+	p->command=command;
+	if (command!=NULL) Tcl_IncrRefCount(command);
+	p->playing=1;
+	p->paused=0;
+	p->shown=0;
+	p->dropped=0;
+	p->late=0;
+	p->stalls=0;
+	p->stalled=0;
+	p->jitter_sum=0;
+	p->late_max=0;
+	play_anchor(tto,next_frame(tto),play_now());
+	play_schedule(tto,0);
+	return TCL_OK;
+}
+
+/* hold the clock (and the picture) where they are */
+void play_pause (TclTheoraObject *tto) {
+	playerState *p=&tto->player;
+	if (!p->playing || p->paused) return;
+	p->paused_at=media_time(p,play_now());
+	if (p->timer!=NULL) Tcl_DeleteTimerHandler(p->timer);
+	p->timer=NULL;
+	p->paused=1;
+}
+
+void play_resume (TclTheoraObject *tto) {
+	playerState *p=&tto->player;
+	if (!p->playing || !p->paused) return;
+	p->media0=p->paused_at;
+	p->wall0=play_now();
+	p->paused=0;
+	play_schedule(tto,0);
+}
+
+/* stop playing; the statistics are kept until the next "play" */
+void play_stop (TclTheoraObject *tto) {
+	playerState *p=&tto->player;
+	if (p->timer!=NULL) Tcl_DeleteTimerHandler(p->timer);
+	p->timer=NULL;
+	if (p->photo!=NULL) Tcl_DecrRefCount(p->photo);
+	p->photo=NULL;
+	if (p->command!=NULL) Tcl_DecrRefCount(p->command);
+	p->command=NULL;
+	p->playing=0;
+	p->paused=0;
+}
+
+/* change speed, carrying on from wherever the clock is now */
+void play_set_rate (TclTheoraObject *tto, double rate) {
+	playerState *p=&tto->player;
+	double now=play_now();
+	if (p->playing && !p->paused) {
+		p->media0=media_time(p,now);
+		p->wall0=now;
+	}
+	p->rate=rate;
+	if (p->timer!=NULL) {
+		Tcl_DeleteTimerHandler(p->timer);
+		play_schedule(tto,0);
+	}
+}
+
+/* how playback has gone, for "$t playStats" */
+Tcl_Obj *play_stats_obj (TclTheoraObject *tto) {
+	playerState *p=&tto->player;
+	Tcl_Obj *result=Tcl_NewDictObj();
+	dict_put(result,"playing",Tcl_NewBooleanObj(p->playing));
+	dict_put(result,"paused",Tcl_NewBooleanObj(p->paused));
+	dict_put(result,"rate",Tcl_NewDoubleObj(p->rate));
+	dict_put(result,"shown",Tcl_NewLongObj(p->shown));
+	dict_put(result,"dropped",Tcl_NewLongObj(p->dropped));
+	dict_put(result,"late",Tcl_NewLongObj(p->late));
+	dict_put(result,"stalls",Tcl_NewLongObj(p->stalls));
+	dict_put(result,"jitterMs",Tcl_NewDoubleObj(
+				p->shown>0?p->jitter_sum/p->shown*1000.0:0.0));
+	dict_put(result,"lateMaxMs",Tcl_NewDoubleObj(p->late_max*1000.0));
+	return result;
+}
@@ -0,0 +1,197 @@
+/*
+ * This file is part of MVTH - the Machine Vision Test Harness.
+ *
+ * A small pool of threads, one per theora object, that converts bands
+ * of rows of a frame to RGBA in parallel.
+ *
+ * Copyright (C) 2011 Samuel P. Bromley <sam@sambromley.com>
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License Version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (see the file named "COPYING"), and a copy of the GNU Lesser General
+ * Public License (see the file named "COPYING.LESSER") along with MVTH.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tcl.h>
+#include "tcltheora.h"
+#include "tcltheora_yuv.h"
+
+/* bands smaller than this are not worth handing to another thread */
+enum {POOL_MIN_ROWS=16};
+
+/* Every pixel is converted by the same code whichever thread gets its
+ * band, so the output does not depend on the number of threads. The
+ * queue and the pending count are only touched with the lock held. */
+
+static void run_job (convertJob *job) {
+	ogg_uint64_t start=stats_now();
+	ycbcr_to_rgb_region(job->info,job->buffer,0,job->y,job->info->pic_width,
+			job->h,&job->dst);
+	stats_time(job->stats,STATS_CONVERT,start);
+}
+
+/* take the next job off the queue, with the lock held */
+static int take_job (convertPool *pool, convertJob *job) {
+	if (pool->head==pool->tail) return 0;
+	*job=pool->queue[pool->head%CONVERT_POOL_QUEUE];
+	pool->head++;
+	return 1;
+}
+
+static Tcl_ThreadCreateType pool_thread (ClientData clientData) {
+	convertPool *pool=(convertPool *)clientData;
+	convertJob job;
+	Tcl_MutexLock(&pool->lock);
+	for (;;) {
+		while (!pool->stop && pool->head==pool->tail) {
+			Tcl_ConditionWait(&pool->work,&pool->lock,NULL);
+		}
+		if (!take_job(pool,&job)) break;
+		Tcl_MutexUnlock(&pool->lock);
+		run_job(&job);
+		Tcl_MutexLock(&pool->lock);
+		if (--pool->pending==0) Tcl_ConditionNotify(&pool->idle);
+	}
+	Tcl_MutexUnlock(&pool->lock);
+	TCL_THREAD_CREATE_RETURN;
+}
+
+/* Convert with nthreads threads in all: the caller plus nthreads-1 in
+ * the pool. Any pool already running is stopped first. */
+int pool_start (TclTheoraObject *tto, int nthreads) {
+	convertPool *pool=&tto->pool;
+	pool_stop(tto);
+	if (nthreads<1) nthreads=1;
+	if (nthreads>CONVERT_POOL_MAX_THREADS) nthreads=CONVERT_POOL_MAX_THREADS;
+	pool->nthreads=nthreads;
+	while (pool->nhelpers<nthreads-1) {
+		if (Tcl_CreateThread(&pool->helpers[pool->nhelpers],pool_thread,
+					(ClientData)pool,TCL_THREAD_STACK_DEFAULT,TCL_THREAD_JOINABLE)!=TCL_OK) {
+			pool_stop(tto);
+			return TCL_ERROR;
+		}
+		pool->nhelpers++;
+	}
+	return TCL_OK;
+}
+
+/* finish off queued work and let the pool threads go */
+void pool_stop (TclTheoraObject *tto) {
+	convertPool *pool=&tto->pool;
+	int i,result;
+	if (pool->nhelpers>0) {
+		Tcl_MutexLock(&pool->lock);
+		pool->stop=1;
+		Tcl_ConditionNotify(&pool->work);
+		Tcl_MutexUnlock(&pool->lock);
+		for (i=0;i<pool->nhelpers;i++) {
+			Tcl_JoinThread(pool->helpers[i],&result);
+		}
+	}
+	pool->nhelpers=0;
+	pool->nthreads=1;
+	pool->head=0;
+	pool->tail=0;
+	pool->pending=0;
+	pool->stop=0;
+	/* made again by the next pool_start() */
+	Tcl_MutexFinalize(&pool->lock);
+	Tcl_ConditionFinalize(&pool->work);
+	Tcl_ConditionFinalize(&pool->idle);
+}
+
+/* Queue the conversion of picture rows y..y+h-1 into dst (which is
+ * positioned at row y), split into bands for the pool. Bands start on
+ * even frame rows so that 4:2:0 chroma rows are never split. Call
+ * pool_wait() before using the result. */
+void pool_submit (TclTheoraObject *tto, th_info *info, th_ycbcr_buffer buffer,
+		int y, int h, Tk_PhotoImageBlock *dst)
+{
+	convertPool *pool=&tto->pool;
+	convertJob job;
+	int first=y;
+	int band,end,next;
+
+	if (pool->nhelpers==0 || h<2*POOL_MIN_ROWS) {
+		ogg_uint64_t start=stats_now();
+		ycbcr_to_rgb_region(info,buffer,0,y,info->pic_width,h,dst);
+		stats_time(&tto->stats,STATS_CONVERT,start);
+		return;
+	}
+	band=(h+pool->nthreads-1)/pool->nthreads;
+	if (band<POOL_MIN_ROWS) band=POOL_MIN_ROWS;
+	band=(band+1)&~1;
+
+	job.stats=&tto->stats;
+	job.info=info;
+	memcpy(job.buffer,buffer,sizeof(th_ycbcr_buffer));
+	end=y+h;
+	Tcl_MutexLock(&pool->lock);
+	while (y<end) {
+		next=y+band;
+		if (((int)info->pic_y+next)&1) next++;
+		if (next>end) next=end;
+		job.y=y;
+		job.h=next-y;
+		job.dst=*dst;
+		job.dst.pixelPtr=dst->pixelPtr+(y-first)*dst->pitch;
+		job.dst.height=job.h;
+		if (pool->tail-pool->head==CONVERT_POOL_QUEUE) {
+			/* no room, do it here */
+			Tcl_MutexUnlock(&pool->lock);
+			run_job(&job);
+			Tcl_MutexLock(&pool->lock);
+		} else {
+			pool->queue[pool->tail%CONVERT_POOL_QUEUE]=job;
+			pool->tail++;
+			pool->pending++;
+		}
+		y=next;
+	}
+	Tcl_ConditionNotify(&pool->work);
+	Tcl_MutexUnlock(&pool->lock);
+}
+
+/* help out with the queued bands until all of them are done */
+void pool_wait (TclTheoraObject *tto) {
+	convertPool *pool=&tto->pool;
+	convertJob job;
+	if (pool->nhelpers==0) return;
+	Tcl_MutexLock(&pool->lock);
+	for (;;) {
+		if (take_job(pool,&job)) {
+			Tcl_MutexUnlock(&pool->lock);
+			run_job(&job);
+			Tcl_MutexLock(&pool->lock);
+			if (--pool->pending==0) Tcl_ConditionNotify(&pool->idle);
+			continue;
+		}
+		if (pool->pending==0) break;
+		Tcl_ConditionWait(&pool->idle,&pool->lock,NULL);
+	}
+	Tcl_MutexUnlock(&pool->lock);
+}
+
+/* convert the whole picture area, using the pool */
+void pool_convert (TclTheoraObject *tto, th_info *info, th_ycbcr_buffer buffer,
+		Tk_PhotoImageBlock *dst)
+{
+	pool_submit(tto,info,buffer,0,info->pic_height,dst);
+	pool_wait(tto);
+}
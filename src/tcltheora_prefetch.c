@@ -0,0 +1,286 @@
+/*
+ * This file is part of MVTH - the Machine Vision Test Harness.
+ *
+ * Decode and convert frames ahead of time on a background thread,
+ * so that "next" only has to copy a finished frame into a photo.
+ *
+ * Copyright (C) 2011 Samuel P. Bromley <sam@sambromley.com>
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License Version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (see the file named "COPYING"), and a copy of the GNU Lesser General
+ * Public License (see the file named "COPYING.LESSER") along with MVTH.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tcl.h>
+#include "tcltheora.h"
+#include "tcltheora_yuv.h"
+
+/* While the worker runs it owns the ogg sync state, the stream states and
+ * the decoder context. The ring indices are handed over with acquire/release
+ * atomics; worker_lock and worker_cond are only used to sleep when the
+ * ring is full (worker) or empty (Tcl thread). */
+
+static inline unsigned int ring_load (unsigned int *p) {
+	return __atomic_load_n(p,__ATOMIC_ACQUIRE);
+}
+
+static inline void ring_store (unsigned int *p, unsigned int v) {
+	__atomic_store_n(p,v,__ATOMIC_RELEASE);
+}
+
+static void worker_notify (TclTheoraObject *tto) {
+	Tcl_MutexLock(&tto->worker_lock);
+	Tcl_ConditionNotify(&tto->worker_cond);
+	Tcl_MutexUnlock(&tto->worker_lock);
+}
+
+static Tcl_ThreadCreateType prefetch_thread (ClientData clientData) {
+	TclTheoraObject *tto=(TclTheoraObject *)clientData;
+	frameRing *ring=&tto->ring;
+	th_info *info=&tto->streams[0]->mTheora.mInfo;
+	ogg_int64_t granulepos;
+	int stop;
+
+	for (;;) {
+		unsigned int tail=ring->tail;
+		/* wait for room in the ring */
+		Tcl_MutexLock(&tto->worker_lock);
+		while (!tto->worker_stop && tail-ring_load(&ring->head)>=ring->limit) {
+			Tcl_ConditionWait(&tto->worker_cond,&tto->worker_lock,NULL);
+		}
+		stop=tto->worker_stop;
+		Tcl_MutexUnlock(&tto->worker_lock);
+		if (stop) break;
+
+		readyFrame *slot=&ring->slots[tail&(ring->size-1)];
+		int got;
+		if (!frame_format_is_full(&tto->ring_format)) {
+			/* scaled, cropped or gray ("next -scale" and so on) */
+			got=decode_next_frame_format(tto,&tto->ring_format,slot,&granulepos);
+		} else {
+			if (slot->pixels==NULL || slot->width!=(int)info->pic_width
+					|| slot->height!=(int)info->pic_height) {
+				if (slot->pixels!=NULL) ckfree((char*)slot->pixels);
+				slot->width=info->pic_width;
+				slot->height=info->pic_height;
+				slot->pixels=(unsigned char*)ckalloc(4*slot->width*slot->height);
+			}
+			Tk_PhotoImageBlock block;
+			block.pixelPtr=slot->pixels;
+			block.width=slot->width;
+			block.height=slot->height;
+			block.pitch=4*slot->width;
+			block.pixelSize=4;
+			block.offset[0]=0;
+			block.offset[1]=1;
+			block.offset[2]=2;
+			block.offset[3]=3;
+			/* the decoder converts into the slot as it goes */
+			got=decode_next_frame_rgb(tto,&block,NULL,NULL,&granulepos);
+		}
+		if (got!=1) {
+			Tcl_MutexLock(&tto->worker_lock);
+			tto->worker_done=1;
+			Tcl_ConditionNotify(&tto->worker_cond);
+			Tcl_MutexUnlock(&tto->worker_lock);
+			break;
+		}
+		slot->granulepos=granulepos;
+
+		/* publish the frame */
+		ring_store(&ring->tail,tail+1);
+		worker_notify(tto);
+	}
+	TCL_THREAD_CREATE_RETURN;
+}
+
+/* Start decoding ahead, keeping up to tto->prefetch frames ready.
+ * Frames already waiting in the ring are kept. */
+int prefetch_start (TclTheoraObject *tto) {
+	frameRing *ring=&tto->ring;
+	unsigned int pending=ring->tail-ring->head;
+	unsigned int want=(unsigned int)tto->prefetch;
+	unsigned int size=1;
+	unsigned int i;
+
+	if (tto->worker_running || tto->prefetch<=0) return TCL_OK;
+	/* a Tcl channel can only be read from the thread that owns it */
+	if (tto->channel!=NULL) return TCL_OK;
+	if (want<pending) want=pending;
+	while (size<want) size<<=1;
+
+	if (ring->size!=size) {
+		/* move the pending frames (and spare buffers) into a new ring */
+		readyFrame *slots=(readyFrame*)ckalloc(size*sizeof(readyFrame));
+		memset(slots,0,size*sizeof(readyFrame));
+		for (i=0;i<ring->size;i++) {
+			readyFrame *old=&ring->slots[(ring->head+i)&(ring->size-1)];
+			if (i<size) {
+				slots[i]=*old;
+			} else if (old->pixels!=NULL) {
+				ckfree((char*)old->pixels);
+			}
+		}
+		if (ring->slots!=NULL) ckfree((char*)ring->slots);
+		ring->slots=slots;
+		ring->size=size;
+		ring->head=0;
+		ring->tail=pending;
+	}
+	ring->limit=(unsigned int)tto->prefetch;
+
+	tto->worker_stop=0;
+	tto->worker_done=0;
+	if (Tcl_CreateThread(&tto->worker,prefetch_thread,(ClientData)tto,
+				TCL_THREAD_STACK_DEFAULT,TCL_THREAD_JOINABLE)!=TCL_OK) {
+		return TCL_ERROR;
+	}
+	tto->worker_running=1;
+	return TCL_OK;
+}
+
+/* Stop the worker thread. Frames it already finished stay in the ring
+ * and are handed out by "next" before it resumes decoding itself. */
+void prefetch_stop (TclTheoraObject *tto) {
+	int result;
+	if (tto->worker_running) {
+		Tcl_MutexLock(&tto->worker_lock);
+		tto->worker_stop=1;
+		Tcl_ConditionNotify(&tto->worker_cond);
+		Tcl_MutexUnlock(&tto->worker_lock);
+		Tcl_JoinThread(tto->worker,&result);
+		tto->worker_running=0;
+	}
+	/* nobody else waits on them; they are made again if it restarts */
+	Tcl_MutexFinalize(&tto->worker_lock);
+	Tcl_ConditionFinalize(&tto->worker_cond);
+}
+
+/* Stop the worker and throw away everything in the ring */
+void prefetch_flush (TclTheoraObject *tto) {
+	frameRing *ring=&tto->ring;
+	unsigned int i;
+	prefetch_stop(tto);
+	for (i=0;i<ring->size;i++) {
+		if (ring->slots[i].pixels!=NULL) ckfree((char*)ring->slots[i].pixels);
+	}
+	if (ring->slots!=NULL) ckfree((char*)ring->slots);
+	memset(ring,0,sizeof(frameRing));
+	tto->worker_done=0;
+}
+
+/* Stop the worker and forget the frames in the ring, but keep its
+ * buffers for when it starts again */
+void prefetch_discard (TclTheoraObject *tto) {
+	prefetch_stop(tto);
+	tto->ring.head=tto->ring.tail;
+	tto->worker_done=0;
+}
+
+/* Get the oldest ready frame, waiting for the worker if need be.
+ * Returns 1 with *frame set (hand it back with prefetch_release()),
+ * 0 if the worker reached the end of the file, or -1 if there is no
+ * worker and nothing left in the ring, in which case the caller should
+ * decode the frame itself. */
+int prefetch_next (TclTheoraObject *tto, readyFrame **frame) {
+	frameRing *ring=&tto->ring;
+	int done;
+	for (;;) {
+		if (ring->slots!=NULL && ring_load(&ring->tail)!=ring->head) {
+			*frame=&ring->slots[ring->head&(ring->size-1)];
+			return 1;
+		}
+		if (!tto->worker_running) {
+			if (ring->slots!=NULL) prefetch_flush(tto);
+			return -1;
+		}
+		Tcl_MutexLock(&tto->worker_lock);
+		while (ring_load(&ring->tail)==ring->head && !tto->worker_done) {
+			Tcl_ConditionWait(&tto->worker_cond,&tto->worker_lock,NULL);
+		}
+		done=tto->worker_done;
+		Tcl_MutexUnlock(&tto->worker_lock);
+		if (done && ring_load(&ring->tail)==ring->head) return 0;
+	}
+}
+
+/* Give the frame returned by prefetch_next() back to the worker */
+void prefetch_release (TclTheoraObject *tto) {
+	ring_store(&tto->ring.head,tto->ring.head+1);
+	if (tto->worker_running) worker_notify(tto);
+}
+
+/* Throw away up to n frames that are already decoded, without waiting
+ * for the worker. Returns how many were dropped. */
+int prefetch_drop (TclTheoraObject *tto, int n) {
+	frameRing *ring=&tto->ring;
+	int dropped=0;
+	if (ring->slots==NULL) return 0;
+	while (dropped<n && ring_load(&ring->tail)!=ring->head) {
+		tto->granulepos=ring->slots[ring->head&(ring->size-1)].granulepos;
+		prefetch_release(tto);
+		dropped++;
+	}
+	return dropped;
+}
+
+/* Stop decoding ahead and put the decoder back on the first frame that
+ * has not been handed out yet, for callers that want to decode frames
+ * themselves. The next plain "next" starts the worker again. Returns 0
+ * on success, -1 if the seek back failed. */
+int prefetch_sync (TclTheoraObject *tto) {
+	frameRing *ring=&tto->ring;
+	ogg_int64_t frame;
+	/* the decoder is already ours, and where it should be */
+	if (!tto->worker_running && ring->tail==ring->head) return 0;
+	prefetch_stop(tto);
+	if (ring->slots==NULL || ring->tail==ring->head) {
+		/* nothing decoded that has not been shown */
+		prefetch_flush(tto);
+		return 0;
+	}
+	frame=th_granule_frame(tto->streams[0]->mTheora.mCtx,
+			ring->slots[ring->head&(ring->size-1)].granulepos);
+	prefetch_flush(tto);
+	return seek_to_frame(tto,frame);
+}
+
+/* do a and b (either may be NULL) ask for the same conversion? */
+static int format_same (frameFormat *a, frameFormat *b) {
+	if (frame_format_is_full(a) || frame_format_is_full(b)) {
+		return frame_format_is_full(a) && frame_format_is_full(b);
+	}
+	return memcmp(a,b,sizeof(frameFormat))==0;
+}
+
+/* Have the worker convert the frames it decodes as fmt (which may be
+ * NULL) says, starting it if it is not running. Frames already in the
+ * ring the other way are decoded again. Returns 0 on success, -1 if the
+ * seek back failed. */
+int prefetch_format (TclTheoraObject *tto, frameFormat *fmt) {
+	if (!format_same(fmt,&tto->ring_format)) {
+		if (prefetch_sync(tto)!=0) return -1;
+		if (fmt!=NULL) tto->ring_format=*fmt;
+		else memset(&tto->ring_format,0,sizeof(frameFormat));
+	}
+	/* if the thread will not start, the caller decodes the frame */
+	prefetch_start(tto);
+	return 0;
+}
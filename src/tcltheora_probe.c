@@ -0,0 +1,357 @@
+/*
+ * This file is part of MVTH - the Machine Vision Test Harness.
+ *
+ * Read just the headers of Ogg files ("theora probe"), for cataloguing,
+ * optionally many files at once on a few threads ("theora probeMany").
+ *
+ * Copyright (C) 2011 Samuel P. Bromley <sam@sambromley.com>
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License Version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (see the file named "COPYING"), and a copy of the GNU Lesser General
+ * Public License (see the file named "COPYING.LESSER") along with MVTH.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <tcl.h>
+#include <ogg/ogg.h>
+#include <theora/theoradec.h>
+#include "tcltheora.h"
+
+/* Probing never allocates a decoder: th_decode_headerin() is all it
+ * needs. The work on the file is done without touching Tcl, so that
+ * probeMany can run it on other threads; the results are turned into
+ * Tcl objects back on the interpreter's thread. */
+
+/* give up looking for the headers after this much of a file; probeMany
+ * only keeps the results of this many files at a time */
+enum {PROBE_MAX_BYTES=8*1024*1024, PROBE_READ=4096, PROBE_MAX_THREADS=64,
+	PROBE_CHUNK=256};
+
+typedef struct probeStream_s {
+	int serial;
+	const char *type;
+	int theora; /* these are only used for theora streams */
+	ogg_stream_state state;
+	th_info info;
+	th_comment comment;
+	th_setup_info *setup; /* set once all three headers are in */
+	int complete; /* ...which is all that is kept of it afterwards */
+	int bad; /* the headers did not make sense */
+} probeStream;
+
+typedef struct probeResult_s {
+	const char *path;
+	const char *error; /* a static string, or NULL */
+	int num_streams;
+	probeStream streams[TCLTHEORA_MAX_NUM_STREAMS];
+} probeResult;
+
+/* what kind of stream a first packet starts */
+static const char *probe_type (ogg_packet *packet) {
+	static const struct {const char *magic; int len; const char *type;} kinds[]={
+		{"\x80theora",7,"theora"},{"\x01vorbis",7,"vorbis"},{"OpusHead",8,"opus"},
+		{"Speex   ",8,"speex"},{"\x7f""FLAC",5,"flac"},{"fishead",8,"skeleton"},
+		{"\x80kate\0\0\0",8,"kate"}
+	};
+	int i;
+	for (i=0;i<(int)(sizeof(kinds)/sizeof(kinds[0]));i++) {
+		if (packet->bytes>=kinds[i].len
+				&& memcmp(packet->packet,kinds[i].magic,kinds[i].len)==0) {
+			return kinds[i].type;
+		}
+	}
+	return "other";
+}
+
+static probeStream *probe_find (probeResult *r, int serial) {
+	int i;
+	for (i=0;i<r->num_streams;i++) {
+		if (r->streams[i].serial==serial) return &r->streams[i];
+	}
+	return NULL;
+}
+
+/* feed the pages of a theora stream's headers to libtheora */
+static void probe_headers (probeStream *s, ogg_page *page) {
+	ogg_packet packet;
+	int ret;
+	if (ogg_stream_pagein(&s->state,page)!=0) return;
+	while (s->setup==NULL && !s->bad
+			&& (ret=ogg_stream_packetout(&s->state,&packet))!=0) {
+		if (ret<0) continue;
+		if (th_decode_headerin(&s->info,&s->comment,&s->setup,&packet)<=0) s->bad=1;
+	}
+}
+
+/* are we still waiting for any theora headers? */
+static int probe_pending (probeResult *r) {
+	int i;
+	for (i=0;i<r->num_streams;i++) {
+		probeStream *s=&r->streams[i];
+		if (s->theora && s->setup==NULL && !s->bad) return 1;
+	}
+	return 0;
+}
+
+/* Read the first pages of each stream of r->path, and the headers of
+ * the theora ones. Sets r->error if the file is not Ogg at all. */
+static void probe_file (probeResult *r) {
+	ogg_sync_state sync;
+	ogg_page page;
+	ogg_packet packet;
+	long total=0;
+	int i,bos_done=0;
+	FILE *fp=fopen(r->path,"rb");
+
+	if (fp==NULL) {
+		r->error="Cannot open file.";
+		return;
+	}
+	ogg_sync_init(&sync);
+	for (;;) {
+		int ret=ogg_sync_pageout(&sync,&page);
+		if (ret==0) {
+			size_t n;
+			char *buffer;
+			if (total>=PROBE_MAX_BYTES) break;
+			buffer=ogg_sync_buffer(&sync,PROBE_READ);
+			n=fread(buffer,1,PROBE_READ,fp);
+			if (n==0) break;
+			ogg_sync_wrote(&sync,(long)n);
+			total+=(long)n;
+			continue;
+		}
+		if (ret<0) continue;
+		if (ogg_page_bos(&page) && !bos_done) {
+			probeStream *s;
+			if (r->num_streams==TCLTHEORA_MAX_NUM_STREAMS
+					|| probe_find(r,ogg_page_serialno(&page))!=NULL) continue;
+			s=&r->streams[r->num_streams++];
+			memset(s,0,sizeof(probeStream));
+			s->serial=ogg_page_serialno(&page);
+			ogg_stream_init(&s->state,s->serial);
+			th_info_init(&s->info);
+			th_comment_init(&s->comment);
+			ogg_stream_pagein(&s->state,&page);
+			s->type=ogg_stream_packetpeek(&s->state,&packet)==1?probe_type(&packet):"other";
+			s->theora=strcmp(s->type,"theora")==0;
+			ogg_stream_reset(&s->state);
+			if (s->theora) probe_headers(s,&page);
+			continue;
+		}
+		/* the streams all start before anything else */
+		bos_done=1;
+		{
+			probeStream *s=probe_find(r,ogg_page_serialno(&page));
+			if (s!=NULL && s->theora) probe_headers(s,&page);
+		}
+		if (!probe_pending(r)) break;
+	}
+	ogg_sync_clear(&sync);
+	fclose(fp);
+	/* only the info and comments are wanted from here on */
+	for (i=0;i<r->num_streams;i++) {
+		probeStream *s=&r->streams[i];
+		ogg_stream_clear(&s->state);
+		s->complete=s->setup!=NULL;
+		if (s->setup!=NULL) th_setup_free(s->setup);
+		s->setup=NULL;
+	}
+	if (r->num_streams==0) r->error="Not an Ogg file.";
+}
+
+/* let go of what probe_file() kept */
+static void probe_free (probeResult *r) {
+	int i;
+	for (i=0;i<r->num_streams;i++) {
+		probeStream *s=&r->streams[i];
+		th_info_clear(&s->info);
+		th_comment_clear(&s->comment);
+	}
+	r->num_streams=0;
+}
+
+/* every field of a th_info */
+static Tcl_Obj *probe_info_obj (th_info *info) {
+	static const char *colorspaces[]={"unspecified","rec470m","rec470bg"};
+	static const char *formats[]={"420","rsvd","422","444"};
+	Tcl_Obj *result=Tcl_NewDictObj();
+	dict_put_int(result,"versionMajor",info->version_major);
+	dict_put_int(result,"versionMinor",info->version_minor);
+	dict_put_int(result,"versionSubminor",info->version_subminor);
+	dict_put_int(result,"frameWidth",info->frame_width);
+	dict_put_int(result,"frameHeight",info->frame_height);
+	dict_put_int(result,"picWidth",info->pic_width);
+	dict_put_int(result,"picHeight",info->pic_height);
+	dict_put_int(result,"picX",info->pic_x);
+	dict_put_int(result,"picY",info->pic_y);
+	dict_put_int(result,"fpsNumerator",info->fps_numerator);
+	dict_put_int(result,"fpsDenominator",info->fps_denominator);
+	dict_put_int(result,"aspectNumerator",info->aspect_numerator);
+	dict_put_int(result,"aspectDenominator",info->aspect_denominator);
+	dict_put(result,"colorspace",Tcl_NewStringObj(
+				(unsigned)info->colorspace<3?colorspaces[info->colorspace]:"unknown",-1));
+	dict_put(result,"pixelFormat",Tcl_NewStringObj(
+				(unsigned)info->pixel_fmt<4?formats[info->pixel_fmt]:"unknown",-1));
+	dict_put_int(result,"targetBitrate",info->target_bitrate);
+	dict_put_int(result,"quality",info->quality);
+	dict_put_int(result,"keyframeGranuleShift",info->keyframe_granule_shift);
+	return result;
+}
+
+/* the result of probing a file, as a dict */
+static Tcl_Obj *probe_obj (probeResult *r) {
+	Tcl_Obj *result=Tcl_NewDictObj();
+	Tcl_Obj *streams=Tcl_NewListObj(0,NULL);
+	int i,j;
+	dict_put(result,"file",Tcl_NewStringObj(r->path,-1));
+	if (r->error!=NULL) {
+		dict_put(result,"error",Tcl_NewStringObj(r->error,-1));
+		return result;
+	}
+	for (i=0;i<r->num_streams;i++) {
+		probeStream *s=&r->streams[i];
+		Tcl_Obj *stream=Tcl_NewDictObj();
+		dict_put_int(stream,"serial",s->serial);
+		dict_put(stream,"type",Tcl_NewStringObj(s->type,-1));
+		if (s->theora) {
+			Tcl_Obj *comments=Tcl_NewListObj(0,NULL);
+			dict_put(stream,"headers",Tcl_NewStringObj(
+						s->complete?"complete":s->bad?"bad":"incomplete",-1));
+			dict_put(stream,"info",probe_info_obj(&s->info));
+			dict_put(stream,"vendor",Tcl_NewStringObj(
+						s->comment.vendor!=NULL?s->comment.vendor:"",-1));
+			for (j=0;j<s->comment.comments;j++) {
+				Tcl_ListObjAppendElement(NULL,comments,Tcl_NewStringObj(
+							s->comment.user_comments[j],s->comment.comment_lengths[j]));
+			}
+			dict_put(stream,"comments",comments);
+		}
+		Tcl_ListObjAppendElement(NULL,streams,stream);
+	}
+	dict_put(result,"streams",streams);
+	return result;
+}
+
+/* theora probe file */
+int TclTheora_Probe_Cmd(ClientData clientData, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[])
+{
+	probeResult *r;
+	(void)clientData;
+	if (objc!=2) {
+		Tcl_WrongNumArgs(interp,1,objv,"file");
+		return TCL_ERROR;
+	}
+	r=(probeResult*)ckalloc(sizeof(probeResult));
+	memset(r,0,sizeof(probeResult));
+	r->path=Tcl_GetString(objv[1]);
+	probe_file(r);
+	if (r->error!=NULL) {
+		Tcl_AppendResult(interp,r->error," (",r->path,")\n",NULL);
+		probe_free(r);
+		ckfree((char*)r);
+		return TCL_ERROR;
+	}
+	Tcl_SetObjResult(interp,probe_obj(r));
+	probe_free(r);
+	ckfree((char*)r);
+	return TCL_OK;
+}
+
+/* files shared out among the probing threads */
+typedef struct probeBatch_s {
+	probeResult *results;
+	int count;
+	int next; /* the next file nobody has taken */
+} probeBatch;
+
+/* probe files until there are none left */
+static void probe_batch (probeBatch *batch) {
+	int i;
+	while ((i=__atomic_fetch_add(&batch->next,1,__ATOMIC_RELAXED))<batch->count) {
+		probe_file(&batch->results[i]);
+	}
+}
+
+static Tcl_ThreadCreateType probe_thread (ClientData clientData) {
+	probe_batch((probeBatch *)clientData);
+	TCL_THREAD_CREATE_RETURN;
+}
+
+/* theora probeMany files ?-threads n?
+ * Probes the files in parallel and returns a list of dicts, in the same
+ * order. A file that could not be probed gets a dict with an "error". */
+int TclTheora_ProbeMany_Cmd(ClientData clientData, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[])
+{
+	Tcl_ThreadId threads[PROBE_MAX_THREADS];
+	Tcl_Obj **files;
+	Tcl_Obj *result;
+	probeBatch batch;
+	long cpus=sysconf(_SC_NPROCESSORS_ONLN);
+	int nthreads,started;
+	int i,n,first,status;
+
+	(void)clientData;
+	/* the work is mostly waiting for the disk, so be generous */
+	nthreads=cpus>0?2*(int)cpus:4;
+	if (objc==4 && strcmp(Tcl_GetString(objv[2]),"-threads")==0) {
+		if (Tcl_GetIntFromObj(interp,objv[3],&nthreads)!=TCL_OK) return TCL_ERROR;
+		if (nthreads<1) {
+			Tcl_AppendResult(interp,"-threads must be >= 1\n",NULL);
+			return TCL_ERROR;
+		}
+	} else if (objc!=2) {
+		Tcl_WrongNumArgs(interp,1,objv,"files ?-threads n?");
+		return TCL_ERROR;
+	}
+	if (nthreads>PROBE_MAX_THREADS) nthreads=PROBE_MAX_THREADS;
+	if (Tcl_ListObjGetElements(interp,objv[1],&n,&files)!=TCL_OK) return TCL_ERROR;
+
+	if (nthreads>n) nthreads=n;
+	batch.results=(probeResult*)ckalloc(PROBE_CHUNK*sizeof(probeResult));
+	result=Tcl_NewListObj(0,NULL);
+	/* a chunk at a time, so a long list does not hold every file's
+	 * headers at once */
+	for (first=0;first<n;first+=batch.count) {
+		batch.count=n-first<PROBE_CHUNK?n-first:PROBE_CHUNK;
+		batch.next=0;
+		memset(batch.results,0,batch.count*sizeof(probeResult));
+		for (i=0;i<batch.count;i++) batch.results[i].path=Tcl_GetString(files[first+i]);
+		/* this thread takes a share too */
+		started=0;
+		for (i=0;i<nthreads-1 && i<batch.count-1;i++) {
+			if (Tcl_CreateThread(&threads[started],probe_thread,(ClientData)&batch,
+						TCL_THREAD_STACK_DEFAULT,TCL_THREAD_JOINABLE)!=TCL_OK) break;
+			started++;
+		}
+		probe_batch(&batch);
+		for (i=0;i<started;i++) Tcl_JoinThread(threads[i],&status);
+
+		for (i=0;i<batch.count;i++) {
+			Tcl_ListObjAppendElement(NULL,result,probe_obj(&batch.results[i]));
+			probe_free(&batch.results[i]);
+		}
+	}
+	ckfree((char*)batch.results);
+	Tcl_SetObjResult(interp,result);
+	return TCL_OK;
+}
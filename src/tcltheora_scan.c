@@ -0,0 +1,459 @@
+/*
+ * This file is part of MVTH - the Machine Vision Test Harness.
+ *
+ * Decode a whole file for analysis as fast as possible: the frames are
+ * split into segments that are decoded at the same time, each by a
+ * decoder of its own, and handed to a script with their frame numbers.
+ *
+ * Copyright (C) 2011 Samuel P. Bromley <sam@sambromley.com>
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License Version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (see the file named "COPYING"), and a copy of the GNU Lesser General
+ * Public License (see the file named "COPYING.LESSER") along with MVTH.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <tcl.h>
+#include <ogg/ogg.h>
+#include <theora/theoradec.h>
+#include "tcltheora.h"
+
+/* Each worker thread is a theora object of its own, with its own file
+ * handle, ogg state and decoder, so it can seek and decode without
+ * minding the others. Only the headers are read once: the workers'
+ * decoders are all made from the first object's setup. A segment is
+ * decoded starting from the keyframe before its first frame, so at most
+ * a group of pictures is decoded twice. The queues are only touched with
+ * the lock held. */
+
+/* frames a segment may have waiting before its worker stops for them */
+enum {SCAN_QUEUE=8, SCAN_MAX_THREADS=64, SCAN_SEGMENTS_PER_THREAD=4};
+
+/* a decoded frame, its planes packed (stride equal to width) after it */
+typedef struct scanFrame_s {
+	ogg_int64_t frame;
+	int nplanes;
+	th_img_plane planes[3];
+	struct scanFrame_s *next;
+} scanFrame;
+
+/* frames first..end-1, done by whichever worker gets there first */
+typedef struct scanSegment_s {
+	ogg_int64_t first;
+	ogg_int64_t end;
+	scanFrame *head; /* oldest first */
+	scanFrame *tail;
+	int count;
+	int done; /* the worker has finished with it */
+	int failed; /* and could not seek to first */
+} scanSegment;
+
+typedef struct scanJob_s {
+	scanSegment *segments;
+	int nsegments;
+	int next; /* the next segment nobody has taken */
+	int gray; /* only the Y' plane is wanted */
+	int abort;
+	Tcl_Mutex lock;
+	Tcl_Condition cond; /* a frame was queued or taken, or a segment done */
+} scanJob;
+
+typedef struct scanWorker_s {
+	scanJob *job;
+	TclTheoraObject *tto;
+	Tcl_ThreadId thread;
+	int running;
+} scanWorker;
+
+/* copy the planes out of the decoder's buffer */
+static scanFrame *scan_copy (th_ycbcr_buffer buffer, ogg_int64_t frame, int gray) {
+	int nplanes=gray?1:3;
+	long bytes=0;
+	unsigned char *dst;
+	scanFrame *f;
+	int i,row;
+	for (i=0;i<nplanes;i++) bytes+=(long)buffer[i].width*buffer[i].height;
+	f=(scanFrame*)ckalloc(sizeof(scanFrame)+bytes);
+	f->frame=frame;
+	f->nplanes=nplanes;
+	f->next=NULL;
+	dst=(unsigned char*)(f+1);
+	for (i=0;i<nplanes;i++) {
+		th_img_plane *plane=&buffer[i];
+		f->planes[i].width=plane->width;
+		f->planes[i].height=plane->height;
+		f->planes[i].stride=plane->width;
+		f->planes[i].data=dst;
+		for (row=0;row<plane->height;row++) {
+			memcpy(dst,plane->data+row*plane->stride,plane->width);
+			dst+=plane->width;
+		}
+	}
+	return f;
+}
+
+/* Queue a frame of seg, waiting for room. Returns -1 (and frees the
+ * frame) if the scan is being called off. */
+static int scan_put (scanJob *job, scanSegment *seg, scanFrame *f) {
+	Tcl_MutexLock(&job->lock);
+	while (!job->abort && seg->count>=SCAN_QUEUE) {
+		Tcl_ConditionWait(&job->cond,&job->lock,NULL);
+	}
+	if (job->abort) {
+		Tcl_MutexUnlock(&job->lock);
+		ckfree((char*)f);
+		return -1;
+	}
+	if (seg->tail!=NULL) seg->tail->next=f;
+	else seg->head=f;
+	seg->tail=f;
+	seg->count++;
+	Tcl_ConditionNotify(&job->cond);
+	Tcl_MutexUnlock(&job->lock);
+	return 0;
+}
+
+/* decode the frames of one segment */
+static void scan_segment (scanWorker *w, scanSegment *seg) {
+	scanJob *job=w->job;
+	TclTheoraObject *tto=w->tto;
+	th_dec_ctx *ctx=tto->streams[0]->mTheora.mCtx;
+	th_ycbcr_buffer buffer;
+	ogg_int64_t gp,frame;
+	ogg_uint64_t start;
+	int failed=0;
+
+	if (seek_to_frame(tto,seg->first)!=0) {
+		failed=1;
+	} else {
+		while (!__atomic_load_n(&job->abort,__ATOMIC_RELAXED)
+				&& decode_next_packet(tto,&gp)==1) {
+			frame=th_granule_frame(ctx,gp);
+			if (frame>=seg->end) break;
+			if (frame<seg->first) continue;
+			start=stats_now();
+			th_decode_ycbcr_out(ctx,buffer);
+			stats_time(&tto->stats,STATS_YCBCR_OUT,start);
+			if (scan_put(job,seg,scan_copy(buffer,frame,job->gray))!=0) break;
+		}
+	}
+	Tcl_MutexLock(&job->lock);
+	seg->failed=failed;
+	seg->done=1;
+	Tcl_ConditionNotify(&job->cond);
+	Tcl_MutexUnlock(&job->lock);
+}
+
+/* Segments are taken in order, so the one the caller is waiting on in
+ * ordered mode always has a worker that is not stuck behind a full
+ * queue of a later one. */
+static Tcl_ThreadCreateType scan_thread (ClientData clientData) {
+	scanWorker *w=(scanWorker *)clientData;
+	scanJob *job=w->job;
+	int i;
+	while ((i=__atomic_fetch_add(&job->next,1,__ATOMIC_RELAXED))<job->nsegments) {
+		scan_segment(w,&job->segments[i]);
+	}
+	TCL_THREAD_CREATE_RETURN;
+}
+
+/* Take the next frame to hand out: the next in frame order if ordered,
+ * or else whichever is ready. *current is the first segment that may
+ * still have frames. Returns NULL once every segment is finished, or
+ * when the frames run up to one that failed, which *current is left at. */
+static scanFrame *scan_take (scanJob *job, int ordered, int *current) {
+	scanFrame *f=NULL;
+	int i;
+	Tcl_MutexLock(&job->lock);
+	for (;;) {
+		scanSegment *seg;
+		while (*current<job->nsegments) {
+			seg=&job->segments[*current];
+			if (seg->head!=NULL || !seg->done || seg->failed) break;
+			(*current)++;
+		}
+		if (*current==job->nsegments || job->segments[*current].failed) break;
+		for (i=*current;i<job->nsegments;i++) {
+			seg=&job->segments[i];
+			if (seg->head!=NULL) {
+				f=seg->head;
+				seg->head=f->next;
+				if (seg->head==NULL) seg->tail=NULL;
+				seg->count--;
+				break;
+			}
+			if (ordered) break;
+		}
+		if (f!=NULL) break;
+		Tcl_ConditionWait(&job->cond,&job->lock,NULL);
+	}
+	/* there is room in that queue again */
+	Tcl_ConditionNotify(&job->cond);
+	Tcl_MutexUnlock(&job->lock);
+	return f;
+}
+
+/* A worker object for the file tto has open, sharing its decoder setup.
+ * Returns NULL if the file cannot be opened again. */
+static TclTheoraObject *scan_worker_new (TclTheoraObject *tto) {
+	oggStream *src=tto->streams[0];
+	oggStream *stream;
+	TclTheoraObject *w;
+	FILE *fp=fopen(tto->filename,"r");
+	if (fp==NULL) return NULL;
+	w=theora_object_alloc();
+	w->quiet=1;
+	w->fp=fp;
+	if (input_open(w,1)!=0) {
+		theora_destroy_func((void*)w);
+		return NULL;
+	}
+	/* frames are never kept around here */
+	frame_cache_set_budget(w,0);
+	w->sync_state=(ogg_sync_state*)ckalloc(sizeof(ogg_sync_state));
+	ogg_sync_init(w->sync_state);
+	w->page=(ogg_page*)ckalloc(sizeof(ogg_page));
+	stream=(oggStream*)ckalloc(sizeof(oggStream));
+	memset(stream,0,sizeof(oggStream));
+	stream->mSerial=src->mSerial;
+	ogg_stream_init(&stream->mState,src->mSerial);
+	stream->stream_type=STREAM_TYPE_THEORA;
+	stream->active=1;
+	stream->mTheora.mInfo=src->mTheora.mInfo;
+	th_comment_init(&stream->mTheora.mComment);
+	stream->mTheora.mCtx=th_decode_alloc(&stream->mTheora.mInfo,src->mTheora.mSetup);
+	w->streams[0]=stream;
+	w->num_streams=1;
+	w->headers_read=1;
+	w->data_offset=tto->data_offset>=0?tto->data_offset:tto->rewind_offset;
+	w->rewind_offset=tto->rewind_offset;
+	/* start out knowing what the first object knows about the pages */
+	if (tto->index.count>0) {
+		w->index.alloc=tto->index.count;
+		w->index.count=tto->index.count;
+		w->index.entries=(seekEntry*)ckalloc(w->index.alloc*sizeof(seekEntry));
+		memcpy(w->index.entries,tto->index.entries,w->index.count*sizeof(seekEntry));
+	}
+	if (stream->mTheora.mCtx==NULL) {
+		theora_destroy_func((void*)w);
+		return NULL;
+	}
+	return w;
+}
+
+/* the frame's planes, as "nextYUV" would have them */
+static Tcl_Obj *scan_frame_obj (th_info *info, scanFrame *f) {
+	th_img_plane planes[3];
+	Tcl_Obj *data[3];
+	int i;
+	/* with -gray the chroma planes were never copied, but say how big
+	 * they would have been */
+	for (i=0;i<3;i++) {
+		planes[i].width=info->frame_width>>(i && info->pixel_fmt!=TH_PF_444);
+		planes[i].height=info->frame_height>>(i && info->pixel_fmt==TH_PF_420);
+	}
+	for (i=0;i<f->nplanes;i++) {
+		planes[i]=f->planes[i];
+		data[i]=Tcl_NewByteArrayObj(f->planes[i].data,
+				f->planes[i].width*f->planes[i].height);
+	}
+	return yuv_frame_obj(info,planes,data,f->nplanes,
+			info->pic_x,info->pic_y,info->pic_width,info->pic_height);
+}
+
+/* theora scan file ?-threads n? ?-ordered bool? ?-gray bool? -command cmd
+ * Decodes every frame of the file, n segments at a time, and calls cmd
+ * with the frame number and a dict of its planes (see "nextYUV"). With
+ * -ordered 0 the frames come as soon as they are ready, in no particular
+ * order. A break in cmd ends the scan early. Returns the number of
+ * frames handed to cmd, or an error once the frames before a part that
+ * could not be sought to have been handed out. */
+int TclTheora_Scan_Cmd(ClientData clientData, Tcl_Interp *interp,
+		int objc, Tcl_Obj *CONST objv[])
+{
+	CONST char *options[] = {"-threads","-ordered","-gray","-command",NULL};
+	enum ScanOptIx {ThreadsIx,OrderedIx,GrayIx,CommandIx};
+	scanWorker workers[SCAN_MAX_THREADS];
+	TclTheoraObject *tto;
+	Tcl_Obj *command=NULL;
+	th_info *info;
+	scanJob job;
+	scanFrame *f;
+	FILE *fp;
+	long cpus=sysconf(_SC_NPROCESSORS_ONLN);
+	ogg_int64_t gp,nframes=0,length,gop;
+	Tcl_WideInt delivered=0;
+	int nthreads=cpus>0?(int)cpus:2;
+	int ordered=1;
+	int started=0,current=0;
+	int ret=TCL_OK;
+	int i,index,status;
+
+	(void)clientData;
+	memset(&job,0,sizeof(job));
+	if (objc<2 || objc%2!=0) {
+		Tcl_WrongNumArgs(interp,1,objv,
+				"file ?-threads n? ?-ordered bool? ?-gray bool? -command cmd");
+		return TCL_ERROR;
+	}
+	for (i=2;i<objc;i+=2) {
+		if (Tcl_GetIndexFromObj(interp,objv[i],options,"option",0,&index)!=TCL_OK)
+			return TCL_ERROR;
+		switch (index) {
+			case ThreadsIx:
+				if (Tcl_GetIntFromObj(interp,objv[i+1],&nthreads)!=TCL_OK) return TCL_ERROR;
+				if (nthreads<1) {
+					Tcl_AppendResult(interp,"-threads must be >= 1\n",NULL);
+					return TCL_ERROR;
+				}
+				break;
+			case OrderedIx:
+				if (Tcl_GetBooleanFromObj(interp,objv[i+1],&ordered)!=TCL_OK) return TCL_ERROR;
+				break;
+			case GrayIx:
+				if (Tcl_GetBooleanFromObj(interp,objv[i+1],&job.gray)!=TCL_OK) return TCL_ERROR;
+				break;
+			case CommandIx:
+				command=objv[i+1];
+				break;
+		}
+	}
+	if (command==NULL) {
+		Tcl_AppendResult(interp,"No -command given.\n",NULL);
+		return TCL_ERROR;
+	}
+	if (nthreads>SCAN_MAX_THREADS) nthreads=SCAN_MAX_THREADS;
+
+	fp=fopen(Tcl_GetString(objv[1]),"r");
+	if (fp==NULL) {
+		Tcl_AppendResult(interp,"Error opening file ",Tcl_GetString(objv[1])," .\n",
+				NULL);
+		return TCL_ERROR;
+	}
+	tto=theora_object_alloc();
+	tto->quiet=1;
+	tto->fp=fp;
+	tto->filename=ckalloc(strlen(Tcl_GetString(objv[1]))+1);
+	strcpy(tto->filename,Tcl_GetString(objv[1]));
+	if (input_open(tto,1)!=0) {
+		Tcl_AppendResult(interp,"Error reading file ",Tcl_GetString(objv[1])," .\n",
+				NULL);
+		theora_destroy_func((void*)tto);
+		return TCL_ERROR;
+	}
+	/* this frees tto if the file is no good */
+	if (initialize_theora_stream(interp,tto)!=TCL_OK) return TCL_ERROR;
+	index_load(tto);
+	info=&tto->streams[0]->mTheora.mInfo;
+
+	/* how many frames are there to share out? */
+	if (seek_last_granulepos(tto,&gp)==1) {
+		nframes=th_granule_frame(tto->streams[0]->mTheora.mCtx,gp)+1;
+	}
+	if (nframes<=0) {
+		theora_destroy_func((void*)tto);
+		Tcl_SetObjResult(interp,Tcl_NewIntObj(0));
+		return TCL_OK;
+	}
+	/* a few segments per thread evens out the work, but a segment much
+	 * shorter than a group of pictures is mostly decoded twice */
+	gop=(ogg_int64_t)1<<info->keyframe_granule_shift;
+	job.nsegments=nthreads*SCAN_SEGMENTS_PER_THREAD;
+	if (job.nsegments>nframes/(2*gop)) job.nsegments=(int)(nframes/(2*gop));
+	if (job.nsegments<1) job.nsegments=1;
+	if (nthreads>job.nsegments) nthreads=job.nsegments;
+	job.segments=(scanSegment*)ckalloc(job.nsegments*sizeof(scanSegment));
+	memset(job.segments,0,job.nsegments*sizeof(scanSegment));
+	length=nframes/job.nsegments;
+	for (i=0;i<job.nsegments;i++) {
+		job.segments[i].first=i*length;
+		job.segments[i].end=i==job.nsegments-1?nframes:(i+1)*length;
+	}
+
+	for (i=0;i<nthreads;i++) {
+		workers[i].job=&job;
+		workers[i].running=0;
+		workers[i].tto=scan_worker_new(tto);
+		if (workers[i].tto==NULL) {
+			nthreads=i;
+			Tcl_AppendResult(interp,"Could not set up a decoder for ",
+					Tcl_GetString(objv[1]),"\n",NULL);
+			ret=TCL_ERROR;
+			goto finish;
+		}
+	}
+	for (i=0;i<nthreads;i++) {
+		if (Tcl_CreateThread(&workers[i].thread,scan_thread,(ClientData)&workers[i],
+					TCL_THREAD_STACK_DEFAULT,TCL_THREAD_JOINABLE)!=TCL_OK) break;
+		workers[i].running=1;
+		started++;
+	}
+	if (started==0) {
+		Tcl_AppendResult(interp,"Could not start scan threads.\n",NULL);
+		ret=TCL_ERROR;
+		goto finish;
+	}
+
+	while ((f=scan_take(&job,ordered,&current))!=NULL) {
+		Tcl_Obj *cmd=Tcl_DuplicateObj(command);
+		Tcl_IncrRefCount(cmd);
+		Tcl_ListObjAppendElement(NULL,cmd,Tcl_NewWideIntObj(f->frame));
+		Tcl_ListObjAppendElement(NULL,cmd,scan_frame_obj(info,f));
+		ckfree((char*)f);
+		status=Tcl_EvalObjEx(interp,cmd,TCL_EVAL_GLOBAL);
+		Tcl_DecrRefCount(cmd);
+		delivered++;
+		if (status==TCL_BREAK) break;
+		if (status!=TCL_OK && status!=TCL_CONTINUE) {
+			ret=TCL_ERROR;
+			break;
+		}
+	}
+	if (f==NULL && current<job.nsegments) {
+		char msg[64];
+		sprintf(msg,"%lld",(long long)job.segments[current].first);
+		Tcl_AppendResult(interp,"Could not seek to frame ",msg," in ",
+				Tcl_GetString(objv[1]),"\n",NULL);
+		ret=TCL_ERROR;
+	}
+
+finish:
+	/* call the workers off, and throw away what they had ready */
+	Tcl_MutexLock(&job.lock);
+	job.abort=1;
+	Tcl_ConditionNotify(&job.cond);
+	Tcl_MutexUnlock(&job.lock);
+	for (i=0;i<nthreads;i++) {
+		if (workers[i].running) Tcl_JoinThread(workers[i].thread,&status);
+		theora_destroy_func((void*)workers[i].tto);
+	}
+	for (i=0;i<job.nsegments;i++) {
+		while ((f=job.segments[i].head)!=NULL) {
+			job.segments[i].head=f->next;
+			ckfree((char*)f);
+		}
+	}
+	ckfree((char*)job.segments);
+	Tcl_MutexFinalize(&job.lock);
+	Tcl_ConditionFinalize(&job.cond);
+	theora_destroy_func((void*)tto);
+	if (ret==TCL_OK) Tcl_SetObjResult(interp,Tcl_NewWideIntObj(delivered));
+	return ret;
+}
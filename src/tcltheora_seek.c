@@ -0,0 +1,350 @@
+/*
+ * This file is part of MVTH - the Machine Vision Test Harness.
+ *
+ * Seeking within an Ogg Theora file by bisection on page granule
+ * positions, and the page index that is built up along the way.
+ *
+ * Copyright (C) 2011 Samuel P. Bromley <sam@sambromley.com>
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License Version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (see the file named "COPYING"), and a copy of the GNU Lesser General
+ * Public License (see the file named "COPYING.LESSER") along with MVTH.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <tcl.h>
+#include "tcltheora.h"
+
+/* once the bisection has narrowed things down this far,
+ * just read through the remaining pages */
+enum {SEEK_LINEAR_SCAN=65536};
+
+/* how much of the end of the file to look at first for the last page
+ * (doubling each step back, up to SEEK_TAIL_MAX_CHUNK), and the most a
+ * page can overhang the part being looked at */
+enum {SEEK_TAIL_CHUNK=16384, SEEK_TAIL_MAX_CHUNK=4*1024*1024, SEEK_MAX_PAGE=65307};
+
+/* frame index of a granule position of the video stream */
+static ogg_int64_t gp_frame (TclTheoraObject *tto, ogg_int64_t gp) {
+	return th_granule_frame(tto->streams[0]->mTheora.mCtx,gp);
+}
+
+/* remember where a video page with a valid granule position lives.
+ * Entries are kept sorted by offset. */
+void seek_index_add (TclTheoraObject *tto, ogg_int64_t offset, ogg_int64_t gp) {
+	seekIndex *index=&tto->index;
+	int lo=0,hi=index->count;
+	/* the common case is sequential playback, which just appends */
+	if (hi==0 || index->entries[hi-1].offset<offset) {
+		lo=hi;
+	} else {
+		while (lo<hi) {
+			int mid=(lo+hi)/2;
+			if (index->entries[mid].offset<offset) lo=mid+1;
+			else hi=mid;
+		}
+		if (lo<index->count && index->entries[lo].offset==offset) return;
+	}
+	if (index->alloc==0 && index->map!=NULL) {
+		/* entries loaded from disk are read only, take a copy */
+		seekEntry *entries;
+		index->alloc=2*index->count+256;
+		entries=(seekEntry*)ckalloc(index->alloc*sizeof(seekEntry));
+		memcpy(entries,index->entries,index->count*sizeof(seekEntry));
+		munmap(index->map,index->map_len);
+		index->map=NULL;
+		index->map_len=0;
+		index->entries=entries;
+	}
+	if (index->count==index->alloc) {
+		index->alloc=index->alloc?2*index->alloc:256;
+		index->entries=(seekEntry*)ckrealloc((char*)index->entries,
+				index->alloc*sizeof(seekEntry));
+	}
+	memmove(index->entries+lo+1,index->entries+lo,
+			(index->count-lo)*sizeof(seekEntry));
+	index->entries[lo].offset=offset;
+	index->entries[lo].granulepos=gp;
+	index->count++;
+	index->dirty=1;
+}
+
+void seek_index_free (TclTheoraObject *tto) {
+	if (tto->index.map!=NULL) {
+		munmap(tto->index.map,tto->index.map_len);
+	} else if (tto->index.entries!=NULL) {
+		ckfree((char*)tto->index.entries);
+	}
+	memset(&tto->index,0,sizeof(seekIndex));
+}
+
+/* Use the index to narrow down where the last page holding a frame
+ * before target must be. */
+static void seek_index_bounds (TclTheoraObject *tto, ogg_int64_t target,
+		ogg_int64_t *lo, ogg_int64_t *lo_gp, ogg_int64_t *hi)
+{
+	seekIndex *index=&tto->index;
+	int a=0,b=index->count;
+	while (a<b) {
+		int mid=(a+b)/2;
+		if (gp_frame(tto,index->entries[mid].granulepos)<target) a=mid+1;
+		else b=mid;
+	}
+	/* entries before a hold earlier frames, a and after do not */
+	if (a>0 && index->entries[a-1].offset>*lo) {
+		*lo=index->entries[a-1].offset;
+		*lo_gp=index->entries[a-1].granulepos;
+	}
+	if (a<index->count && index->entries[a].offset<*hi) {
+		*hi=index->entries[a].offset;
+	}
+}
+
+/* restart reading the file at offset */
+static int seek_reposition (TclTheoraObject *tto, ogg_int64_t offset) {
+	return input_seek(tto,offset);
+}
+
+/* Find the first video page with a granule position that starts at or
+ * after offset and before limit. Returns 1 if one was found. */
+static int seek_scan_page (TclTheoraObject *tto, ogg_int64_t offset,
+		ogg_int64_t limit, ogg_int64_t *page_offset, ogg_int64_t *gp)
+{
+	int serial=tto->streams[0]->mSerial;
+	if (seek_reposition(tto,offset)!=0) return 0;
+	while (get_next_page(tto)==0) {
+		if (tto->page_offset>=limit) return 0;
+		if (ogg_page_serialno(tto->page)!=serial) continue;
+		if (ogg_page_granulepos(tto->page)==-1) continue;
+		*page_offset=tto->page_offset;
+		*gp=ogg_page_granulepos(tto->page);
+		return 1;
+	}
+	return 0;
+}
+
+/* Find the last video page whose granule position is for a frame before
+ * target. Returns 1 with its offset and granule position, or 0 if no such
+ * page exists (ie. the frame is in the first few pages of data). */
+static int seek_find_page_before (TclTheoraObject *tto, ogg_int64_t target,
+		ogg_int64_t *offset, ogg_int64_t *gp)
+{
+	int serial=tto->streams[0]->mSerial;
+	ogg_int64_t lo=tto->data_offset;
+	ogg_int64_t lo_gp=-1;
+	ogg_int64_t hi;
+	ogg_int64_t p,pgp;
+
+	if (input_size(tto,&hi)!=0) return 0;
+	seek_index_bounds(tto,target,&lo,&lo_gp,&hi);
+
+	/* bisect on byte offset until the gap is small */
+	while (hi-lo>SEEK_LINEAR_SCAN) {
+		ogg_int64_t mid=lo+(hi-lo)/2;
+		if (seek_scan_page(tto,mid,hi,&p,&pgp) && gp_frame(tto,pgp)<target) {
+			lo=p;
+			lo_gp=pgp;
+		} else {
+			hi=mid;
+		}
+	}
+
+	/* and walk forward over what is left */
+	if (seek_reposition(tto,lo)!=0) return 0;
+	while (get_next_page(tto)==0) {
+		if (ogg_page_serialno(tto->page)!=serial) continue;
+		pgp=ogg_page_granulepos(tto->page);
+		if (pgp==-1) continue;
+		if (gp_frame(tto,pgp)>=target) break;
+		lo=tto->page_offset;
+		lo_gp=pgp;
+	}
+	if (lo_gp==-1) return 0;
+	*offset=lo;
+	*gp=lo_gp;
+	return 1;
+}
+
+/* Go back to the first data page without reading the headers again: the
+ * stream states are emptied and the decoders restarted, all in place.
+ * Returns 0 on success, or -1 if the input cannot go back. */
+int seek_rewind (TclTheoraObject *tto) {
+	ogg_int64_t gp=0;
+	int i;
+	if (tto->rewind_offset<0) return -1;
+	if (seek_reposition(tto,tto->rewind_offset)!=0) return -1;
+	for (i=0;i<tto->num_streams;i++) {
+		oggStream *stream=tto->streams[i];
+		ogg_stream_reset(&stream->mState);
+		/* the other video streams start again at their next keyframe */
+		multi_queue_reset(stream);
+		if (stream->mTheora.mCtx!=NULL) {
+			th_decode_ctl(stream->mTheora.mCtx,TH_DECCTL_SET_GRANPOS,&gp,sizeof(gp));
+		}
+	}
+	tto->granulepos=-1;
+	return 0;
+}
+
+/* Find the granule position of the last video page, reading backwards
+ * from the end of the input a chunk at a time, and without disturbing
+ * the decoder. Returns 1 if there is one, 0 if there are no video data
+ * pages, or -1 if the input cannot be read out of order. */
+int seek_last_granulepos (TclTheoraObject *tto, ogg_int64_t *gp) {
+	int serial=tto->streams[0]->mSerial;
+	ogg_int64_t size,start,end,chunk=SEEK_TAIL_CHUNK;
+	ogg_sync_state sync;
+	ogg_page page;
+	int found=0;
+
+	if (input_size(tto,&size)!=0) return -1;
+	ogg_sync_init(&sync);
+	end=size;
+	while (!found && end>0) {
+		ogg_int64_t offset,stop;
+		long want,n;
+		char *buffer;
+		start=end>chunk?end-chunk:0;
+		if (tto->rewind_offset>0 && start<tto->rewind_offset) start=tto->rewind_offset;
+		if (start>=end) break;
+		/* pages starting before end may run on past it */
+		stop=end+SEEK_MAX_PAGE<size?end+SEEK_MAX_PAGE:size;
+		want=(long)(stop-start);
+		ogg_sync_reset(&sync);
+		buffer=ogg_sync_buffer(&sync,want);
+		n=input_read_at(tto,start,buffer,want);
+		if (n<0) {
+			ogg_sync_clear(&sync);
+			return -1;
+		}
+		ogg_sync_wrote(&sync,n);
+		offset=start;
+		while ((n=ogg_sync_pageseek(&sync,&page))!=0) {
+			if (n<0) {
+				offset-=n;
+				continue;
+			}
+			if (offset>=end) break;
+			if (ogg_page_serialno(&page)==serial && ogg_page_granulepos(&page)!=-1) {
+				*gp=ogg_page_granulepos(&page);
+				found=1;
+			}
+			offset+=n;
+		}
+		end=start;
+		if (chunk<SEEK_TAIL_MAX_CHUNK) chunk*=2;
+	}
+	ogg_sync_clear(&sync);
+	return found;
+}
+
+/* Take the packets of the video stream up to (but not including) the one
+ * for frame, which should be a keyframe, without decoding them: they
+ * depend on reference frames the decoder does not have. next is the frame
+ * of the next packet. Returns 1 if the keyframe is next, 0 if the file ends
+ * first or the packet there is not a keyframe after all. */
+static int skip_to_keyframe (TclTheoraObject *tto, ogg_int64_t next,
+		ogg_int64_t frame)
+{
+	oggStream *stream=tto->streams[0];
+	ogg_packet packet;
+	int ret;
+	for (;;) {
+		ret=ogg_stream_packetpeek(&stream->mState,&packet);
+		if (ret==0) {
+			if (get_next_page(tto)!=0) return 0;
+			route_page(tto);
+			continue;
+		}
+		if (ret<0) continue; /* lost some data, just carry on */
+		if (next==frame) return th_packet_iskeyframe(&packet)==1;
+		ogg_stream_packetout(&stream->mState,&packet);
+		stream->mPacketCount++;
+		next++;
+	}
+}
+
+/* Position the decoder so that the next frame decoded is the given one.
+ * Returns 0 on success, or -1 if something went wrong reading the file. */
+int seek_to_frame (TclTheoraObject *tto, ogg_int64_t frame) {
+	oggStream *stream=tto->streams[0];
+	th_dec_ctx *ctx=stream->mTheora.mCtx;
+	int shift=stream->mTheora.mInfo.keyframe_granule_shift;
+	ogg_int64_t offset,gp,keyframe,key_gp,start_gp,skip_gp;
+	ogg_packet packet;
+	int i;
+
+	if (tto->data_offset<0) return -1;
+	if (frame<0) frame=0;
+
+	/* which keyframe does the frame depend on? */
+	keyframe=0;
+	key_gp=0;
+	if (seek_find_page_before(tto,frame+1,&offset,&gp)) {
+		key_gp=(gp>>shift)<<shift;
+		keyframe=gp_frame(tto,key_gp);
+		if (keyframe<0) keyframe=0;
+	}
+	tto->cache.group_start=keyframe;
+
+	/* and where does the packet for that keyframe start? */
+	start_gp=0;
+	skip_gp=-1;
+	offset=tto->data_offset;
+	if (keyframe>0 && seek_find_page_before(tto,keyframe,&offset,&gp)) {
+		/* packets up to the one holding gp belong to earlier frames */
+		start_gp=gp;
+		skip_gp=gp;
+	} else {
+		offset=tto->data_offset;
+	}
+
+	if (seek_reposition(tto,offset)!=0) return -1;
+	for (i=0;i<tto->num_streams;i++) {
+		ogg_stream_reset(&tto->streams[i]->mState);
+		multi_queue_reset(tto->streams[i]);
+	}
+	if (skip_gp!=-1) {
+		do {
+			if (!next_stream_packet(tto,stream,&packet)) return 0;
+		} while (packet.granulepos!=skip_gp);
+		/* the frames between that page and the keyframe are not
+		 * decoded at all. The decoder is told the frame before the
+		 * keyframe was a keyframe itself, so that it counts on from
+		 * there and gives the keyframe key_gp. */
+		skip_to_keyframe(tto,gp_frame(tto,skip_gp)+1,keyframe);
+		start_gp=key_gp-((ogg_int64_t)1<<shift);
+	}
+	th_decode_ctl(ctx,TH_DECCTL_SET_GRANPOS,&start_gp,sizeof(start_gp));
+	tto->granulepos=start_gp;
+
+	/* decode (without output) up to the frame we want */
+	while (frame>0 && gp_frame(tto,tto->granulepos)<frame-1) {
+		if (decode_next_packet(tto,&gp)!=1) break;
+		tto->granulepos=gp;
+		/* keep them for stepping back (see "frame"), but only from the
+		 * keyframe on: anything before it is decoded from nothing */
+		if (gp_frame(tto,gp)>=keyframe) frame_cache_decoded(tto,gp);
+	}
+	return 0;
+}
@@ -0,0 +1,151 @@
+/*
+ * This file is part of MVTH - the Machine Vision Test Harness.
+ *
+ * Counters and timing histograms for "$t stats", cheap enough to be
+ * left on in the decoding path.
+ *
+ * Copyright (C) 2011 Samuel P. Bromley <sam@sambromley.com>
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License Version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (see the file named "COPYING"), and a copy of the GNU Lesser General
+ * Public License (see the file named "COPYING.LESSER") along with MVTH.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <tcl.h>
+#include <tk.h>
+#include "tcltheora.h"
+
+/* The prefetch worker, the pool threads and the stream threads all add
+ * to the same counters, so every update is a relaxed atomic add: no
+ * locks, and nothing but the counter's own cache line is touched. A
+ * reader may see a sample's count before its time, which does not
+ * matter for statistics. */
+
+/* nanoseconds on the monotonic clock */
+ogg_uint64_t stats_now (void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (ogg_uint64_t)ts.tv_sec*1000000000u+(ogg_uint64_t)ts.tv_nsec;
+}
+
+void stats_add (ogg_uint64_t *counter, ogg_uint64_t n) {
+	__atomic_fetch_add(counter,n,__ATOMIC_RELAXED);
+}
+
+static ogg_uint64_t stats_load (ogg_uint64_t *counter) {
+	return __atomic_load_n(counter,__ATOMIC_RELAXED);
+}
+
+/* one more call of timer, which began at start */
+void stats_time (perfStats *stats, int timer, ogg_uint64_t start) {
+	statsTimer *t=&stats->timers[timer];
+	ogg_uint64_t ns=stats_now()-start;
+	/* bucket by bit length */
+	int b=ns?64-__builtin_clzll(ns):0;
+	if (b>=STATS_BUCKETS) b=STATS_BUCKETS-1;
+	stats_add(&t->calls,1);
+	stats_add(&t->ns,ns);
+	stats_add(&t->hist[b],1);
+}
+
+/* Tk_PhotoPutBlock(), timed */
+void photo_put_block (TclTheoraObject *tto, Tcl_Interp *interp,
+		Tk_PhotoHandle photo, Tk_PhotoImageBlock *block, int x, int y,
+		int width, int height)
+{
+	ogg_uint64_t start=stats_now();
+	Tk_PhotoPutBlock(interp,photo,block,x,y,width,height,TK_PHOTO_COMPOSITE_SET);
+	stats_time(&tto->stats,STATS_UPLOAD,start);
+}
+
+/* Start counting again. The caller stops the worker first, as it
+ * counts the packets without atomics. */
+void stats_reset (TclTheoraObject *tto) {
+	int i;
+	memset(&tto->stats,0,sizeof(perfStats));
+	tto->cache.hits=0;
+	tto->cache.misses=0;
+	for (i=0;i<tto->num_streams;i++) tto->streams[i]->mPacketCount=0;
+}
+
+/* key=value into a dict being built for a command's result */
+void dict_put (Tcl_Obj *dict, const char *key, Tcl_Obj *value) {
+	Tcl_DictObjPut(NULL,dict,Tcl_NewStringObj(key,-1),value);
+}
+
+void dict_put_int (Tcl_Obj *dict, const char *key, int value) {
+	dict_put(dict,key,Tcl_NewIntObj(value));
+}
+
+static Tcl_Obj *counter_obj (ogg_uint64_t *counter) {
+	return Tcl_NewWideIntObj((Tcl_WideInt)stats_load(counter));
+}
+
+static Tcl_Obj *timer_obj (statsTimer *t) {
+	Tcl_Obj *result=Tcl_NewDictObj();
+	Tcl_Obj *hist=Tcl_NewListObj(0,NULL);
+	int i,n;
+	dict_put(result,"calls",counter_obj(&t->calls));
+	dict_put(result,"ns",counter_obj(&t->ns));
+	/* leave off the empty buckets at the slow end */
+	for (n=STATS_BUCKETS;n>0 && stats_load(&t->hist[n-1])==0;n--);
+	for (i=0;i<n;i++) Tcl_ListObjAppendElement(NULL,hist,counter_obj(&t->hist[i]));
+	dict_put(result,"hist",hist);
+	return result;
+}
+
+/* everything, for "$t stats" */
+Tcl_Obj *stats_obj (TclTheoraObject *tto) {
+	static const char *timers[STATS_NTIMERS]={"getNextPage","decodePacketin",
+		"decodeYCbCrOut","convert","photoPutBlock"};
+	perfStats *s=&tto->stats;
+	Tcl_Obj *result=Tcl_NewDictObj();
+	ogg_int64_t stream_bytes=0;
+	int i;
+
+	dict_put(result,"bytesRead",counter_obj(&s->bytes));
+	dict_put(result,"pages",counter_obj(&s->pages));
+	dict_put(result,"framesDecoded",counter_obj(&s->frames));
+	dict_put(result,"framesDropped",counter_obj(&s->dropped));
+	dict_put(result,"duplicateFrames",counter_obj(&s->dups));
+	for (i=0;i<STATS_NTIMERS;i++) dict_put(result,timers[i],timer_obj(&s->timers[i]));
+	/* the stream states belong to the worker while it runs */
+	if (!tto->worker_running) {
+		Tcl_Obj *packets=Tcl_NewDictObj();
+		for (i=0;i<tto->num_streams;i++) {
+			oggStream *stream=tto->streams[i];
+			ogg_stream_state *os=&stream->mState;
+			Tcl_DictObjPut(NULL,packets,Tcl_NewIntObj(stream->mSerial),
+					Tcl_NewIntObj(stream->mPacketCount));
+			stream_bytes+=os->body_storage
+				+os->lacing_storage*(sizeof(*os->lacing_vals)+sizeof(*os->granule_vals));
+		}
+		dict_put(result,"packets",packets);
+		dict_put(result,"syncBytes",Tcl_NewWideIntObj(
+					tto->sync_state!=NULL?tto->sync_state->storage:0));
+		dict_put(result,"streamBytes",Tcl_NewWideIntObj(stream_bytes));
+	}
+	dict_put(result,"cacheFrames",Tcl_NewIntObj(tto->cache.frames.numEntries));
+	dict_put(result,"cacheBytes",Tcl_NewWideIntObj(tto->cache.bytes));
+	dict_put(result,"cacheHits",Tcl_NewWideIntObj(tto->cache.hits));
+	dict_put(result,"cacheMisses",Tcl_NewWideIntObj(tto->cache.misses));
+	return result;
+}
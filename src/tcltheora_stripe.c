@@ -0,0 +1,149 @@
+/*
+ * This file is part of MVTH - the Machine Vision Test Harness.
+ *
+ * Convert frames to RGBA a stripe at a time, from the decoder's stripe
+ * callback, while the freshly decoded rows are still in cache.
+ *
+ * Copyright (C) 2011 Samuel P. Bromley <sam@sambromley.com>
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License Version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (see the file named "COPYING"), and a copy of the GNU Lesser General
+ * Public License (see the file named "COPYING.LESSER") along with MVTH.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tcl.h>
+#include <tk.h>
+#include "tcltheora.h"
+#include "tcltheora_yuv.h"
+
+/* Called by th_decode_packetin() each time a band of superblock rows is
+ * finished (and post-processed). The fragment rows count up from the
+ * bottom of the coded frame; the buffer is the usual top-down view. */
+static void stripe_decoded (void *ctx, th_ycbcr_buffer buffer,
+		int yfrag0, int yfrag_end)
+{
+	TclTheoraObject *tto=(TclTheoraObject *)ctx;
+	stripeTarget *s=&tto->stripe;
+	th_info *info=&tto->streams[0]->mTheora.mInfo;
+	Tk_PhotoImageBlock block;
+	Tcl_Time start;
+	ogg_uint64_t entered=stats_now();
+	int top,bottom;
+
+	if (s->dst==NULL) return;
+	/* the picture rows this stripe covers */
+	top=(int)info->frame_height-8*yfrag_end-(int)info->pic_y;
+	bottom=(int)info->frame_height-8*yfrag0-(int)info->pic_y;
+	if (top<0) top=0;
+	if (bottom>(int)info->pic_height) bottom=info->pic_height;
+	if (top>=bottom) goto done;
+
+	Tcl_GetTime(&start);
+	block=*s->dst;
+	block.pixelPtr+=top*block.pitch;
+	block.height=bottom-top;
+	if (tto->pool.nhelpers>0) {
+		/* the rows are final until the packet is done, so the pool can
+		 * convert them while we carry on decoding */
+		pool_submit(tto,info,buffer,top,bottom-top,&block);
+	} else {
+		ogg_uint64_t convert=stats_now();
+		ycbcr_to_rgb_region(info,buffer,0,top,info->pic_width,bottom-top,&block);
+		stats_time(&tto->stats,STATS_CONVERT,convert);
+	}
+	if (s->photo!=NULL && tto->pool.nhelpers==0) {
+		photo_put_block(tto,s->interp,s->photo,&block,0,top,info->pic_width,
+				bottom-top);
+	}
+	s->rows_done+=bottom-top;
+	s->convert_time+=governor_elapsed(&start);
+done:
+	s->callback_ns+=stats_now()-entered;
+}
+
+/* hook the stripe callback into a freshly allocated decoder context */
+void stripe_init (TclTheoraObject *tto) {
+	th_stripe_callback cb;
+	cb.ctx=tto;
+	cb.stripe_decoded=stripe_decoded;
+	th_decode_ctl(tto->streams[0]->mTheora.mCtx,TH_DECCTL_SET_STRIPE_CB,
+			&cb,sizeof(cb));
+	memset(&tto->stripe,0,sizeof(stripeTarget));
+}
+
+/* Decode the next frame straight into dst (sized for the picture), and
+ * if photo is given, upload it there stripe by stripe as well. photo must
+ * only be given on the interpreter's thread.
+ * Returns 1 if we got a frame, 0 at the end of the file. */
+int decode_next_frame_rgb (TclTheoraObject *tto, Tk_PhotoImageBlock *dst,
+		Tcl_Interp *interp, Tk_PhotoHandle photo, ogg_int64_t *granulepos)
+{
+	stripeTarget *s=&tto->stripe;
+	th_info *info=&tto->streams[0]->mTheora.mInfo;
+	int frames=tto->governor.realtime?tto->governor.drop+1:1;
+	th_ycbcr_buffer buffer;
+	Tcl_Time start;
+	int i,ret;
+
+	Tcl_GetTime(&start);
+	/* frames the governor drops are decoded without converting them */
+	for (i=0;i<frames-1;i++) {
+		if (decode_next_packet(tto,granulepos)!=1) return 0;
+	}
+	s->dst=dst;
+	s->interp=interp;
+	s->photo=photo;
+	s->rows_done=0;
+	s->convert_time=0;
+	ret=decode_next_packet(tto,granulepos);
+	s->dst=NULL;
+	s->photo=NULL;
+	if (tto->pool.nhelpers>0) {
+		Tcl_Time wstart;
+		Tcl_GetTime(&wstart);
+		pool_wait(tto);
+		s->convert_time+=governor_elapsed(&wstart);
+	}
+	if (ret!=1) return 0;
+
+	if (s->rows_done<(int)info->pic_height) {
+		/* a duplicate frame produces no stripes, so do it the long way */
+		Tcl_Time cstart;
+		ogg_uint64_t out;
+		Tcl_GetTime(&cstart);
+		out=stats_now();
+		th_decode_ycbcr_out(tto->streams[0]->mTheora.mCtx,buffer);
+		stats_time(&tto->stats,STATS_YCBCR_OUT,out);
+		pool_convert(tto,info,buffer,dst);
+		if (photo!=NULL) {
+			photo_put_block(tto,interp,photo,dst,0,0,info->pic_width,info->pic_height);
+		}
+		s->convert_time+=governor_elapsed(&cstart);
+	} else if (photo!=NULL && tto->pool.nhelpers>0) {
+		/* the stripes went to the pool, so upload them all at once */
+		Tcl_Time ustart;
+		Tcl_GetTime(&ustart);
+		photo_put_block(tto,interp,photo,dst,0,0,info->pic_width,info->pic_height);
+		s->convert_time+=governor_elapsed(&ustart);
+	}
+	governor_decoded(tto,governor_elapsed(&start)-s->convert_time,frames);
+	governor_converted(tto,s->convert_time);
+	return 1;
+}
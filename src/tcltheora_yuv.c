@@ -0,0 +1,475 @@
+/*
+ * This file is part of MVTH - the Machine Vision Test Harness.
+ *
+ * Y'CbCr to RGBA conversion for decoded Theora frames.
+ *
+ * Copyright (C) 2011 Samuel P. Bromley <sam@sambromley.com>
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License Version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (see the file named "COPYING"), and a copy of the GNU Lesser General
+ * Public License (see the file named "COPYING.LESSER") along with MVTH.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tcl.h>
+#include "tcltheora_yuv.h"
+
+#if (defined(__GNUC__) || defined(__clang__)) && \
+	(defined(__x86_64__) || defined(__i386__))
+#  define TCLTHEORA_X86_SIMD 1
+#  include <immintrin.h>
+#endif
+
+/* The conversion is the same as the one we always used:
+ *   R = 255/219*(Y-16) + 255*0.701/112*(Cr-128)
+ *   G = 255/219*(Y-16) - 255*0.886*0.114/(112*0.587)*(Cb-128)
+ *                      - 255*0.701*0.299/(112*0.587)*(Cr-128)
+ *   B = 255/219*(Y-16) + 255*0.866/112*(Cb-128)
+ * but done in fixed point so that it maps straight onto 16 bit SIMD lanes.
+ * Inputs are offset and scaled by 2^7, multiplied by Q14 coefficients
+ * keeping the high 16 bits of the product (ie. _mm_mulhi_epi16()), which
+ * leaves the sums in Q5. Like before, results are truncated. The scalar
+ * code below does exactly the same arithmetic, so every kernel produces bit
+ * identical output, which is within one LSB of the old floating point
+ * version. */
+enum {
+	YUV_CY=19077,  /* 255/219 */
+	YUV_CRR=26149, /* Cr contribution to R */
+	YUV_CBG=6419,  /* Cb contribution to G */
+	YUV_CRG=13320, /* Cr contribution to G */
+	YUV_CBB=32304, /* Cb contribution to B */
+	YUV_SHIFT=5
+};
+
+static inline int yuv_mulhi (int a, int c) {
+	return (a*c)>>16;
+}
+
+static inline unsigned char yuv_clamp (int v) {
+	if (v<0) return 0;
+	if (v>255) return 255;
+	return (unsigned char)v;
+}
+
+static inline void yuv_pixel (int y, int cb, int cr, unsigned char *rgba) {
+	int yy=yuv_mulhi((y-16)<<7,YUV_CY);
+	int u=(cb-128)<<7;
+	int v=(cr-128)<<7;
+	rgba[0]=yuv_clamp((yy+yuv_mulhi(v,YUV_CRR))>>YUV_SHIFT);
+	rgba[1]=yuv_clamp((yy-yuv_mulhi(u,YUV_CBG)-yuv_mulhi(v,YUV_CRG))>>YUV_SHIFT);
+	rgba[2]=yuv_clamp((yy+yuv_mulhi(u,YUV_CBB))>>YUV_SHIFT);
+	rgba[3]=255;
+}
+
+static void yuv_row444_c (const unsigned char *y, const unsigned char *cb,
+		const unsigned char *cr, unsigned char *rgba, int width)
+{
+	int i;
+	for (i=0;i<width;i++) {
+		yuv_pixel(y[i],cb[i],cr[i],rgba+4*i);
+	}
+}
+
+static void yuv_row42x_c (const unsigned char *y, const unsigned char *cb,
+		const unsigned char *cr, unsigned char *rgba, int width)
+{
+	int i;
+	for (i=0;i<width;i++) {
+		yuv_pixel(y[i],cb[i>>1],cr[i>>1],rgba+4*i);
+	}
+}
+
+#ifdef TCLTHEORA_X86_SIMD
+/* Convert 8 pixels held as 16 bit values, returning 16 bit R,G,B */
+__attribute__((target("sse2")))
+static inline void yuv8_sse2 (__m128i y, __m128i u, __m128i v,
+		__m128i *r, __m128i *g, __m128i *b)
+{
+	__m128i yy;
+	y=_mm_slli_epi16(_mm_sub_epi16(y,_mm_set1_epi16(16)),7);
+	u=_mm_slli_epi16(_mm_sub_epi16(u,_mm_set1_epi16(128)),7);
+	v=_mm_slli_epi16(_mm_sub_epi16(v,_mm_set1_epi16(128)),7);
+	yy=_mm_mulhi_epi16(y,_mm_set1_epi16(YUV_CY));
+	*r=_mm_add_epi16(yy,_mm_mulhi_epi16(v,_mm_set1_epi16(YUV_CRR)));
+	*g=_mm_sub_epi16(_mm_sub_epi16(yy,_mm_mulhi_epi16(u,_mm_set1_epi16(YUV_CBG))),
+			_mm_mulhi_epi16(v,_mm_set1_epi16(YUV_CRG)));
+	*b=_mm_add_epi16(yy,_mm_mulhi_epi16(u,_mm_set1_epi16(YUV_CBB)));
+	*r=_mm_srai_epi16(*r,YUV_SHIFT);
+	*g=_mm_srai_epi16(*g,YUV_SHIFT);
+	*b=_mm_srai_epi16(*b,YUV_SHIFT);
+}
+
+/* Convert 16 pixels given 16 bytes each of Y, Cb and Cr */
+__attribute__((target("sse2")))
+static inline void yuv16_sse2 (__m128i y8, __m128i u8, __m128i v8,
+		unsigned char *rgba)
+{
+	__m128i zero=_mm_setzero_si128();
+	__m128i r0,g0,b0,r1,g1,b1,r,g,b,rg,ba;
+	yuv8_sse2(_mm_unpacklo_epi8(y8,zero),_mm_unpacklo_epi8(u8,zero),
+			_mm_unpacklo_epi8(v8,zero),&r0,&g0,&b0);
+	yuv8_sse2(_mm_unpackhi_epi8(y8,zero),_mm_unpackhi_epi8(u8,zero),
+			_mm_unpackhi_epi8(v8,zero),&r1,&g1,&b1);
+	r=_mm_packus_epi16(r0,r1);
+	g=_mm_packus_epi16(g0,g1);
+	b=_mm_packus_epi16(b0,b1);
+	rg=_mm_unpacklo_epi8(r,g);
+	ba=_mm_unpacklo_epi8(b,_mm_set1_epi8(-1));
+	_mm_storeu_si128((__m128i*)(rgba),_mm_unpacklo_epi16(rg,ba));
+	_mm_storeu_si128((__m128i*)(rgba+16),_mm_unpackhi_epi16(rg,ba));
+	rg=_mm_unpackhi_epi8(r,g);
+	ba=_mm_unpackhi_epi8(b,_mm_set1_epi8(-1));
+	_mm_storeu_si128((__m128i*)(rgba+32),_mm_unpacklo_epi16(rg,ba));
+	_mm_storeu_si128((__m128i*)(rgba+48),_mm_unpackhi_epi16(rg,ba));
+}
+
+__attribute__((target("sse2")))
+static void yuv_row444_sse2 (const unsigned char *y, const unsigned char *cb,
+		const unsigned char *cr, unsigned char *rgba, int width)
+{
+	int i;
+	for (i=0;i+16<=width;i+=16) {
+		yuv16_sse2(_mm_loadu_si128((const __m128i*)(y+i)),
+				_mm_loadu_si128((const __m128i*)(cb+i)),
+				_mm_loadu_si128((const __m128i*)(cr+i)),rgba+4*i);
+	}
+	yuv_row444_c(y+i,cb+i,cr+i,rgba+4*i,width-i);
+}
+
+__attribute__((target("sse2")))
+static void yuv_row42x_sse2 (const unsigned char *y, const unsigned char *cb,
+		const unsigned char *cr, unsigned char *rgba, int width)
+{
+	int i;
+	for (i=0;i+16<=width;i+=16) {
+		__m128i u=_mm_loadl_epi64((const __m128i*)(cb+(i>>1)));
+		__m128i v=_mm_loadl_epi64((const __m128i*)(cr+(i>>1)));
+		yuv16_sse2(_mm_loadu_si128((const __m128i*)(y+i)),
+				_mm_unpacklo_epi8(u,u),_mm_unpacklo_epi8(v,v),rgba+4*i);
+	}
+	yuv_row42x_c(y+i,cb+(i>>1),cr+(i>>1),rgba+4*i,width-i);
+}
+
+/* Convert 16 pixels held as 16 bit values, returning 16 bit R,G,B */
+__attribute__((target("avx2")))
+static inline void yuv16_avx2 (__m256i y, __m256i u, __m256i v,
+		__m256i *r, __m256i *g, __m256i *b)
+{
+	__m256i yy;
+	y=_mm256_slli_epi16(_mm256_sub_epi16(y,_mm256_set1_epi16(16)),7);
+	u=_mm256_slli_epi16(_mm256_sub_epi16(u,_mm256_set1_epi16(128)),7);
+	v=_mm256_slli_epi16(_mm256_sub_epi16(v,_mm256_set1_epi16(128)),7);
+	yy=_mm256_mulhi_epi16(y,_mm256_set1_epi16(YUV_CY));
+	*r=_mm256_add_epi16(yy,_mm256_mulhi_epi16(v,_mm256_set1_epi16(YUV_CRR)));
+	*g=_mm256_sub_epi16(
+			_mm256_sub_epi16(yy,_mm256_mulhi_epi16(u,_mm256_set1_epi16(YUV_CBG))),
+			_mm256_mulhi_epi16(v,_mm256_set1_epi16(YUV_CRG)));
+	*b=_mm256_add_epi16(yy,_mm256_mulhi_epi16(u,_mm256_set1_epi16(YUV_CBB)));
+	*r=_mm256_srai_epi16(*r,YUV_SHIFT);
+	*g=_mm256_srai_epi16(*g,YUV_SHIFT);
+	*b=_mm256_srai_epi16(*b,YUV_SHIFT);
+}
+
+/* Convert 32 pixels given as two 16 byte halves each of Y, Cb and Cr */
+__attribute__((target("avx2")))
+static inline void yuv32_avx2 (__m128i y0, __m128i y1, __m128i u0, __m128i u1,
+		__m128i v0, __m128i v1, unsigned char *rgba)
+{
+	__m256i r0,g0,b0,r1,g1,b1,r,g,b,a,rg,ba,q0,q1,q2,q3;
+	yuv16_avx2(_mm256_cvtepu8_epi16(y0),_mm256_cvtepu8_epi16(u0),
+			_mm256_cvtepu8_epi16(v0),&r0,&g0,&b0);
+	yuv16_avx2(_mm256_cvtepu8_epi16(y1),_mm256_cvtepu8_epi16(u1),
+			_mm256_cvtepu8_epi16(v1),&r1,&g1,&b1);
+	/* packus works within 128 bit lanes, so put the bytes back in order */
+	r=_mm256_permute4x64_epi64(_mm256_packus_epi16(r0,r1),0xD8);
+	g=_mm256_permute4x64_epi64(_mm256_packus_epi16(g0,g1),0xD8);
+	b=_mm256_permute4x64_epi64(_mm256_packus_epi16(b0,b1),0xD8);
+	a=_mm256_set1_epi8(-1);
+	rg=_mm256_unpacklo_epi8(r,g);
+	ba=_mm256_unpacklo_epi8(b,a);
+	q0=_mm256_unpacklo_epi16(rg,ba); /* pixels 0-3 and 16-19 */
+	q1=_mm256_unpackhi_epi16(rg,ba); /* pixels 4-7 and 20-23 */
+	rg=_mm256_unpackhi_epi8(r,g);
+	ba=_mm256_unpackhi_epi8(b,a);
+	q2=_mm256_unpacklo_epi16(rg,ba); /* pixels 8-11 and 24-27 */
+	q3=_mm256_unpackhi_epi16(rg,ba); /* pixels 12-15 and 28-31 */
+	_mm256_storeu_si256((__m256i*)(rgba),_mm256_permute2x128_si256(q0,q1,0x20));
+	_mm256_storeu_si256((__m256i*)(rgba+32),_mm256_permute2x128_si256(q2,q3,0x20));
+	_mm256_storeu_si256((__m256i*)(rgba+64),_mm256_permute2x128_si256(q0,q1,0x31));
+	_mm256_storeu_si256((__m256i*)(rgba+96),_mm256_permute2x128_si256(q2,q3,0x31));
+}
+
+__attribute__((target("avx2")))
+static void yuv_row444_avx2 (const unsigned char *y, const unsigned char *cb,
+		const unsigned char *cr, unsigned char *rgba, int width)
+{
+	int i;
+	for (i=0;i+32<=width;i+=32) {
+		yuv32_avx2(_mm_loadu_si128((const __m128i*)(y+i)),
+				_mm_loadu_si128((const __m128i*)(y+i+16)),
+				_mm_loadu_si128((const __m128i*)(cb+i)),
+				_mm_loadu_si128((const __m128i*)(cb+i+16)),
+				_mm_loadu_si128((const __m128i*)(cr+i)),
+				_mm_loadu_si128((const __m128i*)(cr+i+16)),rgba+4*i);
+	}
+	yuv_row444_sse2(y+i,cb+i,cr+i,rgba+4*i,width-i);
+}
+
+__attribute__((target("avx2")))
+static void yuv_row42x_avx2 (const unsigned char *y, const unsigned char *cb,
+		const unsigned char *cr, unsigned char *rgba, int width)
+{
+	int i;
+	for (i=0;i+32<=width;i+=32) {
+		__m128i u=_mm_loadu_si128((const __m128i*)(cb+(i>>1)));
+		__m128i v=_mm_loadu_si128((const __m128i*)(cr+(i>>1)));
+		yuv32_avx2(_mm_loadu_si128((const __m128i*)(y+i)),
+				_mm_loadu_si128((const __m128i*)(y+i+16)),
+				_mm_unpacklo_epi8(u,u),_mm_unpackhi_epi8(u,u),
+				_mm_unpacklo_epi8(v,v),_mm_unpackhi_epi8(v,v),rgba+4*i);
+	}
+	yuv_row42x_sse2(y+i,cb+(i>>1),cr+(i>>1),rgba+4*i,width-i);
+}
+#endif
+
+/* The kernels to use, picked for this CPU the first time any thread
+ * converts a frame. yuv_row444 is stored last, with release semantics,
+ * so whoever sees it set also sees the other two. Threads racing to
+ * pick them store the same values. */
+static yuv_row_func yuv_row444=NULL;
+static yuv_row_func yuv_row42x=NULL;
+static const char *yuv_kernel="c";
+
+static void yuv_select_kernels (void) {
+	yuv_row_func row444=yuv_row444_c;
+	yuv_row_func row42x=yuv_row42x_c;
+	const char *name="c";
+#ifdef TCLTHEORA_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		row444=yuv_row444_avx2;
+		row42x=yuv_row42x_avx2;
+		name="avx2";
+	} else if (__builtin_cpu_supports("sse2")) {
+		row444=yuv_row444_sse2;
+		row42x=yuv_row42x_sse2;
+		name="sse2";
+	}
+#endif
+	__atomic_store_n(&yuv_kernel,name,__ATOMIC_RELAXED);
+	__atomic_store_n(&yuv_row42x,row42x,__ATOMIC_RELAXED);
+	__atomic_store_n(&yuv_row444,row444,__ATOMIC_RELEASE);
+}
+
+/* the 4:4:4 kernel, picking the kernels first if need be */
+static yuv_row_func yuv_kernels (void) {
+	yuv_row_func row444=__atomic_load_n(&yuv_row444,__ATOMIC_ACQUIRE);
+	if (row444==NULL) {
+		yuv_select_kernels();
+		row444=__atomic_load_n(&yuv_row444,__ATOMIC_ACQUIRE);
+	}
+	return row444;
+}
+
+const char *ycbcr_kernel_name (void) {
+	yuv_kernels();
+	return __atomic_load_n(&yuv_kernel,__ATOMIC_RELAXED);
+}
+
+/* how far the chroma planes are subsampled. Returns -1 for formats we
+ * do not handle. */
+static int yuv_chroma_shift (th_info *info, int *hshift, int *vshift) {
+	switch (info->pixel_fmt) {
+		case TH_PF_420:
+			*hshift=1;
+			*vshift=1;
+			return 0;
+		case TH_PF_422:
+			*hshift=1;
+			*vshift=0;
+			return 0;
+		case TH_PF_444:
+			*hshift=0;
+			*vshift=0;
+			return 0;
+		default:
+			return -1;
+	}
+}
+
+/* the kernels write packed RGBA, anything else has to be scattered */
+static int yuv_packed (Tk_PhotoImageBlock *dst) {
+	return dst->pixelSize==4 && dst->offset[0]==0 && dst->offset[1]==1
+		&& dst->offset[2]==2 && dst->offset[3]==3;
+}
+
+static void yuv_scatter (const unsigned char *rgba, int w, unsigned char *p,
+		Tk_PhotoImageBlock *dst)
+{
+	int i;
+	for (i=0;i<w;i++,p+=dst->pixelSize) {
+		p[dst->offset[0]]=rgba[4*i];
+		p[dst->offset[1]]=rgba[4*i+1];
+		p[dst->offset[2]]=rgba[4*i+2];
+		p[dst->offset[3]]=rgba[4*i+3];
+	}
+}
+
+int ycbcr_to_rgb_region(th_info *info, th_ycbcr_buffer buffer,
+		int x, int y, int w, int h, Tk_PhotoImageBlock *dst)
+{
+	int hshift,vshift;
+	int j;
+	int fx=(int)info->pic_x+x;
+	yuv_row_func row;
+	unsigned char *tmp=NULL;
+	int packed;
+
+	row=yuv_kernels();
+	/* pick the chroma layout once for the whole frame */
+	if (yuv_chroma_shift(info,&hshift,&vshift)!=0) return -1;
+	if (hshift) row=__atomic_load_n(&yuv_row42x,__ATOMIC_RELAXED);
+	if (w<=0 || h<=0) return 0;
+
+	/* the kernels write packed RGBA. Anything else goes through a
+	 * temporary row and gets scattered into place. */
+	packed=yuv_packed(dst);
+	if (!packed) tmp=(unsigned char*)ckalloc(4*w);
+
+	for (j=0;j<h;j++) {
+		int fy=(int)info->pic_y+y+j;
+		const unsigned char *py=buffer[0].data+fy*buffer[0].stride+fx;
+		const unsigned char *pcb=buffer[1].data+(fy>>vshift)*buffer[1].stride+(fx>>hshift);
+		const unsigned char *pcr=buffer[2].data+(fy>>vshift)*buffer[2].stride+(fx>>hshift);
+		unsigned char *out=packed?dst->pixelPtr+j*dst->pitch:tmp;
+		int n=w;
+		if (hshift && (fx&1)) {
+			/* starting on the right half of a chroma pair */
+			yuv_pixel(*py++,*pcb++,*pcr++,out);
+			out+=4;
+			n--;
+		}
+		row(py,pcb,pcr,out,n);
+		if (!packed) yuv_scatter(tmp,w,dst->pixelPtr+j*dst->pitch,dst);
+	}
+	if (tmp!=NULL) ckfree((char*)tmp);
+	return 0;
+}
+
+/* average of the (1<<xs) by (1<<ys) samples of plane p starting at (x,y) */
+static inline unsigned char yuv_box (const th_img_plane *p, int x, int y,
+		int xs, int ys)
+{
+	const unsigned char *row=p->data+y*p->stride+x;
+	int n=1<<xs;
+	int m=1<<ys;
+	int sum=0;
+	int i,j;
+	for (j=0;j<m;j++,row+=p->stride) {
+		for (i=0;i<n;i++) sum+=row[i];
+	}
+	return (unsigned char)((sum+((n*m)>>1))>>(xs+ys));
+}
+
+int ycbcr_to_rgb_scaled(th_info *info, th_ycbcr_buffer buffer,
+		int x, int y, int w, int h, int shift, int box, Tk_PhotoImageBlock *dst)
+{
+	int hshift,vshift;
+	int ow=w>>shift;
+	int oh=h>>shift;
+	/* how many chroma samples each output pixel covers, as shifts */
+	int cxs,cys;
+	unsigned char *ty,*tcb,*tcr,*tmp;
+	int i,j;
+	int packed;
+	yuv_row_func row;
+
+	if (shift==0) return ycbcr_to_rgb_region(info,buffer,x,y,w,h,dst);
+	row=yuv_kernels();
+	if (yuv_chroma_shift(info,&hshift,&vshift)!=0) return -1;
+	if (ow<=0 || oh<=0) return 0;
+	cxs=shift>hshift?shift-hshift:0;
+	cys=shift>vshift?shift-vshift:0;
+
+	/* gather a row of samples at the output resolution, then convert
+	 * it with the full resolution 4:4:4 kernel */
+	packed=yuv_packed(dst);
+	ty=(unsigned char*)ckalloc(3*ow+(packed?0:4*ow));
+	tcb=ty+ow;
+	tcr=tcb+ow;
+	tmp=tcr+ow;
+	for (j=0;j<oh;j++) {
+		int fy=(int)info->pic_y+y+(j<<shift);
+		int cy=fy>>vshift;
+		const unsigned char *py=buffer[0].data+fy*buffer[0].stride;
+		const unsigned char *pcb=buffer[1].data+cy*buffer[1].stride;
+		const unsigned char *pcr=buffer[2].data+cy*buffer[2].stride;
+		int fx=(int)info->pic_x+x;
+		if (box) {
+			for (i=0;i<ow;i++,fx+=1<<shift) {
+				ty[i]=yuv_box(&buffer[0],fx,fy,shift,shift);
+				tcb[i]=yuv_box(&buffer[1],fx>>hshift,cy,cxs,cys);
+				tcr[i]=yuv_box(&buffer[2],fx>>hshift,cy,cxs,cys);
+			}
+		} else {
+			for (i=0;i<ow;i++,fx+=1<<shift) {
+				ty[i]=py[fx];
+				tcb[i]=pcb[fx>>hshift];
+				tcr[i]=pcr[fx>>hshift];
+			}
+		}
+		if (packed) {
+			row(ty,tcb,tcr,dst->pixelPtr+j*dst->pitch,ow);
+		} else {
+			row(ty,tcb,tcr,tmp,ow);
+			yuv_scatter(tmp,ow,dst->pixelPtr+j*dst->pitch,dst);
+		}
+	}
+	ckfree((char*)ty);
+	return 0;
+}
+
+int ycbcr_to_rgb(th_info *info, th_ycbcr_buffer buffer, Tk_PhotoImageBlock *dst)
+{
+	return ycbcr_to_rgb_region(info,buffer,0,0,
+			(int)info->pic_width,(int)info->pic_height,dst);
+}
+
+int ycbcr_to_gray(th_info *info, th_ycbcr_buffer buffer,
+		int x, int y, int w, int h, int shift, int box,
+		unsigned char *dst, int pitch)
+{
+	int ow=w>>shift;
+	int oh=h>>shift;
+	int fx=(int)info->pic_x+x;
+	int i,j;
+	for (j=0;j<oh;j++) {
+		int fy=(int)info->pic_y+y+(j<<shift);
+		const unsigned char *py=buffer[0].data+fy*buffer[0].stride+fx;
+		unsigned char *out=dst+j*pitch;
+		if (shift==0) {
+			memcpy(out,py,ow);
+		} else if (box) {
+			for (i=0;i<ow;i++) out[i]=yuv_box(&buffer[0],fx+(i<<shift),fy,shift,shift);
+		} else {
+			for (i=0;i<ow;i++) out[i]=py[i<<shift];
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,64 @@
+/*
+ * This file is part of MVTH - the Machine Vision Test Harness.
+ *
+ * Y'CbCr to RGBA conversion for decoded Theora frames.
+ *
+ * Copyright (C) 2011 Samuel P. Bromley <sam@sambromley.com>
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License Version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (see the file named "COPYING"), and a copy of the GNU Lesser General
+ * Public License (see the file named "COPYING.LESSER") along with MVTH.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef TCLTHEORA_YUV_H
+#define TCLTHEORA_YUV_H
+
+#include <tk.h>
+#include <theora/theoradec.h>
+
+/* Convert one row of pixels to packed RGBA (R,G,B,A byte order).
+ * cb and cr point at the chroma sample for the first output pixel.
+ * For subsampled formats every chroma sample covers two pixels, and
+ * the first pixel is assumed to be the left one of such a pair. */
+typedef void (*yuv_row_func)(const unsigned char *y, const unsigned char *cb,
+		const unsigned char *cr, unsigned char *rgba, int width);
+
+/* Convert the rectangle (x,y,w,h), given in picture coordinates (ie. relative
+ * to pic_x,pic_y), of a decoded frame into dst. Pixel (x,y) of the picture
+ * lands at pixel (0,0) of dst. Returns 0 on success, -1 if the pixel format
+ * is not supported. */
+int ycbcr_to_rgb_region(th_info *info, th_ycbcr_buffer buffer,
+		int x, int y, int w, int h, Tk_PhotoImageBlock *dst);
+
+/* Like ycbcr_to_rgb_region(), but scaled down by 2^shift: dst gets
+ * (w>>shift) by (h>>shift) pixels. Chroma is read at its own resolution.
+ * Each output pixel takes the samples at its top left corner, or with
+ * box set, the average of all the samples it covers. */
+int ycbcr_to_rgb_scaled(th_info *info, th_ycbcr_buffer buffer,
+		int x, int y, int w, int h, int shift, int box, Tk_PhotoImageBlock *dst);
+
+/* Copy just the Y' plane of the same area, scaled the same way, into
+ * dst as one byte per pixel, pitch bytes per row. The values are the
+ * decoder's own (16-235 for video range), so at full size this is a
+ * memcpy per row. */
+int ycbcr_to_gray(th_info *info, th_ycbcr_buffer buffer,
+		int x, int y, int w, int h, int shift, int box,
+		unsigned char *dst, int pitch);
+
+/* Convert the whole picture area of a decoded frame into dst. */
+int ycbcr_to_rgb(th_info *info, th_ycbcr_buffer buffer, Tk_PhotoImageBlock *dst);
+
+/* Name of the row kernel selected for this CPU ("avx2", "sse2", or "c") */
+const char *ycbcr_kernel_name(void);
+
+#endif
@@ -0,0 +1,199 @@
+/*
+ * This file is part of MVTH - the Machine Vision Test Harness.
+ *
+ * Time the conversion of a synthetic frame to RGBA with 1, 2, ... threads
+ * in the conversion pool, and check that every thread count gives the
+ * same pixels. First every Y'CbCr triple is converted once and checked
+ * against the floating point conversion, which it may miss by one.
+ *
+ *   convert_bench ?width height? ?max_threads? ?frames?
+ *
+ * Copyright (C) 2011 Samuel P. Bromley <sam@sambromley.com>
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License Version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (see the file named "COPYING"), and a copy of the GNU Lesser General
+ * Public License (see the file named "COPYING.LESSER") along with MVTH.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <tcl.h>
+#include "tcltheora.h"
+#include "tcltheora_yuv.h"
+
+static unsigned char *make_plane (th_img_plane *plane, int width, int height) {
+	int i;
+	plane->width=width;
+	plane->height=height;
+	plane->stride=width+32; /* like the decoder's borders */
+	plane->data=(unsigned char*)malloc(plane->stride*height);
+	for (i=0;i<plane->stride*height;i++) plane->data[i]=rand()&0xff;
+	return plane->data;
+}
+
+/* the floating point conversion the kernels replaced */
+static unsigned char float_clamp (double v) {
+	if (v<0) v=0;
+	if (v>255) v=255;
+	return (unsigned char)v;
+}
+
+static void float_pixel (int y, int cb, int cr, unsigned char *rgb) {
+	rgb[0]=float_clamp(255.0*(y-16)/219 + 255*0.701*(cr-128)/112);
+	rgb[1]=float_clamp(255.0*(y-16)/219 - 255*0.886*0.114*(cb-128)/(112*0.587)
+			- 255*0.701*0.299*(cr-128)/(112*0.587));
+	rgb[2]=float_clamp(255.0*(y-16)/219+255.0*0.866*(cb-128)/112);
+}
+
+/* Convert all 2^24 Y'CbCr triples, as a 4:4:4 frame with Cb along the
+ * rows and Cr down the columns for each Y', and compare each channel
+ * with float_pixel(). Returns the number more than one LSB off. */
+static long check_exhaustive (void) {
+	th_info info;
+	th_ycbcr_buffer buffer;
+	Tk_PhotoImageBlock dst;
+	long bad=0;
+	int worst=0;
+	int y,cb,cr,c,p;
+
+	memset(&info,0,sizeof(info));
+	info.frame_width=info.pic_width=256;
+	info.frame_height=info.pic_height=256;
+	info.pixel_fmt=TH_PF_444;
+	for (p=0;p<3;p++) {
+		buffer[p].width=256;
+		buffer[p].height=256;
+		buffer[p].stride=256;
+		buffer[p].data=(unsigned char*)malloc(256*256);
+	}
+	for (cr=0;cr<256;cr++) {
+		for (cb=0;cb<256;cb++) {
+			buffer[1].data[cr*256+cb]=(unsigned char)cb;
+			buffer[2].data[cr*256+cb]=(unsigned char)cr;
+		}
+	}
+	dst.width=256;
+	dst.height=256;
+	dst.pitch=4*256;
+	dst.pixelSize=4;
+	dst.offset[0]=0;
+	dst.offset[1]=1;
+	dst.offset[2]=2;
+	dst.offset[3]=3;
+	dst.pixelPtr=(unsigned char*)malloc(dst.pitch*dst.height);
+
+	for (y=0;y<256;y++) {
+		memset(buffer[0].data,y,256*256);
+		ycbcr_to_rgb(&info,buffer,&dst);
+		for (cr=0;cr<256;cr++) {
+			for (cb=0;cb<256;cb++) {
+				unsigned char *out=dst.pixelPtr+cr*dst.pitch+4*cb;
+				unsigned char rgb[3];
+				float_pixel(y,cb,cr,rgb);
+				for (c=0;c<3;c++) {
+					int d=abs(out[c]-rgb[c]);
+					if (d>worst) worst=d;
+					if (d>1) {
+						if (bad<10) {
+							fprintf(stderr,"Y'CbCr %d,%d,%d: channel %d is %d, not %d\n",
+									y,cb,cr,c,out[c],rgb[c]);
+						}
+						bad++;
+					}
+				}
+			}
+		}
+	}
+	fprintf(stdout,"all Y'CbCr triples: at most %d off the floating point, %ld more than 1\n",
+			worst,bad);
+	for (p=0;p<3;p++) free(buffer[p].data);
+	free(dst.pixelPtr);
+	return bad;
+}
+
+int main (int argc, char *argv[]) {
+	int width=1920,height=1080;
+	int max_threads=(int)sysconf(_SC_NPROCESSORS_ONLN);
+	int frames=50;
+	TclTheoraObject tto;
+	th_info info;
+	th_ycbcr_buffer buffer;
+	Tk_PhotoImageBlock dst;
+	unsigned char *reference;
+	double base=0;
+	int failed=0;
+	int n,f;
+
+	if (argc>=3) {
+		width=atoi(argv[1]);
+		height=atoi(argv[2]);
+	}
+	if (argc>=4) max_threads=atoi(argv[3]);
+	if (argc>=5) frames=atoi(argv[4]);
+	if (width<2 || height<2 || frames<1) {
+		fprintf(stderr,"Usage: %s ?width height? ?max_threads? ?frames?\n",argv[0]);
+		return 1;
+	}
+	if (max_threads<1) max_threads=1;
+	Tcl_FindExecutable(argv[0]);
+	if (check_exhaustive()!=0) failed=1;
+
+	memset(&info,0,sizeof(info));
+	info.frame_width=info.pic_width=width&~1;
+	info.frame_height=info.pic_height=height&~1;
+	info.pixel_fmt=TH_PF_420;
+	make_plane(&buffer[0],info.frame_width,info.frame_height);
+	make_plane(&buffer[1],info.frame_width/2,info.frame_height/2);
+	make_plane(&buffer[2],info.frame_width/2,info.frame_height/2);
+
+	dst.width=info.pic_width;
+	dst.height=info.pic_height;
+	dst.pitch=4*dst.width;
+	dst.pixelSize=4;
+	dst.offset[0]=0;
+	dst.offset[1]=1;
+	dst.offset[2]=2;
+	dst.offset[3]=3;
+	dst.pixelPtr=(unsigned char*)malloc(dst.pitch*dst.height);
+	reference=(unsigned char*)malloc(dst.pitch*dst.height);
+
+	memset(&tto,0,sizeof(tto));
+	fprintf(stdout,"%dx%d 4:2:0, %s kernel, %d frames\n",dst.width,dst.height,
+			ycbcr_kernel_name(),frames);
+	for (n=1;n<=max_threads;n++) {
+		Tcl_Time t0,t1;
+		double ms;
+		int same;
+		if (pool_start(&tto,n)!=TCL_OK) {
+			fprintf(stderr,"Could not start %d threads\n",n);
+			return 1;
+		}
+		memset(dst.pixelPtr,0,dst.pitch*dst.height);
+		Tcl_GetTime(&t0);
+		for (f=0;f<frames;f++) pool_convert(&tto,&info,buffer,&dst);
+		Tcl_GetTime(&t1);
+		ms=((t1.sec-t0.sec)*1e3+(t1.usec-t0.usec)*1e-3)/frames;
+		if (n==1) {
+			base=ms;
+			memcpy(reference,dst.pixelPtr,dst.pitch*dst.height);
+		}
+		same=memcmp(reference,dst.pixelPtr,dst.pitch*dst.height)==0;
+		if (!same) failed=1;
+		fprintf(stdout,"%2d threads: %7.3f ms/frame, %5.2fx%s\n",n,ms,base/ms,
+				same?"":", OUTPUT DIFFERS");
+	}
+	pool_stop(&tto);
+	return failed;
+}
@@ -0,0 +1,120 @@
+/*
+ * This file is part of MVTH - the Machine Vision Test Harness.
+ *
+ * Time how fast the Ogg pages (and packets) of a file can be pulled out
+ * through the stdio reader and through the memory mapped one.
+ *
+ *   demux_bench file.ogv [repeats]
+ *
+ * Run it twice and take the second numbers if you want to leave disk
+ * speed out of it.
+ *
+ * Copyright (C) 2011 Samuel P. Bromley <sam@sambromley.com>
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License Version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (see the file named "COPYING"), and a copy of the GNU Lesser General
+ * Public License (see the file named "COPYING.LESSER") along with MVTH.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <ogg/ogg.h>
+#include "tcltheora.h"
+
+enum {MAX_SERIALS=16};
+
+static double now (void) {
+	struct timeval tv;
+	gettimeofday(&tv,NULL);
+	return tv.tv_sec+tv.tv_usec*1e-6;
+}
+
+/* read every page and split it into packets. Returns bytes read, or -1. */
+static ogg_int64_t demux (const char *filename, int allow_mmap, long *npackets) {
+	TclTheoraObject tto;
+	ogg_sync_state sync;
+	ogg_page page;
+	ogg_packet packet;
+	ogg_stream_state streams[MAX_SERIALS];
+	int serials[MAX_SERIALS];
+	int nstreams=0;
+	int i;
+
+	memset(&tto,0,sizeof(tto));
+	tto.fp=fopen(filename,"rb");
+	if (tto.fp==NULL) return -1;
+	ogg_sync_init(&sync);
+	tto.sync_state=&sync;
+	tto.page=&page;
+	input_open(&tto,allow_mmap);
+
+	*npackets=0;
+	while (input_next_page(&tto)==0) {
+		int serial=ogg_page_serialno(&page);
+		for (i=0;i<nstreams;i++) {
+			if (serials[i]==serial) break;
+		}
+		if (i==nstreams) {
+			if (nstreams==MAX_SERIALS) continue;
+			ogg_stream_init(&streams[i],serial);
+			serials[i]=serial;
+			nstreams++;
+		}
+		ogg_stream_pagein(&streams[i],&page);
+		while (ogg_stream_packetout(&streams[i],&packet)!=0) (*npackets)++;
+	}
+
+	for (i=0;i<nstreams;i++) ogg_stream_clear(&streams[i]);
+	input_close(&tto);
+	ogg_sync_clear(&sync);
+	fclose(tto.fp);
+	return tto.sync_offset;
+}
+
+int main (int argc, char *argv[]) {
+	const char *names[2]={"stdio","mmap"};
+	int repeats=3;
+	int mode,r;
+
+	if (argc<2) {
+		fprintf(stderr,"Usage: %s file.ogv [repeats]\n",argv[0]);
+		return 1;
+	}
+	if (argc>2) repeats=atoi(argv[2]);
+	if (repeats<1) repeats=1;
+
+	for (mode=0;mode<2;mode++) {
+		double best=0;
+		ogg_int64_t bytes=0;
+		long npackets=0;
+		for (r=0;r<repeats;r++) {
+			double t0=now();
+			double dt;
+			bytes=demux(argv[1],mode,&npackets);
+			if (bytes<0) {
+				fprintf(stderr,"Could not open %s\n",argv[1]);
+				return 1;
+			}
+			dt=now()-t0;
+			if (r==0 || dt<best) best=dt;
+		}
+		fprintf(stdout,"%-6s %lld bytes, %ld packets, %.3f s, %.1f MB/s\n",
+				names[mode],(long long)bytes,npackets,best,
+				best>0?bytes/best/1e6:0.0);
+	}
+	return 0;
+}
@@ -0,0 +1,340 @@
+/*
+ * This file is part of MVTH - the Machine Vision Test Harness.
+ *
+ * Encode reproducible synthetic clips of a few sizes and pixel formats,
+ * then time each stage of getting them onto the screen separately:
+ * demultiplexing, decoding, conversion to RGBA and upload to a photo.
+ *
+ *   tcltheora_bench ?frames? ?directory?
+ *
+ * The clips are written to directory (default $TMPDIR or /tmp) and
+ * removed again. Each result is printed as one line that is a Tcl dict,
+ * so that runs can be compared with a script. The upload time is -1 if
+ * Tk could not be started (no display).
+ *
+ * Copyright (C) 2011 Samuel P. Bromley <sam@sambromley.com>
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License Version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * (see the file named "COPYING"), and a copy of the GNU Lesser General
+ * Public License (see the file named "COPYING.LESSER") along with MVTH.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <tcl.h>
+#include <tk.h>
+#include <ogg/ogg.h>
+#include <theora/theoraenc.h>
+#include <theora/theoradec.h>
+#include "tcltheora.h"
+#include "tcltheora_yuv.h"
+
+/* the clips: every size in every pixel format */
+static const int sizes[][2]={{320,240},{1280,720},{1920,1080}};
+static const struct {int fmt; const char *name;} formats[]={
+	{TH_PF_420,"420"},{TH_PF_422,"422"},{TH_PF_444,"444"}
+};
+
+/* the packets of the one stream in a clip, headers first */
+typedef struct {
+	ogg_packet *packets;
+	int count;
+	int alloc;
+} packetList;
+
+static double now (void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec+ts.tv_nsec*1e-9;
+}
+
+static void write_pages (ogg_stream_state *os, FILE *fp, int flush) {
+	ogg_page og;
+	while (flush?ogg_stream_flush(os,&og):ogg_stream_pageout(os,&og)) {
+		fwrite(og.header,1,og.header_len,fp);
+		fwrite(og.body,1,og.body_len,fp);
+	}
+}
+
+/* a moving pattern with some noise, the same on every run */
+static void make_frame (th_ycbcr_buffer buffer, int f, unsigned int *seed) {
+	int x,y,p;
+	for (p=0;p<3;p++) {
+		th_img_plane *plane=&buffer[p];
+		for (y=0;y<plane->height;y++) {
+			unsigned char *row=plane->data+y*plane->stride;
+			for (x=0;x<plane->width;x++) {
+				*seed=*seed*1103515245u+12345u;
+				if (p==0) row[x]=(unsigned char)(((x+y+4*f)&0xff)^((*seed>>16)&0x0f));
+				else if (p==1) row[x]=(unsigned char)(96+((2*x+f)&0x3f));
+				else row[x]=(unsigned char)(96+((2*y-f)&0x3f));
+			}
+		}
+	}
+}
+
+/* Encode frames frames of the pattern into path. Returns 0 on success. */
+static int encode_clip (const char *path, int width, int height, int fmt,
+		int frames)
+{
+	th_info ti;
+	th_comment tc;
+	th_enc_ctx *enc;
+	th_ycbcr_buffer buffer;
+	ogg_stream_state os;
+	ogg_packet op;
+	unsigned int seed=1;
+	FILE *fp;
+	int f,p,first=1;
+
+	th_info_init(&ti);
+	ti.frame_width=(width+15)&~15;
+	ti.frame_height=(height+15)&~15;
+	ti.pic_width=width;
+	ti.pic_height=height;
+	ti.pic_x=0;
+	ti.pic_y=0;
+	ti.fps_numerator=30;
+	ti.fps_denominator=1;
+	ti.aspect_numerator=1;
+	ti.aspect_denominator=1;
+	ti.colorspace=TH_CS_UNSPECIFIED;
+	ti.pixel_fmt=fmt;
+	ti.target_bitrate=0;
+	ti.quality=48;
+	ti.keyframe_granule_shift=6;
+	enc=th_encode_alloc(&ti);
+	th_info_clear(&ti);
+	if (enc==NULL) return -1;
+	fp=fopen(path,"wb");
+	if (fp==NULL) {
+		th_encode_free(enc);
+		return -1;
+	}
+	ogg_stream_init(&os,1);
+	th_comment_init(&tc);
+	while (th_encode_flushheader(enc,&tc,&op)>0) {
+		ogg_stream_packetin(&os,&op);
+		/* the first header goes on a page of its own */
+		if (first) write_pages(&os,fp,1);
+		first=0;
+	}
+	write_pages(&os,fp,1);
+	th_comment_clear(&tc);
+
+	for (p=0;p<3;p++) {
+		int hs=p && fmt!=TH_PF_444;
+		int vs=p && fmt==TH_PF_420;
+		buffer[p].width=((width+15)&~15)>>hs;
+		buffer[p].height=((height+15)&~15)>>vs;
+		buffer[p].stride=buffer[p].width;
+		buffer[p].data=(unsigned char*)malloc(buffer[p].stride*buffer[p].height);
+	}
+	for (f=0;f<frames;f++) {
+		make_frame(buffer,f,&seed);
+		th_encode_ycbcr_in(enc,buffer);
+		while (th_encode_packetout(enc,f==frames-1,&op)>0) {
+			ogg_stream_packetin(&os,&op);
+		}
+		write_pages(&os,fp,0);
+	}
+	write_pages(&os,fp,1);
+	for (p=0;p<3;p++) free(buffer[p].data);
+	ogg_stream_clear(&os);
+	th_encode_free(enc);
+	fclose(fp);
+	return 0;
+}
+
+/* Pull every page and packet out of path with the package's own reader,
+ * keeping copies of the packets. Returns the number of bytes, or -1. */
+static ogg_int64_t demux_clip (const char *path, packetList *list, double *seconds) {
+	TclTheoraObject tto;
+	ogg_sync_state sync;
+	ogg_page page;
+	ogg_stream_state os;
+	ogg_packet op;
+	int started=0;
+	double t0;
+
+	memset(&tto,0,sizeof(tto));
+	tto.fp=fopen(path,"rb");
+	if (tto.fp==NULL) return -1;
+	ogg_sync_init(&sync);
+	tto.sync_state=&sync;
+	tto.page=&page;
+	t0=now();
+	input_open(&tto,1);
+	while (input_next_page(&tto)==0) {
+		if (!started) {
+			ogg_stream_init(&os,ogg_page_serialno(&page));
+			started=1;
+		}
+		ogg_stream_pagein(&os,&page);
+		while (ogg_stream_packetout(&os,&op)>0) {
+			ogg_packet *copy;
+			if (list->count==list->alloc) {
+				list->alloc=list->alloc?2*list->alloc:64;
+				list->packets=(ogg_packet*)realloc(list->packets,
+						list->alloc*sizeof(ogg_packet));
+			}
+			copy=&list->packets[list->count++];
+			*copy=op;
+			copy->packet=(unsigned char*)malloc(op.bytes>0?op.bytes:1);
+			memcpy(copy->packet,op.packet,op.bytes);
+		}
+	}
+	*seconds=now()-t0;
+	if (started) ogg_stream_clear(&os);
+	input_close(&tto);
+	ogg_sync_clear(&sync);
+	fclose(tto.fp);
+	return tto.sync_offset;
+}
+
+static void free_packets (packetList *list) {
+	int i;
+	for (i=0;i<list->count;i++) free(list->packets[i].packet);
+	free(list->packets);
+	memset(list,0,sizeof(packetList));
+}
+
+/* Start Tk and make a photo to upload into, if there is a display */
+static Tk_PhotoHandle make_photo (Tcl_Interp *interp) {
+	if (Tcl_Init(interp)!=TCL_OK) return NULL;
+	if (Tk_Init(interp)!=TCL_OK) return NULL;
+	if (Tcl_Eval(interp,"wm withdraw .; image create photo bench")!=TCL_OK) return NULL;
+	return Tk_FindPhoto(interp,"bench");
+}
+
+/* Decode, convert and upload every frame, timing each separately */
+static int run_clip (Tcl_Interp *interp, Tk_PhotoHandle photo,
+		packetList *list, double *decode, double *convert, double *upload,
+		int *frames)
+{
+	th_info info;
+	th_comment tc;
+	th_setup_info *setup=NULL;
+	th_dec_ctx *ctx;
+	th_ycbcr_buffer buffer;
+	Tk_PhotoImageBlock block;
+	ogg_int64_t granulepos;
+	int i=0;
+	double t0,t1,t2;
+
+	th_info_init(&info);
+	th_comment_init(&tc);
+	while (i<list->count && th_decode_headerin(&info,&tc,&setup,&list->packets[i])>0) i++;
+	ctx=th_decode_alloc(&info,setup);
+	th_setup_free(setup);
+	th_comment_clear(&tc);
+	if (ctx==NULL) {
+		th_info_clear(&info);
+		return -1;
+	}
+	block.width=info.pic_width;
+	block.height=info.pic_height;
+	block.pitch=4*block.width;
+	block.pixelSize=4;
+	block.offset[0]=0;
+	block.offset[1]=1;
+	block.offset[2]=2;
+	block.offset[3]=3;
+	block.pixelPtr=(unsigned char*)malloc(block.pitch*block.height);
+	if (photo!=NULL) Tk_PhotoSetSize(interp,photo,block.width,block.height);
+
+	*decode=*convert=*upload=0;
+	*frames=0;
+	for (;i<list->count;i++) {
+		t0=now();
+		if (th_decode_packetin(ctx,&list->packets[i],&granulepos)<0) continue;
+		th_decode_ycbcr_out(ctx,buffer);
+		t1=now();
+		ycbcr_to_rgb(&info,buffer,&block);
+		t2=now();
+		*decode+=t1-t0;
+		*convert+=t2-t1;
+		if (photo!=NULL) {
+			Tk_PhotoPutBlock(interp,photo,&block,0,0,block.width,block.height,
+					TK_PHOTO_COMPOSITE_SET);
+			*upload+=now()-t2;
+		}
+		(*frames)++;
+	}
+	free(block.pixelPtr);
+	th_decode_free(ctx);
+	th_info_clear(&info);
+	return 0;
+}
+
+int main (int argc, char *argv[]) {
+	const char *dir=getenv("TMPDIR");
+	char path[4096];
+	Tcl_Interp *interp;
+	Tk_PhotoHandle photo;
+	int nframes=60;
+	int s,f;
+
+	if (argc>1) nframes=atoi(argv[1]);
+	if (argc>2) dir=argv[2];
+	if (dir==NULL) dir="/tmp";
+	if (nframes<1) nframes=1;
+
+	Tcl_FindExecutable(argv[0]);
+	interp=Tcl_CreateInterp();
+	photo=make_photo(interp);
+	fprintf(stdout,"kernel %s theora {%s} upload %s\n",ycbcr_kernel_name(),
+			th_version_string(),photo!=NULL?"tk":"none");
+
+	for (s=0;s<(int)(sizeof(sizes)/sizeof(sizes[0]));s++) {
+		for (f=0;f<(int)(sizeof(formats)/sizeof(formats[0]));f++) {
+			int w=sizes[s][0],h=sizes[s][1];
+			packetList list;
+			ogg_int64_t bytes;
+			double demux,decode,convert,upload;
+			int frames;
+
+			snprintf(path,sizeof(path),"%s/tcltheora_bench_%d_%dx%d_%s.ogv",dir,
+					(int)getpid(),w,h,formats[f].name);
+			if (encode_clip(path,w,h,formats[f].fmt,nframes)!=0) {
+				fprintf(stderr,"Could not encode %s\n",path);
+				continue;
+			}
+			memset(&list,0,sizeof(list));
+			bytes=demux_clip(path,&list,&demux);
+			unlink(path);
+			if (bytes<0 || run_clip(interp,photo,&list,&decode,&convert,&upload,
+						&frames)!=0 || frames==0) {
+				fprintf(stderr,"Could not decode %s\n",path);
+				free_packets(&list);
+				continue;
+			}
+			fprintf(stdout,"size %dx%d format %s frames %d bytes %lld"
+					" demuxMBps %.1f decodeFps %.1f convertMpixps %.1f uploadMs %.3f\n",
+					w,h,formats[f].name,frames,(long long)bytes,
+					demux>0?bytes/demux/1e6:0.0,
+					decode>0?frames/decode:0.0,
+					convert>0?(double)w*h*frames/convert/1e6:0.0,
+					photo!=NULL?upload/frames*1000.0:-1.0);
+			fflush(stdout);
+			free_packets(&list);
+		}
+	}
+	Tcl_DeleteInterp(interp);
+	return 0;
+}